@@ -342,6 +342,32 @@ double HostClockTime() {
     return double(count.QuadPart-ClockBase.QuadPart)/ClockFreq.QuadPart; 
 }
 
+void HostSetRealTimeThreadPriority() {
+    BOOL status = SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+    Assert(status);
+}
+
+HostSemaphore* HostCreateSemaphore() {
+    HANDLE h = CreateSemaphoreA( NULL, 0, MAXLONG, NULL );
+    Assert(h);
+    return (HostSemaphore*)h;
+}
+
+void HostDestroySemaphore( HostSemaphore* s ) {
+    BOOL status = CloseHandle( (HANDLE)s );
+    Assert(status);
+}
+
+void HostSignalSemaphore( HostSemaphore* s, unsigned n ) {
+    BOOL status = ReleaseSemaphore( (HANDLE)s, LONG(n), NULL );
+    Assert(status);
+}
+
+void HostWaitSemaphore( HostSemaphore* s ) {
+    DWORD status = WaitForSingleObject( (HANDLE)s, INFINITE );
+    Assert(status==WAIT_OBJECT_0);
+}
+
 bool HostIsKeyDown( int key ) {
     switch( key ) {
         case HOST_KEY_LEFT:  key=VK_LEFT;  break;
@@ -547,6 +573,56 @@ void HostShowCursor( bool show ) {
     }
 }
 
+const char* HostMapFile( const char* filename, size_t& size ) {
+    size = 0;
+    HANDLE f = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    if( f==INVALID_HANDLE_VALUE )
+        return NULL;
+    const char* data = NULL;
+    LARGE_INTEGER s;
+    if( GetFileSizeEx(f,&s) && s.QuadPart>0 && ULONGLONG(s.QuadPart)<=ULONGLONG(~size_t(0)) ) {
+        HANDLE m = CreateFileMappingA( f, NULL, PAGE_READONLY, 0, 0, NULL );
+        if( m ) {
+            data = (const char*)MapViewOfFile( m, FILE_MAP_READ, 0, 0, 0 );
+            if( data )
+                size = size_t(s.QuadPart);
+            // The view keeps the mapping alive.
+            CloseHandle(m);
+        }
+    }
+    CloseHandle(f);
+    return data;
+}
+
+void HostUnmapFile( const char* data ) {
+    BOOL status = UnmapViewOfFile(data);
+    Assert(status);
+}
+
+bool HostGetFileInfo( const char* filename, uint64_t& size, uint64_t& modifyTime ) {
+    WIN32_FILE_ATTRIBUTE_DATA d;
+    if( !GetFileAttributesExA( filename, GetFileExInfoStandard, &d ) )
+        return false;
+    size = uint64_t(d.nFileSizeHigh)<<32 | d.nFileSizeLow;
+    modifyTime = uint64_t(d.ftLastWriteTime.dwHighDateTime)<<32 | d.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+void HostPrefetchFile( const char* data, size_t size ) {
+    // PrefetchVirtualMemory exists only on Windows 8 and later, so look it up at run time.
+    // Same layout as WIN32_MEMORY_RANGE_ENTRY, which the headers declare only for Windows 8 targets.
+    struct rangeEntry {
+        PVOID address;
+        SIZE_T size;
+    };
+    typedef BOOL (WINAPI *prefetchType)( HANDLE, ULONG_PTR, rangeEntry*, ULONG );
+    static prefetchType prefetch = (prefetchType)GetProcAddress( GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory" );
+    if( prefetch && size>0 ) {
+        rangeEntry r = {(PVOID)data, size};
+        prefetch( GetCurrentProcess(), 1, &r, 0 );
+    }
+}
+
 void HostWarning( const char* message ) {
     D3DPRESENT_PARAMETERS present;
     if( ExclusiveMode ) {
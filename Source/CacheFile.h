@@ -0,0 +1,61 @@
+/******************************************************************************
+ Helpers for cache files that are mapped and used in place.
+
+ A cache file is a header followed by sections of fixed-size records.  Each section
+ is aligned on an 8-byte boundary and described in the header by a CacheSectionInfo.
+*******************************************************************************/
+
+#ifndef CacheFile_H
+#define CacheFile_H
+
+#include <cstdint>
+#include <cstdio>
+#include "MappedFile.h"
+
+//! Location of a section in the cache file.
+struct CacheSectionInfo {
+    uint64_t offset;            //!< Offset from start of cache file
+    uint64_t count;             //!< Number of records, not counting any extra records that follow them
+};
+
+//! Pointer to the records of section s of cache file f, or NULL if the section is misaligned or does not fit.
+/** The section must have room for extra records after its s.count records. */
+template<typename T>
+const T* CacheSectionBegin( const MappedFile& f, const CacheSectionInfo& s, size_t extra=0 ) {
+    if( s.offset%8!=0 || s.offset>f.size() || s.count>f.size() || (f.size()-s.offset)/sizeof(T)<s.count+extra )
+        return NULL;
+    return (const T*)(f.begin()+s.offset);
+}
+
+//! Writes sections of a cache file, keeping track of their offsets.
+class CacheWriter {
+    FILE* myFile;
+    uint64_t myOffset;
+    bool myOkay;
+public:
+    CacheWriter( FILE* f, uint64_t offset ) : myFile(f), myOffset(offset), myOkay(true) {}
+    bool okay() const {return myOkay;}
+    void write( const void* data, size_t size ) {
+        if( myOkay && size>0 && fwrite(data,size,1,myFile)!=1 )
+            myOkay = false;
+        myOffset += size;
+    }
+    //! Start a section of count records, and record its location in s.  The caller must write the records.
+    void beginSection( CacheSectionInfo& s, size_t count ) {
+        static const char zeros[8] = {};
+        write( zeros, size_t((8-myOffset%8)%8) );
+        s.offset = myOffset;
+        s.count = count;
+    }
+    //! Write a section of count records, followed by extra records.
+    void writeSection( CacheSectionInfo& s, const void* data, size_t count, size_t extra, size_t recordSize ) {
+        beginSection( s, count );
+        write( data, (count+extra)*recordSize );
+    }
+    template<typename T, size_t E>
+    void writeSection( CacheSectionInfo& s, const SimpleArray<T,E>& a ) {
+        writeSection( s, a.begin(), a.size(), E, sizeof(T) );
+    }
+};
+
+#endif /* CacheFile_H */
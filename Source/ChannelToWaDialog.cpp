@@ -35,10 +35,10 @@ static std::string GetSimpleName( const std::string& s ) {
     return s.substr(i,j-i);
 }
 
-void ChannelToWaDialog::setFromTune( const Midi::Tune& tune ) {
+void ChannelToWaDialog::setFromChannels( const Midi::ChannelMap& channels ) {
 	Assert(myItems.empty());
-    for( size_t i=0, n=tune.channels().size(); i<n; ++i ) {
-        const Midi::Channel& c = tune.channels()[i];
+    for( size_t i=0, n=channels.size(); i<n; ++i ) {
+        const Midi::Channel& c = channels[i];
         if( !c.isDrum() ) {
             channelOrSoundSet tw(false, c.name());
             tw.channel = i;
@@ -67,17 +67,28 @@ void ChannelToWaDialog::addChannel( const std::string& name, Midi::Event::channe
     myItems.push_back(item);
 }
 
-void ChannelToWaDialog::setupOrchestra(Midi::Orchestra& player) {
-     Synthesizer::SoundSet* s = nullptr;
+void ChannelToWaDialog::getSoundSets(std::vector<const Synthesizer::SoundSet*>& soundSets) const {
+    soundSets.clear();
+    const Synthesizer::SoundSet* s = nullptr;
     for( const channelOrSoundSet& i : myItems )
         if( i.isSoundSet ) {
             // WaSet to use for subsquent channels, until another WaSet is seen.
             s = TheSoundSetCollection.find(i.name);
         } else {
             if( s ) {
-                player.setInstrument(i.channel, s->makeInstrument());
+                if( soundSets.size()<=i.channel )
+                    soundSets.resize(i.channel+1, nullptr);
+                soundSets[i.channel] = s;
             } else {
                 // No Waset specified
             }
         }
 }
+
+void ChannelToWaDialog::setupOrchestra(Midi::Orchestra& player) {
+    std::vector<const Synthesizer::SoundSet*> soundSets;
+    getSoundSets(soundSets);
+    for( size_t k=0; k<soundSets.size(); ++k )
+        if( soundSets[k] )
+            player.setInstrument(Midi::Event::channelType(k), soundSets[k]->makeInstrument());
+}
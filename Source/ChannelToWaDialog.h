@@ -51,8 +51,8 @@ public:
 	//! If a waSet is highlighted, return a pointer to a string with its name.  Otherwise return NULL.
     const std::string* hilightedWaSet( Hue h ) const;
 
-	//! Set entries from given tune.  Clears waSet entries.
-    void setFromTune( const Midi::Tune& tune );
+	//! Set entries from channels of a tune.  Clears waSet entries.
+    void setFromChannels( const Midi::ChannelMap& channels );
 
     //! Add a WaSet to end.  path is the path to the .wav file.  Returns name of the WaSet.
     std::string addWaSet( const std::string& path );
@@ -74,6 +74,9 @@ public:
             f(item.isSoundSet, item.name);
     }
 
+    //! Set soundSets[k] to the SoundSet assigned to channel k, or nullptr if none is assigned.
+    void getSoundSets( std::vector<const Synthesizer::SoundSet*>& soundSets ) const;
+
 	void setupOrchestra( Midi::Orchestra& orchestra );
 };
 
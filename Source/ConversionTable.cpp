@@ -0,0 +1,26 @@
+#include "ConversionTable.h"
+#include <cmath>
+
+namespace Synthesizer {
+
+float NoteFrequencyTable[128];
+float OctaveRatioTable[2*CentsLimit/1200];
+float CentRatioTable[1200];
+float CentibelGainTable[CentibelsLimit+1];
+
+static struct ConversionTableInit {
+    ConversionTableInit();
+} TheConversionTableInit;
+
+ConversionTableInit::ConversionTableInit() {
+    for( int i=0; i<128; ++i )
+        NoteFrequencyTable[i] = float(440*std::pow(2.0,(i-69)/12.0));
+    for( int i=0; i<2*CentsLimit/1200; ++i )
+        OctaveRatioTable[i] = float(std::ldexp(1.0,i-CentsLimit/1200));
+    for( int i=0; i<1200; ++i )
+        CentRatioTable[i] = float(std::pow(2.0,i/1200.0));
+    for( int i=0; i<=CentibelsLimit; ++i )
+        CentibelGainTable[i] = float(std::pow(10.0,-i/200.0));
+}
+
+} // namespace Synthesizer
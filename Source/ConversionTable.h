@@ -0,0 +1,72 @@
+#ifndef ConversionTable_H
+#define ConversionTable_H
+
+#include "AssertLib.h"
+#include <cmath>
+
+namespace Synthesizer {
+
+// Tables for converting MIDI and SoundFont units to linear quantities, so that note-on does no transcendental math.
+// They are filled during static initialization, so do not use them from the constructor of a static object.
+
+//! Cents magnitude for which CentsToRatio must be defined.  Covers the sum of two 16-bit timecent values.
+const int CentsLimit = 64*1200;
+
+//! Largest attenuation in centibels that CentibelsToGain distinguishes from silence, per the SoundFont 2.01 spec.
+const int CentibelsLimit = 1440;
+
+extern float NoteFrequencyTable[128];
+extern float OctaveRatioTable[2*CentsLimit/1200];
+extern float CentRatioTable[1200];
+extern float CentibelGainTable[CentibelsLimit+1];
+
+//! Frequency in hertz of MIDI note, for A4=440 Hz.
+inline float NoteToFrequency( unsigned note ) {
+    Assert( note<128 );
+    return NoteFrequencyTable[note];
+}
+
+//! Return 2^(cents/1200).
+inline float CentsToRatio( int cents ) {
+    Assert( -CentsLimit<=cents && cents<CentsLimit );
+    unsigned c = cents+CentsLimit;
+    return OctaveRatioTable[c/1200]*CentRatioTable[c%1200];
+}
+
+//! Return seconds for SoundFont timecents.  Same formula as CentsToRatio.
+inline float TimecentsToSeconds( int timecents ) {
+    return CentsToRatio(timecents);
+}
+
+//! Return linear gain for an attenuation in centibels.  Attenuation beyond CentibelsLimit is treated as CentibelsLimit.
+inline float CentibelsToGain( int centibels ) {
+    Assert( centibels>=0 );
+    return CentibelGainTable[centibels<CentibelsLimit ? centibels : CentibelsLimit];
+}
+
+//! Set left and right to the gains for a source at (x,y), where the ears are at (-1,0) and (1,0).
+/** Equivalent to cos(atan2(y,-x)/2) and cos(atan2(y,x)/2), via the half-angle identity cos(a/2)=sqrt((1+cos a)/2). */
+inline void PanGain( float x, float y, float& left, float& right ) {
+    float r = std::sqrt(x*x+y*y);
+    if( r==0 ) {
+        // Same as the formula with atan2.
+        left = 0;
+        right = 1;
+        return;
+    }
+    float ax = std::fabs(x);
+    float nearGain = std::sqrt((r+ax)/(2*r));
+    // Computes sqrt((r-|x|)/(2r)) without cancellation, since r-|x| = y*y/(r+|x|).
+    float farGain = std::fabs(y)/std::sqrt(2*r*(r+ax));
+    if( x>=0 ) {
+        left = farGain;
+        right = nearGain;
+    } else {
+        left = nearGain;
+        right = farGain;
+    }
+}
+
+} // namespace Synthesizer
+
+#endif /* ConversionTable_H */
@@ -1,8 +1,15 @@
 #include "DefaultSoundSet.h"
 #include "ReadError.h"
 #include "SF2Bank.h"
+#include "Synthesizer.h"
 #include <cerrno>
 #include <cstdio>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
 
 static void SkipSpace( char*& p ) {
     while( isspace(*p) )
@@ -44,33 +51,198 @@ enum class BankKind {
 
 static SF2Bank TheDefaultBank;
 
-void ReadSF2( const std::string& path ) {
-    TheDefaultBank.load(path);
-}
-
 struct SF2Info {
     std::string subpath;
-    Synthesizer::SoundSet* soundSet;
-    SF2Info() : soundSet(nullptr) {}
+    SF2SoundSet* soundSet;
+    //! True while some thread is creating soundSet.
+    bool isLoading;
+    SF2Info() : soundSet(nullptr), isLoading(false) {}
 };
 
 static SF2Info SF2Cache[256];
 
+//! Guards SF2Cache and the Preload variables.
+static std::mutex SF2CacheMutex;
+//! Signaled when an SF2Cache entry stops loading, or a preload worker exits.
+static std::condition_variable SF2CacheChanged;
+//! MIDI numbers waiting for a preload worker.
+static std::vector<unsigned> PreloadQueue;
+static unsigned PreloadTotal, PreloadDone, PreloadWorkerCount;
+//! Threads started by PreloadDefaultSoundSets that have not been joined.
+static std::vector<std::thread> PreloadWorkers;
+//! True while a thread is writing the cache for TheDefaultBank.
+static bool CacheWriterBusy;
+//! Thread that writes the cache for TheDefaultBank, if it has not been joined.
+static std::thread CacheWriterThread;
+//! Set to make the cache writer give up.
+static std::atomic<bool> CacheWriterCancel;
+
+static SF2SoundSet* CreateDefaultSoundSet( unsigned midiNumber ) {
+    if( midiNumber>=128 ) 
+        return TheDefaultBank.createSoundSet(midiNumber-128,/*bank=*/1);
+    else
+        return TheDefaultBank.createSoundSet(midiNumber,/*bank=*/0);
+}
+
+static void WriteCache( std::string cachePath ) {
+    TheDefaultBank.writeCache(cachePath,&CacheWriterCancel);
+    std::lock_guard<std::mutex> lock(SF2CacheMutex);
+    CacheWriterBusy = false;
+    SF2CacheChanged.notify_all();
+}
+
+//! Drop the preloads that no worker has started, and wait for the workers to exit.  The lock must be held.
+static void StopPreloadWorkers( std::unique_lock<std::mutex>& lock ) {
+    for( unsigned m: PreloadQueue ) 
+        SF2Cache[m].isLoading = false;
+    PreloadTotal -= unsigned(PreloadQueue.size());
+    PreloadQueue.clear();
+    SF2CacheChanged.notify_all();
+    SF2CacheChanged.wait( lock, []{return PreloadWorkerCount==0;} );
+    // Each worker holds the lock from decrementing PreloadWorkerCount until it returns, so none needs the lock now.
+    for( auto& t: PreloadWorkers )
+        t.join();
+    PreloadWorkers.clear();
+}
+
+//! Wait for the cache writer to finish, and join it.  The lock must be held.
+static void JoinCacheWriter( std::unique_lock<std::mutex>& lock ) {
+    SF2CacheChanged.wait( lock, []{return !CacheWriterBusy;} );
+    // As for the preload workers, the writer holds the lock from clearing CacheWriterBusy until it returns.
+    if( CacheWriterThread.joinable() )
+        CacheWriterThread.join();
+}
+
+//! Stops the background threads at exit, before the statics that they use are destroyed.
+static struct BackgroundThreadStopper {
+    ~BackgroundThreadStopper() {
+        std::unique_lock<std::mutex> lock(SF2CacheMutex);
+        StopPreloadWorkers(lock);
+        // A partial cache is removed, and written again on the next run.
+        CacheWriterCancel = true;
+        JoinCacheWriter(lock);
+    }
+} TheBackgroundThreadStopper;
+
+void ReadSF2( const std::string& path ) {
+    std::unique_lock<std::mutex> lock(SF2CacheMutex);
+    // Loading would pull the bank out from under the workers.
+    StopPreloadWorkers(lock);
+    // The cache of the previous bank is not worth waiting for.  A partial one is removed, and written again on its next load.
+    CacheWriterCancel = true;
+    JoinCacheWriter(lock);
+    // Voices view samples of the bank being replaced.  Let them finish before freeing anything they view.
+    while( Synthesizer::ActiveVoiceCount()!=0 )
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    for( auto& rec: SF2Cache ) {
+        Assert(!rec.isLoading);
+        delete rec.soundSet;
+        rec.soundSet = nullptr;
+    }
+    std::string cachePath = path+".cache";
+    if( !TheDefaultBank.loadCache(path,cachePath) ) {
+        TheDefaultBank.load(path,/*mapSamples=*/true);
+        // Write the cache in the background, since it requires building every mip level.
+        CacheWriterBusy = true;
+        CacheWriterCancel = false;
+        CacheWriterThread = std::thread(WriteCache,cachePath);
+    }
+}
+
 Synthesizer::SoundSet* GetDefaultSoundSet( unsigned midiNumber ) {
 #if 0
     midiNumber = 57;    // Force to trombone
 #endif
     Assert(midiNumber<256);
+    std::unique_lock<std::mutex> lock(SF2CacheMutex);
     auto& rec = SF2Cache[midiNumber];
+    // A preload worker might be creating it.
+    SF2CacheChanged.wait( lock, [&]{return !rec.isLoading;} );
     if( !rec.soundSet && !TheDefaultBank.empty() ) {
-        if( midiNumber>=128 ) {
-            rec.soundSet = TheDefaultBank.createSoundSet(midiNumber-128,/*bank=*/1);
-        } else
-            rec.soundSet = TheDefaultBank.createSoundSet(midiNumber,/*bank=*/0);
+        rec.isLoading = true;
+        lock.unlock();
+        SF2SoundSet* s;
+        try {
+            s = CreateDefaultSoundSet(midiNumber);
+        } catch( ... ) {
+            // Let other threads waiting for rec try for themselves.
+            lock.lock();
+            rec.isLoading = false;
+            SF2CacheChanged.notify_all();
+            throw;
+        }
+        lock.lock();
+        rec.soundSet = s;
+        rec.isLoading = false;
+        SF2CacheChanged.notify_all();
     }
     return rec.soundSet;
 }
 
+static void PreloadWorker() {
+    std::unique_lock<std::mutex> lock(SF2CacheMutex);
+    while( !PreloadQueue.empty() ) {
+        unsigned midiNumber = PreloadQueue.back();
+        PreloadQueue.pop_back();
+        auto& rec = SF2Cache[midiNumber];
+        lock.unlock();
+        SF2SoundSet* s = nullptr;
+        try {
+            s = CreateDefaultSoundSet(midiNumber);
+        } catch( ... ) {
+            // Leave it to GetDefaultSoundSet to try again and report the error.
+        }
+        lock.lock();
+        rec.soundSet = s;
+        rec.isLoading = false;
+        ++PreloadDone;
+        SF2CacheChanged.notify_all();
+    }
+    --PreloadWorkerCount;
+    SF2CacheChanged.notify_all();
+}
+
+void PreloadDefaultSoundSets( const std::vector<unsigned>& midiNumbers ) {
+    std::unique_lock<std::mutex> lock(SF2CacheMutex);
+    if( TheDefaultBank.empty() )
+        return;
+    if( PreloadWorkerCount==0 && !PreloadWorkers.empty() )
+        // Reap the workers of previous preloads.
+        StopPreloadWorkers(lock);
+    if( PreloadQueue.empty() && PreloadWorkerCount==0 ) 
+        // Previous preloads are finished, so start counting progress afresh.
+        PreloadTotal = PreloadDone = 0;
+    for( unsigned m: midiNumbers ) {
+        Assert(m<256);
+        auto& rec = SF2Cache[m];
+        if( !rec.soundSet && !rec.isLoading ) {
+            rec.isLoading = true;
+            PreloadQueue.push_back(m);
+            ++PreloadTotal;
+        }
+    }
+    // Leave one hardware thread for the user interface.
+    unsigned h = std::thread::hardware_concurrency();
+    unsigned n = h>1 ? h-1 : 1;
+    while( PreloadWorkerCount<Min(n,unsigned(PreloadQueue.size())) ) {
+        ++PreloadWorkerCount;
+        PreloadWorkers.push_back(std::thread(PreloadWorker));
+    }
+}
+
+bool IsDefaultSoundSetReady( unsigned midiNumber ) {
+    Assert(midiNumber<256);
+    std::lock_guard<std::mutex> lock(SF2CacheMutex);
+    return !SF2Cache[midiNumber].isLoading;
+}
+
+bool GetDefaultSoundSetPreloadProgress( unsigned& done, unsigned& total ) {
+    std::lock_guard<std::mutex> lock(SF2CacheMutex);
+    done = PreloadDone;
+    total = PreloadTotal;
+    return done==total;
+}
+
 // All GUS Patch stuff to be deleted.
 static std::string FreePatDir;
 
@@ -1,6 +1,21 @@
 #include <string>
 #include "Orchestra.h"
 
+#include <vector>
+
+//! Load the SoundFont used for default SoundSets.  SoundSets gotten from a previous SoundFont are deleted.
+/** The caller must first destroy every Instrument made from those SoundSets, so that their voices are released.
+    Waits for sounding voices to finish, since they view samples of the previous SoundFont.
+    Uses the cache path+".cache" if it is up to date.  Otherwise parses the SoundFont and starts writing the cache. */
 void ReadSF2( const std::string& path );
 void ReadFreePatConfig( const std::string& path );
-Synthesizer::SoundSet* GetDefaultSoundSet( unsigned midiNumber );
\ No newline at end of file
+//! Get default SoundSet for a MIDI program number, or for 128+note for a drum kit.  Returns nullptr if there is none.
+/** Creates the SoundSet on first use, or waits for a preload of it to finish. */
+Synthesizer::SoundSet* GetDefaultSoundSet( unsigned midiNumber );
+//! Start creating the default SoundSets for the given MIDI numbers on worker threads.
+/** Numbers that are already created or being created are skipped. */
+void PreloadDefaultSoundSets( const std::vector<unsigned>& midiNumbers );
+//! True if GetDefaultSoundSet(midiNumber) would not have to wait for a preload.
+bool IsDefaultSoundSetReady( unsigned midiNumber );
+//! Set done and total to counts of SoundSets preloaded since preloading was last idle.  Returns true if done==total.
+bool GetDefaultSoundSetPreloadProgress( unsigned& done, unsigned& total );
\ No newline at end of file
@@ -13,6 +13,8 @@
 #include "FileSuffix.h"
 #include "Midi.h"
 #include "Orchestra.h"
+#include "OfflineRender.h"
+#include "WavWriter.h"
 #include "Synthesizer.h"
 #include "ChannelToWaDialog.h"
 #include "DefaultSoundSet.h"
@@ -29,7 +31,11 @@ static std::ofstream GameLog("C:\\tmp\\gamelog.txt");
 static Midi::Orchestra TheOrchestra;
 static double OrchestraZeroTime;
 
+//! True if PlayTune is waiting for default sound sets before commencing.
+static bool OrchestraPending;
+
 static void StopOrchestra() {
+    OrchestraPending = false;
     if(OrchestraZeroTime!=0) {
         TheOrchestra.stop();
         OrchestraZeroTime = 0;
@@ -38,6 +44,20 @@ static void StopOrchestra() {
 
 static std::string TheMidiTuneFileName;  // If empty, then not yet set
 static Midi::Tune TheMidiTune;
+//! Used instead of TheMidiTune for MIDI files too big to hold in memory.
+static Midi::TuneStream TheMidiStream;
+
+//! MIDI files bigger than this many bytes are streamed.
+static const uint64_t StreamMidiFileSize = 64<<20;
+
+static bool HaveMidiTune() {
+    return !TheMidiTune.empty() || !TheMidiStream.empty();
+}
+
+//! Channels of the MIDI tune, whether streamed or not.
+static const Midi::ChannelMap& TheMidiChannels() {
+    return TheMidiStream.empty() ? TheMidiTune.channels() : TheMidiStream.channels();
+}
 ChannelToWaDialog TheChannelToWaDialog;
 WaPlot TheWaPlot;                               // Not static, because it is referenced in VoiceInput.cpp
 
@@ -47,7 +67,16 @@ void InitializeMidi( const char* filename ) {
 }
 #endif
 
+static void CommenceTune() {
+    OrchestraPending = false;
+    SetOutputInterruptHandler(Synthesizer::OutputInterruptHandler);
+    TheOrchestra.commencePlay();
+    OrchestraZeroTime = HostClockTime();
+}
+
 static void MidiUpdate() {
+    if(OrchestraPending && TheOrchestra.isReadyToCommence())
+        CommenceTune();
     if(OrchestraZeroTime)
         TheOrchestra.update(HostClockTime()-OrchestraZeroTime);
 }
@@ -67,30 +96,73 @@ static void CopyWaSetToWaPlot(WaPlot& plot, std::string name, const WaSet& w) {
     });
 }
 
-static void ReadMidiTune(const char* filename) {
+//! Name of the file that caches the parsed MIDI tune of a project.
+static std::string TuneCacheFileName(const std::string& projectFileName) {
+    return projectFileName + ".tune";
+}
+
+//! Read a MIDI file.  If cacheFilename is not empty, try it first, and write it if it cannot be used.
+/** Very big files are streamed instead, and neither cached nor plotted. */
+static void ReadMidiTune(const char* filename, const std::string& cacheFilename=std::string()) {
     // Make sure player is stopped.
     StopOrchestra();
-    if( TheMidiTune.readFromFile(filename) ) {
+    uint64_t size, modifyTime;
+    bool stream = HostGetFileInfo(filename, size, modifyTime) && size>StreamMidiFileSize;
+    bool okay;
+    if( stream ) {
+        TheMidiTune.clear();
+        okay = TheMidiStream.open(filename);
+    } else {
+        TheMidiStream.close();
+        okay = !cacheFilename.empty() && TheMidiTune.loadCache(filename, cacheFilename);
+        if( !okay ) {
+            okay = TheMidiTune.readFromFile(filename);
+            if( okay && !cacheFilename.empty() )
+                // Failure to write the cache just makes the next open slower.
+                TheMidiTune.writeCache(cacheFilename);
+        }
+    }
+    if( okay ) {
         TheMidiTuneFileName = filename;
         TheChannelToWaDialog.clear();
-        TheChannelToWaDialog.setFromTune(TheMidiTune);
-        CopyTuneToWaPlot(TheWaPlot,TheMidiTune);
+        TheChannelToWaDialog.setFromChannels(TheMidiChannels());
+        if( stream )
+            TheWaPlot.clear();
+        else
+            CopyTuneToWaPlot(TheWaPlot,TheMidiTune);
     } else {
         // FIXME - HostWarning will exit
-        HostWarning(TheMidiTune.readStatus().c_str());
+        HostWarning((stream ? TheMidiStream.readStatus() : TheMidiTune.readStatus()).c_str());
     }
 }
 
-static void PlayTune(bool live=true) {
-    if( TheMidiTune.empty() ) 
+//! Start playing the MIDI tune.  Playing commences once the default sound sets it needs are loaded.
+static void PlayTune() {
+    if( !HaveMidiTune() ) 
         return;
-    if( live )
-        SetOutputInterruptHandler(Synthesizer::OutputInterruptHandler);
-    TheOrchestra.preparePlay(TheMidiTune);
+    StopOrchestra();
+    if( TheMidiStream.empty() )
+        TheOrchestra.preparePlay(TheMidiTune);
+    else
+        TheOrchestra.preparePlay(TheMidiStream);
     TheChannelToWaDialog.setupOrchestra(TheOrchestra);
-    TheOrchestra.commencePlay();
-    if( live )
-        OrchestraZeroTime = HostClockTime();
+    if( TheOrchestra.isReadyToCommence() )
+        CommenceTune();
+    else
+        OrchestraPending = true;
+}
+
+//! Move the playing position of the tune by delta seconds.
+static void SeekTune(double delta) {
+    if( !OrchestraZeroTime )
+        // Not playing
+        return;
+    if( !TheOrchestra.canSeek() )
+        // Streamed tune.  Seeking would stall the UI while the stream is parsed up to the time sought.
+        return;
+    double t = std::max(0.0, HostClockTime()-OrchestraZeroTime+delta);
+    TheOrchestra.seek(t);
+    OrchestraZeroTime = HostClockTime()-t;
 }
 
 const char* GameTitle() {
@@ -108,7 +180,8 @@ static std::string CurrentProjectFileName;
     The first character denotes the type of line.
     m: .* denotes a midi file.  This line must come first.
     s: .* denotes a SoundSet file (WaSet or Patch)
-    c: .* denotes a MIDI track name.  (Use canonical synthetic one if track has no name) */
+    c: .* denotes a MIDI track name.  (Use canonical synthetic one if track has no name) 
+    The parsed MIDI file is cached alongside the project, in the file named by TuneCacheFileName. */
 static void OpenWacoderProject(const std::string& filename) {
 #if GAME_LOG
     GameLog << "enter OpenWacoderProject(" << filename << ")\n" << std::flush;
@@ -131,14 +204,14 @@ static void OpenWacoderProject(const std::string& filename) {
                     Assert(0);
                     break;
                 case 'm':
-                    ReadMidiTune(path);
+                    ReadMidiTune(path, TuneCacheFileName(filename));
                     break;
                 case 's':
                     TheSoundSetCollection.addSoundSet(TheChannelToWaDialog.addWaSet(path), path);
                     break;
                 case 'c': {
-                    unsigned channel = TheMidiTune.channels().findByName(path);
-                    if( channel<TheMidiTune.channels().size() )
+                    unsigned channel = TheMidiChannels().findByName(path);
+                    if( channel<TheMidiChannels().size() )
                         TheChannelToWaDialog.addChannel(path, channel);
                     break;
                 }
@@ -175,6 +248,9 @@ static void SaveWacoderProject(const std::string& filename) {
         f << s << std::endl;
     });
     f.close();
+    // Cache the tune so that the next open of the project does not have to parse the MIDI file.
+    // A streamed tune is not cached, and TheMidiTune is empty, so this does nothing.
+    TheMidiTune.writeCache(TuneCacheFileName(CurrentProjectFileName));
 }
 
 static void SaveWacoderProject() {
@@ -194,29 +270,30 @@ static void SaveWacoderProject() {
 }
 
 static void WritePerformance() {
+    if( !HaveMidiTune() ) 
+        return;
     std::string s = HostGetFileName(GetFileNameOp::create, "WAV output", "wav");
+    if( s.empty() )
+        return;
+    StopOrchestra();
     SetOutputInterruptHandler(nullptr);
-    PlayTune(false);
-    std::vector<float> v;
-    for(unsigned i=0; !TheOrchestra.isEndOfTune(); ++i) {
-        const int rate = 60;
-        const size_t n = NimbleSoundSamplesPerSec/rate;
-        Assert(n*rate==NimbleSoundSamplesPerSec);
-        TheOrchestra.update(i/double(rate));
-        float channel[2][n];
-        memset(channel,0,sizeof(channel));
-        Synthesizer::OutputInterruptHandler(channel[0], channel[1], n);
-        size_t m = v.size();
-        v.resize(m+n);
-        std::copy(channel[1]+0, channel[1]+n, v.begin()+m);
+    std::vector<const Synthesizer::SoundSet*> soundSets;
+    TheChannelToWaDialog.getSoundSets(soundSets);
+    // Normalize so that the loudest sample is at full scale, as the old in-memory writer did.
+    Synthesizer::WavWriter w(s.c_str(), Synthesizer::WavFormat::int16, true, 1.0f);
+    if( !w.isOpen() ) {
+        HostWarning(("Cannot create " + s).c_str());
+        return;
     }
-    float a = 0;
-    for( auto sample: v )
-        a = std::max(a,std::fabs(sample));
-    Synthesizer::Waveform w(v.size());
-    for(unsigned k=0; k<v.size(); ++k )
-        w[k] = v[k]/a;
-    w.writeToFile(s.c_str());
+    Midi::OfflineRenderStats stats = TheMidiStream.empty() ? Midi::RenderOffline(TheMidiTune, soundSets, w)
+                                                           : Midi::RenderOffline(TheMidiStream, soundSets, w);
+#if GAME_LOG
+    GameLog << "rendered " << stats.samples << " samples in " << stats.seconds << " sec (" 
+            << stats.realTimeFactor() << "x real time)\n" << std::flush;
+#endif
+    (void)stats;
+    if( !w.close() )
+        HostWarning(("Error writing " + s).c_str());
 }
 
 bool GameInitialize() {
@@ -303,6 +380,12 @@ void GameKeyDown( int key ) {
         case 'w'&0x1F:
             WritePerformance();
             break;
+        case HOST_KEY_LEFT:
+            SeekTune(-10);
+            break;
+        case HOST_KEY_RIGHT:
+            SeekTune(10);
+            break;
 #if 1 // For development only 
         case 'm':  
 		    PlayTune();
@@ -360,7 +443,12 @@ void GameUpdateDraw( NimblePixMap& screen, NimbleRequest request ) {
         DrawClickable( TheChannelToWaDialog, screen, x, InputVolumeMeter.height() );
         screen.draw(NimbleRect(x,0,x+1,screen.height()), NimbleColor(128).pixel());
         extern float VoicePeak;
-        InputVolumeMeter.setLevel(Min(1.0f,VoicePeak));
+        unsigned done, total;
+        if( OrchestraPending && !GetDefaultSoundSetPreloadProgress(done,total) )
+            // Show loading progress instead of input volume while waiting to play.
+            InputVolumeMeter.setLevel(float(done)/total);
+        else
+            InputVolumeMeter.setLevel(Min(1.0f,VoicePeak));
         InputVolumeMeter.drawOn( screen, x, 0 );
         x += InputVolumeMeter.width();
         DrawClickable( ThePlayButton, screen, x, 0 );
@@ -404,6 +492,9 @@ void GameDroppedFile(NimblePoint where, const char* filename) {
             } else if( suffix=="cfg" ) {
                 ReadFreePatConfig(filename);
             } else if( suffix=="sf2" ) {
+                // Instruments and their release tails refer to samples in the previous SoundFont.
+                StopOrchestra();
+                TheOrchestra.clear();
                 ReadSF2(filename);
             }
         }
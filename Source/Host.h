@@ -18,12 +18,31 @@
 *******************************************************************************/
 
 #include <string>
+#include <cstdint>
 
 //! Return current absolute time in seconds.
 /** Only the difference between two calls are meaningful, because the 
     definition of 0 is platform dependent. */
 double HostClockTime();
 
+//! Raise priority of the calling thread to that suitable for real-time audio work.
+void HostSetRealTimeThreadPriority();
+
+//! Counting semaphore, for parking threads until there is work for them.
+class HostSemaphore;
+
+//! Create a semaphore with a count of zero.
+HostSemaphore* HostCreateSemaphore();
+
+//! Destroy a semaphore that no thread is waiting on.
+void HostDestroySemaphore( HostSemaphore* s );
+
+//! Add n to the count of s, waking up to n waiting threads.  Never blocks, so real-time threads may call it.
+void HostSignalSemaphore( HostSemaphore* s, unsigned n );
+
+//! Wait until the count of s is positive, and decrement it.
+void HostWaitSemaphore( HostSemaphore* s );
+
 /** 0 = no limit
     1 = one per frame
     2 = every two frames */
@@ -69,6 +88,22 @@ void HostLoadResource( BuiltFromResourceWaveform& item );
 //! Get path to application data file to be shared across multiple users.
 const char* HostGetCommonAppData( const char* pathSuffix );
 
+//! Map entire file into memory for reading.  Returns NULL if the file cannot be opened or is empty.
+/** On success, size is set to the size of the file in bytes.  Pages are read from the file on demand. 
+    Class MappedFile is a convenient wrapper. */
+const char* HostMapFile( const char* filename, size_t& size );
+
+//! Unmap a view returned by HostMapFile.
+void HostUnmapFile( const char* data );
+
+//! Get the size in bytes and the last modification time of a file.  Returns false if the file cannot be found.
+/** The time is in host-specific units, and is meaningful only for comparison with other results of HostGetFileInfo. */
+bool HostGetFileInfo( const char* filename, uint64_t& size, uint64_t& modifyTime );
+
+//! Hint that [data,data+size), which is within a view returned by HostMapFile, will be read soon.
+/** Starts reading the pages in the background.  Does nothing if the host lacks a way to do so. */
+void HostPrefetchFile( const char* data, size_t size );
+
 //! Print warning message.  Current Windows implementation does not return.
 void HostWarning( const char* message );
 
@@ -0,0 +1,33 @@
+/******************************************************************************
+ Read-only memory-mapped file
+*******************************************************************************/
+
+#ifndef MappedFile_H
+#define MappedFile_H
+
+#include <cstddef>
+#include "Host.h"
+#include "Utility.h"
+
+//! Entire file mapped into memory for reading, via HostMapFile.
+class MappedFile: NoCopy {
+    const char* myData;
+    size_t mySize;
+public:
+    //! Map the given file.  Use isOpen to check for success.
+    explicit MappedFile( const char* filename ) {
+        myData = HostMapFile( filename, mySize );
+        if( !myData )
+            mySize = 0;
+    }
+    ~MappedFile() {
+        if( myData )
+            HostUnmapFile( myData );
+    }
+    bool isOpen() const {return myData!=NULL;}
+    const char* begin() const {return myData;}
+    const char* end() const {return myData+mySize;}
+    size_t size() const {return mySize;}
+};
+
+#endif /* MappedFile_H */
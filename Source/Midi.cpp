@@ -1,7 +1,11 @@
 #include "Midi.h"
+#include "MappedFile.h"
 #include <cstdio>
 #include <algorithm>
-#include <cerrno>
+#include <atomic>
+#include <deque>
+#include <iterator>
+#include <thread>
 
 void SanityCheck() {
     char buf[1024];
@@ -56,9 +60,8 @@ static void ByteSwap(MidiTrackHeader& t) {
 template<typename H>
 static const uint8_t* readHeader(H& h, const uint8_t* first, const uint8_t* last, const char* id) {
     Assert(H::headerSize<=sizeof(H));
-    if(memcmp(first, id, 4)!=0)
+    if(size_t(last-first)<H::headerSize || memcmp(first, id, 4)!=0)
         return nullptr;
-    Assert(last-first>=H::headerSize);
     memcpy(&h, first, H::headerSize);
     first += H::headerSize;
     ByteSwap(h);
@@ -379,16 +382,81 @@ class Tune::parser {
         assignTempo(*m, tickTime, tockTime, microsecondsPerQuarterNote);
         return m;
      }
-    std::string trackName;
+    // An event as framed in a track, before interpretation.
+    struct rawEvent {
+        unsigned tickTime;          // MIDI time in ticks
+        uint8_t status;             // Status byte, after applying running status
+        uint8_t metaType;           // Type of meta event if status is 0xFF
+        const uint8_t* data;        // Data bytes
+        unsigned length;            // Number of data bytes
+    };
+    // A track and the result of parsing it.  Virtual channels are numbered from 0 within the track.
+    struct track {
+        const uint8_t* first;
+        const uint8_t* last;
+        std::vector<Event> events;
+        std::vector<Channel> channels;
+        std::string name;
+        std::string error;          // Empty unless the track could not be parsed
+    };
+    // Virtual channel for events that apply to all drums.
+    static const unsigned allDrums = ~1u;
+    // Tracks with fewer bytes than this in total are parsed by the calling thread alone.
+    static const size_t parallelThreshold = 1<<16;
+    // Reads the rawEvents of a track one at a time, so that parsing can stop and resume.
+    class trackReader {
+        const uint8_t* myFirst;
+        const uint8_t* myLast;
+        unsigned myTickTime;
+        uint8_t myStatus;           // For running status
+    public:
+        trackReader(const uint8_t* first, const uint8_t* last) : myFirst(first), myLast(last), myTickTime(0), myStatus(0) {}
+        // Set r to the next event and return true, or return false if there are no more events.
+        // The end-of-track event is the last event returned.
+        bool next(rawEvent& r);
+    };
+    // Converts the rawEvents of a track, in order, to Events.
+    class trackConverter {
+        std::vector<tempoMark>::const_iterator myTempo;
+        unsigned myChannelBase;
+        unsigned myChannelRemap[16+128];    // 16 channels + 128 fake channels for percussion
+#if ASSERTIONS
+        Event::timeType myPrevTockTime;
+#endif
+    public:
+        // Virtual channels other than allDrums are numbered from channelBase.
+        trackConverter(const std::vector<tempoMark>& tempoMap, unsigned channelBase=0);
+        // Interpret r, updating the channels and name of t.  Return true and set e if r is an Event.
+        bool convert(const rawEvent& r, track& t, Event& e);
+    };
     uint16_t myTicksPerQuarterNote;
-    unsigned parseVariableLen(const uint8_t*& first, const uint8_t* last);
-    void parseTrack(const uint8_t* first, const uint8_t* last);
-    void throwError(const char* format, unsigned value=0);
+    static unsigned parseVariableLen(const uint8_t*& first, const uint8_t* last);
+    // Invoke f(e) for each rawEvent e in [first,last), stopping after the end-of-track event.
+    template<typename F>
+    static void forEachRawEvent(const uint8_t* first, const uint8_t* last, const F& f);
+    // Read the header of the file in [first,last) and set tracks to its tracks.
+    void findTracks(const uint8_t* first, const uint8_t* last, std::vector<track>& tracks);
+    // Set tempoMap from the tempo events of all tracks.
+    void buildTempoMap(const std::vector<track>& tracks);
+    // Parse a track.  Reads tempoMap, but not tune, so tracks can be parsed concurrently.
+    // If keepEvents is false, only the channels and name of the track are set.
+    void parseTrack(track& t, bool keepEvents) const;
+    // Parse the tracks, in parallel if worthwhile.  Sets the error field of tracks that could not be parsed.
+    void parseTracks(std::vector<track>& tracks, bool keepEvents=true) const;
+    // Set the channels of tune from the parsed tracks, and renumber the events of the tracks to match.
+    void assignChannels(std::vector<track>& tracks);
+    static void throwError(const char* format, unsigned value=0);
+    // Set the events of tune to the merge of the events of the tracks.
     // Ensure that "on note" and "off note" events are paired correctly.  
     // Inserts/erases "off note" events to enforce pairing.
-    void canonicalizeEvents();
+    void canonicalizeEvents(const std::vector<track>& tracks);
+    friend class TuneStream;
 public:
-    class badFile {};
+    class badFile {
+    public:
+        std::string message;
+        badFile(const char* m) : message(m) {}
+    };
     parser(Tune& t) : tune(t), myTicksPerQuarterNote(0) {}
 
     /** Throws badFile exception if there is a problem parsing the file. */
@@ -399,8 +467,7 @@ void Tune::parser::throwError(const char* format, unsigned value) {
     char buf[128];
     Assert(std::strlen(format) + 8 <= sizeof(buf));
     sprintf(buf, format, value);
-    tune.myReadStatus = buf;
-    throw badFile();
+    throw badFile(buf);
 }
 
 unsigned Tune::parser::parseVariableLen(const uint8_t*& first, const uint8_t* last) {
@@ -415,240 +482,374 @@ unsigned Tune::parser::parseVariableLen(const uint8_t*& first, const uint8_t* la
     return value;
 }
 
-void Tune::parser::parseTrack(const uint8_t* first, const uint8_t* last) {
-    unsigned tickTime = 0;
-    auto currentTempo = tempoMap.begin();
-    trackName.clear();
+bool Tune::parser::trackReader::next(rawEvent& e) {
+    if( myFirst>=myLast )
+        // Should report warnings about missing end-of-track?
+        return false;
+    const uint8_t* first = myFirst;
+    const uint8_t* last = myLast;
+    unsigned old = myTickTime;
+    myTickTime += parseVariableLen(first, last);
+    if( myTickTime<old )
+        throwError("delta time overflow");
+    e.tickTime = myTickTime;
+    if( first>=last )
+        throwError("truncated event");
+    // MIDI files sometimes omit the status byte if it is the same as for the previous event.
+    // Search Internet for "running status" to learn more.
+    e.status = *first&0x80 ? *first++ : myStatus;
+    e.metaType = 0;
+    if( e.status==0xFF ) {
+        // MetaEvent
+        if( first>=last )
+            throwError("truncated meta event");
+        e.metaType = *first++;
+        e.length = parseVariableLen(first, last);
+    } else {
+        switch( e.status>>4 ) {
+            case 0x8:                       // Note off
+            case 0x9:                       // Note on
+            case 0xA:                       // Note Aftertouch
+            case 0xB:                       // Controller change
+            case 0xE:                       // Pitch bend
+                e.length = 2;
+                break;
+            case 0xC:                       // Program change
+            case 0xD:                       // Channel aftertouch
+                e.length = 1;
+                break;
+            case 0xF:                       // SysEx event
+                e.length = parseVariableLen(first, last);
+                break;
+            default:
+                throwError("High bit of status not set");
+                break;
+        }
+        myStatus = e.status;
+    }
+    if( e.length>size_t(last-first) )
+        throwError("truncated event");
+    e.data = first;
+    first += e.length;
+    if( e.status==0xFF && e.metaType==0x2F ) {
+        // End of track
+#if TUNE_LOG
+        fprintf(TuneLog, "end of track\n");
+        fflush(TuneLog);
+#endif               
+        first = last;
+    }
+    myFirst = first;
+    return true;
+}
+
+template<typename F>
+void Tune::parser::forEachRawEvent(const uint8_t* first, const uint8_t* last, const F& f) {
+    trackReader reader(first, last);
+    rawEvent e;
+    while( reader.next(e) )
+        f(e);
+}
+
+void Tune::parser::buildTempoMap(const std::vector<track>& tracks) {
+    struct tempoEvent {
+        unsigned tickTime;
+        unsigned microsecondsPerQuarterNote;
+    };
+    std::vector<tempoEvent> tempos;
+    for( const track& t: tracks )
+        forEachRawEvent(t.first, t.last, [&](const rawEvent& r) {
+            if( r.status==0xFF && r.metaType==0x51 ) {
+                // Set tempo
+                if( r.length!=3 )
+                    throwError("tempo event has length %u", r.length);
+                tempoEvent e;
+                e.tickTime = r.tickTime;
+                e.microsecondsPerQuarterNote = r.data[0]<<16 | r.data[1]<<8 | r.data[2];
+#if TUNE_LOG
+                fprintf(TuneLog, "microsecondsPerQuarterNote=%u\n", e.microsecondsPerQuarterNote);
+#endif
+                tempos.push_back(e);
+            }
+        });
+    // Stable sort so that when two tempo events have the same time, the one later in the file wins.
+    std::stable_sort(tempos.begin(), tempos.end(), [](const tempoEvent& x, const tempoEvent& y) {
+        return x.tickTime<y.tickTime;
+    });
+    tempoMap.resize(2);
+    assignTempo(tempoMap[0],0,0);       // Time zero
+    assignTempo(tempoMap[1],~0u,~0u);   // Approximation of time infinity
+    for( const tempoEvent& e: tempos ) {
+        auto m = tempoMap.end()-2;
+        addTempoMark(e.tickTime, m->tockFromTick(e.tickTime), e.microsecondsPerQuarterNote);
+    }
+}
+
+Tune::parser::trackConverter::trackConverter(const std::vector<tempoMark>& tempoMap, unsigned channelBase) : 
+    myTempo(tempoMap.begin()),
+    myChannelBase(channelBase)
+{
+    std::fill_n( myChannelRemap, sizeof(myChannelRemap)/sizeof(myChannelRemap[0]), ~0u );
 #if ASSERTIONS
-    Event::timeType prevTockTime = 0;
+    myPrevTockTime = 0;
 #endif
-    const size_t nPhysicalChannel = 16 + 128;   // 16 channels + 128 fake channels for percussion
-    const unsigned nil = ~0u;                   // Denotes empty slow in channelRemap
-    unsigned channelRemap[nPhysicalChannel];
-    std::fill_n( channelRemap, nPhysicalChannel, nil );
-    size_t virtualChannelBase = tune.myChannelMap.size();
-    unsigned status = 0;                        // Status byte
-    while( first<last ) {
-        // Compute tockTime.
-        if( unsigned deltaTime = parseVariableLen(first, last) ) {
-            unsigned old = tickTime;
-            tickTime += deltaTime;
-            if( tickTime<old )
-                throwError("delta time overflow");
-            while(tickTime>=currentTempo[1].tickTime)
-                // Advance to next tempoMark
-                ++currentTempo;
-        }
-        Event::timeType tockTime = currentTempo->tockFromTick(tickTime);
+}
+
+bool Tune::parser::trackConverter::convert(const rawEvent& r, track& t, Event& e) {
+    // Compute tockTime.
+    while(r.tickTime>=myTempo[1].tickTime)
+        // Advance to next tempoMark
+        ++myTempo;
+    Event::timeType tockTime = myTempo->tockFromTick(r.tickTime);
 #if ASSERTIONS
-        Assert( tockTime>=prevTockTime );
-        prevTockTime = tockTime;
+    Assert( tockTime>=myPrevTockTime );
+    myPrevTockTime = tockTime;
 #endif
-        // MIDI files sometimes omit the status byte if it is the same as for the previous event.
-        // Search Internet for "running status" to learn more.
-        unsigned char c = *first&0x80 ? *first++ : status;
-        if(c==0xFF) {
-            // MetaEvent
-            uint8_t type = *first++;
-            unsigned len = parseVariableLen(first,last);
-            switch(type) {
-                case 0x3:                       // Track name
-                    trackName = std::string((const char*)first, len);
+    const uint8_t* first = r.data;
+    const unsigned kind = r.status>>4;
+    if( kind==0xF ) {
+        // MetaEvents other than track name were handled by buildTempoMap or are ignored.  SysEx events are skipped.
+        if( r.status==0xFF && r.metaType==0x3 ) {
+            t.name = std::string((const char*)first, r.length);
 #if TUNE_LOG
-                    fprintf(TuneLog, "trackname %s\n", trackName.c_str());
+            fprintf(TuneLog, "trackname %s\n", t.name.c_str());
 #endif
-                    break;
-                case 0x2F:                      // End of track
-#if TUNE_LOG
-                    fprintf(TuneLog, "end of track\n");
-                    fflush(TuneLog);
-#endif               
-                    return;
-                case 0x51: {                    // Set tempo
-                    Assert(len==3);
-                    unsigned microsecondsPerQuarterNote = first[0]<<16 | first[1]<<8 | first[2];
+        }
+        return false;
+    }
+    const unsigned nil = ~0u;                   // Denotes empty slot in myChannelRemap
+    const unsigned physicalDrumChannel = 9;
+    const unsigned physicalChannel = r.status&0xF;
+    // Figure out where to look in the channelRemap table.
+    unsigned remapIndex;
+    if( physicalChannel==physicalDrumChannel ) {
+        // Drum track has multiple virtual channels encoded on it.
+        switch(kind) {
+            case 0x8:           // Note off
+            case 0x9:           // Note on
+            case 0xA:           // Note Aftertouch
+                remapIndex = 16 + (first[0] & 0x7F);  // Note signifies the "channel"
+                break;
+            default:
+                remapIndex = allDrums;   
+                break;
+        }
+    } else {
+        remapIndex = physicalChannel;
+    }
+    // Get the virtual channel (or create one).
+    unsigned virtualChannel;
+    if( remapIndex != allDrums ) {
+        virtualChannel = myChannelRemap[remapIndex];
+        if(virtualChannel==nil || kind==0xC) {
+            // Need to create a new virtual channel
+            virtualChannel = t.channels.size();
+            t.channels.push_back(Channel(remapIndex<16 ? 0 : remapIndex-16+128));
+            myChannelRemap[remapIndex] = virtualChannel;
+        }
+    } else {
+        virtualChannel = allDrums;
+    }
 #if TUNE_LOG
-                    fprintf(TuneLog, "microsecondsPerQuarterNote=%u\n", microsecondsPerQuarterNote);
+    fprintf(TuneLog, "virtual channel %u = physical channel %d\n", int(virtualChannel), int(physicalChannel));
 #endif
-                    currentTempo = addTempoMark(tickTime,tockTime,microsecondsPerQuarterNote);
-                    break;
-                }
-                default:
-                    break;
-            }
-            first += len;
-        } else {
-            const unsigned physicalDrumChannel = 9;
-            const unsigned allDrums = ~1u;
-            const auto kind = c>>4;
-            const unsigned physicalChannel = c&0xF;
-            // Figure out where to look in the channelRemap table.
-            unsigned remapIndex;
-            if( physicalChannel==physicalDrumChannel ) {
-                // Drum track has multiple virtual channels encoded on it.
-                switch(kind) {
-                    case 0x8:           // Note off
-                    case 0x9:           // Note on
-                    case 0xA:           // Note Aftertouch
-                        remapIndex = 16 + (first[0] & 0x7F);  // Note signifies the "channel"
-                        break;
-                    default:
-                        remapIndex = allDrums;   
-                        break;
-                }
+    const unsigned channel = virtualChannel==allDrums ? allDrums : myChannelBase+virtualChannel;
+    switch(kind) {
+        case 0x8:                       // Note off
+        case 0x9: {                     // Note on (though it's really "note off" if velocity is 0).
+            e = Event(tockTime, channel, kind==0x8 || first[1]==0 ? Event::noteOff : Event::noteOn);
+            e.myNote = first[0] & 0x7F;
+            e.myVelocity = first[1] & 0x7F;
+            return true;
+        }
+        case 0xA: {                     // Note Aftertouch
+            e = Event(tockTime, channel, Event::noteAfterTouch);
+            e.myNote = first[0] & 0x7F;
+            e.myAfterTouch = first[1] & 0x7F;
+            return true;
+        }
+        case 0xB: {                     // Controller change
+            e = Event(tockTime, channel, Event::controlChange);
+            e.myControllerNumber = first[0] & 0x7F;
+            e.myControllerValue = first[1] & 0x7F;
+            return true;
+        }
+        case 0xC: {                     // Program change
+            if( virtualChannel==allDrums ) {
+                // Not implemented
             } else {
-                remapIndex = physicalChannel;
+                t.channels[virtualChannel].myProgram = first[0] & 0x7F;
             }
-            // Get the virtual channel (or create one).
-            unsigned virtualChannel;
-            if( remapIndex != allDrums ) {
-                virtualChannel = channelRemap[remapIndex];
-                if((kind < 0xF && virtualChannel==nil) || kind==0xC) {
-                    // Need to create a new virtual channel
-                    virtualChannel = tune.myChannelMap.size();
-                    tune.myChannelMap.pushBack(Channel(remapIndex<16 ? 0 : remapIndex-16+128));
-                    channelRemap[remapIndex] = virtualChannel;
-                }
+            return false;
+        }
+        case 0xD: {                     // Channel aftertouch
+            if( virtualChannel==allDrums ) {
+                // Not implemented
+                return false;
             } else {
-                virtualChannel = allDrums;
+                e = Event(tockTime, channel, Event::channelAfterTouch);
+                e.myAfterTouch = first[0] & 0x7F;
+                return true;
             }
-#if TUNE_LOG
-            fprintf(TuneLog, "virtual channel %u = physical channel %d\n", int(virtualChannel), int(c&0xF));
-#endif
-            switch(kind) {
-                case 0x8:                       // Note off
-                case 0x9: {                     // Note on (though it's really "note off" if velocity is 0).
-                    Event e(tockTime, virtualChannel, kind==0x8 || first[1]==0 ? Event::noteOff : Event::noteOn);
-                    e.myNote = first[0] & 0x7F;
-                    e.myVelocity = first[1] & 0x7F;
-                    tune.myEventSeq.pushBack(e);
-                    first += 2;
-                    break;
-                }
-                case 0xA: {                     // Note Aftertouch
-                    Event e(tockTime, virtualChannel, Event::noteAfterTouch);
-                    e.myNote = first[0] & 0x7F;
-                    e.myAfterTouch = first[1] & 0x7F;
-                    tune.myEventSeq.pushBack(e);
-                    first += 2;
-                    break;
-                }
-                case 0xB: {                     // Controller change
-                    Event e(tockTime, virtualChannel, Event::controlChange);
-                    e.myControllerNumber = first[0] & 0x7F;
-                    e.myControllerValue = first[1] & 0x7F;
-                    tune.myEventSeq.pushBack(e);
-                    first += 2;
-                    break;
-                }
-                case 0xC: {                     // Program change
-                    if( virtualChannel==allDrums ) {
-                        // Not implemented
-                    } else {
-                        tune.myChannelMap.myChannels[virtualChannel].myProgram = first[0] & 0x7F;
-                        first += 1;
-                    }
-                    break;
-                }
-                case 0xD: {                     // Channel aftertouch
-                    if( virtualChannel==allDrums ) {
-                        // Not implemented
-                    } else {
-                        Event e(tockTime, virtualChannel, Event::channelAfterTouch);
-                        e.myAfterTouch = first[1] & 0x7F;
-                        tune.myEventSeq.pushBack(e);
-                    }
-                    first += 2;
-                    break;  
-                }
-                case 0xE: {                     // Pitch bend
-                    if( virtualChannel==allDrums ) {
-                        // Not implemented
-                    } else {
-                        Event e(tockTime, virtualChannel, Event::channelAfterTouch);
-                        e.myPitchBend = first[0] & 0x7F | (first[1] & 0x7F)<<7;
-                        tune.myEventSeq.pushBack(e);
-                    }
-                    first += 2;
-                    break;
-                }
-                case 0xF: {                     // SysEx event - skip it
-                    unsigned len = parseVariableLen(first, last);
-                    Assert(first[len-1]==0xF7);
-                    first += len;
-                    break;
-                }
-                default:
-                    Assert(0);
-                    throwError("High bit of status not set");
-                    break;
+        }
+        case 0xE: {                     // Pitch bend
+            if( virtualChannel==allDrums ) {
+                // Not implemented
+                return false;
+            } else {
+                e = Event(tockTime, channel, Event::channelAfterTouch);
+                e.myPitchBend = first[0] & 0x7F | (first[1] & 0x7F)<<7;
+                return true;
             }
-            status = c;
         }
     }
-    // Should report warnings about missing end-of-track?
+    return false;
 }
 
-void Tune::parser::canonicalizeEvents() {
-    std::vector<Event> missing;
-    const unsigned nullTime = ~0u;
-    NoteTracker<Event*> on(tune,nullptr);
+void Tune::parser::parseTrack(track& t, bool keepEvents) const {
+    trackConverter c(tempoMap);
+    if( keepEvents )
+        // Typical events take about three bytes.
+        t.events.reserve((t.last-t.first)/3);
+    forEachRawEvent(t.first, t.last, [&](const rawEvent& r) {
+        Event e;
+        if( c.convert(r, t, e) && keepEvents )
+            t.events.push_back(e);
+    });
+}
+
+void Tune::parser::parseTracks(std::vector<track>& tracks, bool keepEvents) const {
+    size_t bytes = 0;
+    for( const track& t: tracks )
+        bytes += t.last-t.first;
+    unsigned n = std::thread::hardware_concurrency();
+    // Small files are not worth starting threads for.  TuneLog is not thread safe.
+    if( n==0 || bytes<parallelThreshold || TUNE_LOG )
+        n = 1;
+    n = Min(n, unsigned(tracks.size()));
+    // Workers claim tracks in order.  Results do not depend on which worker parses which track.
+    std::atomic<unsigned> next(0);
+    auto work = [&]() {
+        for( unsigned i; (i=next++)<tracks.size(); ) 
+            try {
+                parseTrack(tracks[i], keepEvents);
+            } catch( const badFile& e ) {
+                tracks[i].error = e.message;
+            }
+    };
+    std::vector<std::thread> workers;
+    for( unsigned k=1; k<n; ++k )
+        workers.push_back(std::thread(work));
+    work();
+    for( auto& w: workers )
+        w.join();
+}
+
+void Tune::parser::canonicalizeEvents(const std::vector<track>& tracks) {
+    // Events of each track are already sorted by time, so merge them with a heap of cursors, one per track.
+    struct cursor {
+        const Event* first;
+        const Event* last;
+        unsigned track;             // Breaks ties in time, so that the merge is stable.
+    };
+    // Heap functions put the greatest element on top, so order the cursors by "later".
+    auto later = [](const cursor& x, const cursor& y) {
+        return x.first->time()>y.first->time() || (x.first->time()==y.first->time() && x.track>y.track);
+    };
+    std::vector<cursor> heap;
+    size_t n = 0;
+    for( unsigned i=0; i<tracks.size(); ++i ) {
+        const auto& events = tracks[i].events;
+        if( !events.empty() ) {
+            cursor c = {events.data(), events.data()+events.size(), i};
+            heap.push_back(c);
+        }
+        // Each "note on" can cause at most one "note off" to be inserted.
+        n += events.size() + std::count_if(events.begin(), events.end(), [](const Event& e) {
+            return e.kind()==Event::noteOn;
+        });
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+
     auto& seq = tune.myEventSeq.myEvents;
+    seq.clear();
+    seq.reserve(n);
+    const size_t none = ~size_t(0);
+    // For each note, index in seq of its "note on" that is awaiting a "note off", or none.
+    NoteTracker<size_t> on(tune,none);
     unsigned lastTime = 0;
-    for( Event& e: seq )
+    while( !heap.empty() ) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        cursor& c = heap.back();
+        const Event& e = *c.first++;
+        bool keep = true;
         switch( e.kind() ) {
-            case Event::noteOn:
-                if( Event*& f = on[e] ) {
-                    Assert(e.time()>=f->time());
-                    if( e.time()>f->time() ) {
+            case Event::noteOn: {
+                size_t& f = on[e];
+                if( f!=none ) {
+                    Assert(e.time()>=seq[f].time());
+                    if( e.time()>seq[f].time() ) {
                         // "note off" is missing.  Create one with same time as second "note on".
                         Event g(e.time(), e.channel(), Event::noteOff);
                         g.setNote(e.note(), e.velocity());
-                        missing.push_back(g);
-                        f = nullptr;
+                        seq.push_back(g);
                     } else {
-                        // Have a duplicate "note on".  Mark it for erasure.
-                        e.myTime = nullTime;
+                        // Have a duplicate "note on".  Drop it.
+                        keep = false;
                     }
                 }
-                on[e] = &e;
+                if( keep )
+                    f = seq.size();
                 break;
-            case Event::noteOff:
-                if( Event*& f = on[e]) {
-                    f = nullptr;
+            }
+            case Event::noteOff: {
+                size_t& f = on[e];
+                if( f!=none ) {
+                    f = none;
                     if(e.time()>lastTime)
                         lastTime = e.time();
                 } else {
-                    // "note off" with no preceding "note on".  Mark it for erasure.
-                    e.myTime = nullTime;
+                    // "note off" with no preceding "note on".  Drop it.
+                    keep = false;
                 }
                 break;
+            }
         }
+        if( keep )
+            seq.push_back(e);
+        if( c.first<c.last ) 
+            std::push_heap(heap.begin(), heap.end(), later);
+        else
+            heap.pop_back();
+    }
     // Now check for missing final "off note" events.
-    on.forEach( [&]( Event* event ){
-        if( event ) {
-            // Last "on note" is missing a following "off note".  Create an "note off" for it.
-            Event final(lastTime,event->channel(),Event::noteOff);
-            final.setNote(event->note(),0);
+    std::vector<Event> missing;
+    on.forEach( [&]( size_t f ){
+        if( f!=none ) {
+            // Last "on note" is missing a following "off note".  Create an "note off" for it, 
+            // but not earlier than the "note on".
+            const Event& event = seq[f];
+            Event final(Max(lastTime,event.time()),event.channel(),Event::noteOff);
+            final.setNote(event.note(),0);
             missing.push_back(final);
         }
     });
-    // Insert extra off events first.  Stable sort will keep them in front of following on events.
-    seq.insert(seq.begin(), missing.begin(), missing.end());
-    std::stable_sort(seq.begin(),seq.end(),[](const Event& x, const Event& y) {
-        return x.time()<y.time();
-    });
-    // nulled events are now last.  Chop them off.
-    auto z = seq.end();
-    while(z>seq.begin() && z[-1].time()==nullTime)
-        --z;
-    seq.resize(z-seq.begin());
+    if( !missing.empty() ) {
+        // Merge them into the tail of seq, after events with the same time, so that each follows its "note on".  
+        // The tail is usually short, since most of the events precede the last "note off".
+        auto byTime = [](const Event& x, const Event& y) {
+            return x.time()<y.time();
+        };
+        std::stable_sort(missing.begin(), missing.end(), byTime);
+        auto i = std::upper_bound(seq.begin(), seq.end(), missing.front(), byTime);
+        std::vector<Event> tail(i, seq.end());
+        seq.erase(i, seq.end());
+        std::merge(tail.begin(), tail.end(), missing.begin(), missing.end(), std::back_inserter(seq), byTime);
+    }
 }
 
-void Tune::parser::parseFile(const uint8_t* first, const uint8_t* last) {
+void Tune::parser::findTracks(const uint8_t* first, const uint8_t* last, std::vector<track>& tracks) {
     Assert(first<=last);
-    tune.clear();
-    tune.myReadStatus.clear();
     // Read header
     MidiHeader h;
     first = readHeader(h, first, last, "MThd");
@@ -670,14 +871,8 @@ void Tune::parser::parseFile(const uint8_t* first, const uint8_t* last) {
 #if TUNE_LOG
     fprintf(TuneLog,"format=%d numTracks=%d division=%d\n",int(h.format),int(h.numTracks),int(h.division));
 #endif
-    // Initialized the tempoMap
-    tempoMap.resize(2);
-    assignTempo(tempoMap[0],0,0);       // Time zero
-    assignTempo(tempoMap[1],~0u,~0u);   // Approximation of time infinity
-
-    std::vector<ChannelMap::channelInfo> channelNames;
-
-    // Parse each track 
+    // Find the tracks
+    tracks.assign(h.numTracks, track());
     for( unsigned i=0; i<h.numTracks; ++i) {
         MidiTrackHeader t;
         first = readHeader(t, first, last, "MTrk");
@@ -685,26 +880,188 @@ void Tune::parser::parseFile(const uint8_t* first, const uint8_t* last) {
             throwError("track %u has bad MTrk header", i);
         if(t.chunkSize > size_t(last-first))
             throwError("track %u has bad size", i);
+        tracks[i].first = first;
+        tracks[i].last = first+t.chunkSize;
+        first += t.chunkSize;
+    }
+}
+
+void Tune::parser::assignChannels(std::vector<track>& tracks) {
+    // Number the channels in track order, so that virtual channel numbers do not depend on parallel scheduling.
+    std::vector<ChannelMap::channelInfo> channelNames;
+    for( track& t: tracks ) {
+        if( !t.error.empty() )
+            throw badFile(t.error.c_str());
         unsigned virtualChannelBase = tune.myChannelMap.size();
+        for( Event& e: t.events )
+            if( e.myChannel!=Event::channelType(allDrums) )
+                e.myChannel += virtualChannelBase;
         ChannelMap::channelInfo c;
-        parseTrack(first, first+t.chunkSize);
-        for(unsigned i=virtualChannelBase; i<tune.myChannelMap.size(); ++i ) {
-            c.channel = i;
-            c.program = tune.myChannelMap[i].program();
-            c.name = trackName;         // Tentative name.  
+        for( const Channel& k: t.channels ) {
+            c.channel = tune.myChannelMap.size();
+            c.program = k.program();
+            c.name = t.name;            // Tentative name.  
             channelNames.push_back(c);
+            tune.myChannelMap.pushBack(k);
         }
-        first += t.chunkSize;
     }
-    // Fix up so that on/off are properly paired.
-    canonicalizeEvents();
-
-    // Finish setting up myChannelMap
     tune.myChannelMap.assign(channelNames.data(), channelNames.data()+channelNames.size());
 }
 
+void Tune::parser::parseFile(const uint8_t* first, const uint8_t* last) {
+    tune.clear();
+    tune.myReadStatus.clear();
+    std::vector<track> tracks;
+    findTracks(first, last, tracks);
+
+    // Tempo events in any track apply to all tracks, so gather them before parsing the tracks.
+    buildTempoMap(tracks);
+    parseTracks(tracks);
+    assignChannels(tracks);
+
+    // Merge the tracks, and fix up so that on/off are properly paired.
+    canonicalizeEvents(tracks);
+}
+
 //==================================== Tune ====================================
 
+Tune::Tune() : mySourceSize(0), mySourceHash(0) {}
+
+// Out of line so that MappedFile is a complete type for myCacheFile.
+Tune::~Tune() {}
+
+void Tune::clear() {
+    myEventSeq.clear();
+    myChannelMap.clear();
+    myNoteOffOffsets.clear();
+    myCheckpoints.clear();
+    mySoundingNotes.clear();
+    myCacheFile.reset();
+    mySourceSize = 0;
+    mySourceHash = 0;
+}
+
+/** Orchestra::dispatchNext consumes the offsets in order, one per "note on". */
+void Tune::computeNoteOffOffsets() {
+    size_t n = 0;
+    for( const Event& e: events() )
+        if( e.kind()==Event::noteOn )
+            ++n;
+    myNoteOffOffsets.resize(n);
+    size_t k = 0;
+    NoteTracker<std::pair<const Event*, size_t>> noteStart(*this);
+    for( const Event& e: events() )
+        switch( e.kind() ) {
+            case Event::noteOn:
+            case Event::noteOff: {
+                auto& start = noteStart[e];
+                if(const Event* on = start.first) {
+                    Assert(on->note()==e.note());
+                    myNoteOffOffsets[start.second] = uint32_t(&e-on);
+                    start.first = nullptr;
+                }
+                if( e.kind()==Event::noteOn ) {
+                    start.first = &e;
+                    start.second = k;
+                    myNoteOffOffsets[k++] = 0;
+                }
+                break;
+            }
+        }
+    Assert(k==n);
+#if ASSERTIONS
+    noteStart.forEach([](const std::pair<const Event*, size_t>& start) {
+        // Input parsing should canonicalize input so that for any note, 
+        // there is an off for every on, and off precedes next on
+        Assert(!start.first);
+    });
+    const uint32_t* d = myNoteOffOffsets.begin();
+    for(const Event& e: events()) {
+        if( e.kind()==Event::noteOn ) {
+            Assert(d<myNoteOffOffsets.end());
+            const Event& off = (&e)[*d];
+            Assert(e.note()==off.note());
+            Assert(e.channel()==off.channel());
+            ++d;
+        }
+    }
+#endif
+}
+
+void Tune::computeCheckpoints() {
+    myCheckpoints.clear();
+    mySoundingNotes.clear();
+    const Event* first = events().begin();
+    const uint32_t n = uint32_t(events().size());
+    const uint64_t interval = uint64_t(checkpointSeconds/SecondsPerTock);
+    // Notes sounding before the current event, in no particular order, and where each is in sounding.
+    std::vector<position> sounding;
+    NoteTracker<size_t> where(*this);
+    position p;
+    p.noteOn = 0;
+    for( p.event=0; p.event<=n; ++p.event ) {
+        // Checkpoints go before the first event at or after their time.  
+        // The last checkpoint is the last one before the last event, or at the end of an empty tune.
+        while( p.event<n ? myCheckpoints.size()*interval<=first[p.event].time() : myCheckpoints.empty() ) {
+            checkpoint c;
+            c.start = p;
+            c.firstSounding = uint32_t(mySoundingNotes.size());
+            myCheckpoints.push_back(c);
+            mySoundingNotes.insert(mySoundingNotes.end(), sounding.begin(), sounding.end());
+        }
+        if( p.event==n )
+            break;
+        const Event& e = first[p.event];
+        switch( e.kind() ) {
+            case Event::noteOn:
+                where[e] = sounding.size();
+                sounding.push_back(p);
+                ++p.noteOn;
+                break;
+            case Event::noteOff: {
+                // Canonical form guarantees that the note is sounding.  Move the last note into its place.
+                size_t k = where[e];
+                Assert(k<sounding.size());
+                sounding[k] = sounding.back();
+                where[first[sounding[k].event]] = k;
+                sounding.pop_back();
+                break;
+            }
+        }
+    }
+    Assert(sounding.empty());
+}
+
+Tune::position Tune::seek( Event::timeType t, std::vector<std::pair<const Event*,const Event*>>& sounding ) const {
+    Assert(!myCheckpoints.empty());
+    sounding.clear();
+    const Event* first = events().begin();
+    const uint32_t* offsets = noteOffOffsets();
+    auto addIfSounding = [&]( const position& q ) {
+        const Event& off = first[q.event+offsets[q.noteOn]];
+        if( off.time()>t )
+            sounding.push_back(std::make_pair(first+q.event, &off));
+    };
+    // Start from the last checkpoint at or before t.
+    size_t k = Min( size_t(t/uint64_t(checkpointSeconds/SecondsPerTock)), myCheckpoints.size()-1 );
+    const checkpoint& c = myCheckpoints[k];
+    auto i = mySoundingNotes.begin()+c.firstSounding;
+    auto j = k+1<myCheckpoints.size() ? mySoundingNotes.begin()+myCheckpoints[k+1].firstSounding : mySoundingNotes.end();
+    for( ; i!=j; ++i )
+        addIfSounding(*i);
+    // Then account for the notes that start between the checkpoint and t.
+    const Event* last = std::lower_bound(first+c.start.event, events().end(), t, [](const Event& e, Event::timeType t) {
+        return e.time()<t;
+    });
+    position p = c.start;
+    for( ; p.event<uint32_t(last-first); ++p.event )
+        if( first[p.event].kind()==Event::noteOn ) {
+            addIfSounding(p);
+            ++p.noteOn;
+        }
+    return p;
+}
+
 #if ASSERTIONS
 bool Tune::assertOkay() const {
     NoteTracker<const Event*> on(*this, nullptr);
@@ -727,39 +1084,320 @@ bool Tune::assertOkay() const {
 }
 #endif
 
+//! Reason that MappedFile could not open filename.
+static std::string OpenFailure(const std::string& filename) {
+    uint64_t size, modifyTime;
+    if(HostGetFileInfo(filename.c_str(), size, modifyTime) && size==0)
+        return "empty file";
+    else
+        return "cannot open file " + filename;
+}
+
 bool Tune::readFromFile(const std::string& filename) {
 #if TUNE_LOG
     TuneLog = std::fopen(TuneLogFileName,"w+");
     Assert(TuneLog);
 #endif
-    FILE* f = std::fopen(filename.c_str(),"rb");
-    if(!f) {
-        myReadStatus = "cannot open file " + filename + ": " + std::strerror(errno);
-        return false;
-    }
-    std::fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    std::fseek(f, 0, SEEK_SET);
-    uint8_t* buf = new uint8_t[fsize];
-    long s = fread(buf, 1, fsize, f);
-    fclose(f);
-    Assert(s==fsize);
-    if(s>=0) {
+    // Map the file rather than reading it, so that pages are read only as the track parsers touch them.
+    MappedFile f(filename.c_str());
+    if(!f.isOpen()) {
+        myReadStatus = OpenFailure(filename);
+    } else {
         parser p(*this);
         try {
-            p.parseFile(buf, buf+s);
+            const uint8_t* buf = (const uint8_t*)f.begin();
+            p.parseFile(buf, buf+f.size());
             Assert(assertOkay());
-        } catch( parser::badFile ) {
+            computeNoteOffOffsets();
+            computeCheckpoints();
+            mySourceSize = f.size();
+            mySourceHash = hashSource(f.begin(), f.size());
+        } catch( const parser::badFile& e ) {
+            myReadStatus = e.message;
             Assert(!myReadStatus.empty());
         }
-    } else {
-        myReadStatus = "empty file";
     }
-    delete[] buf;
 #if TUNE_LOG
     std::fclose(TuneLog);
 #endif
     return myReadStatus.empty();
 };
 
+//==================================== TuneStream ====================================
+
+struct TuneStream::state {
+    typedef Tune::parser parser;
+    MappedFile file;
+    parser parse;
+    // Tracks of the file.  Only first, last, and the number of channels are used after open.
+    std::vector<parser::track> tracks;
+    // Position in a track, and its next Event.
+    struct cursor {
+        parser::trackReader reader;
+        parser::trackConverter converter;
+        parser::track track;            // Channels and name seen so far.  Never has events.
+        Event next;
+        cursor(const parser::track& t, const std::vector<parser::tempoMark>& tempoMap, unsigned channelBase) : 
+            reader(t.first, t.last), 
+            converter(tempoMap, channelBase) 
+        {}
+        // Set next to the next Event of the track and return true, or return false if there are no more.
+        bool advance() {
+            parser::rawEvent r;
+            while( reader.next(r) )
+                if( converter.convert(r, track, next) )
+                    return true;
+            return false;
+        }
+    };
+    std::vector<cursor> cursors;
+    // Heap of indices into cursors, ordered as in canonicalizeEvents, so the events come out in the same order.
+    std::vector<unsigned> heap;
+    struct entry {
+        Event event;
+        Event off;                      // If event is a "note on", its "note off" once that has been parsed
+    };
+    // Events parsed but not yet popped.  Event number i is queue[i-popped].
+    std::deque<entry> queue;
+    uint64_t popped;
+    static const uint64_t none = ~uint64_t(0);
+    // For each note, number of its "note on" that is awaiting a "note off", or none.
+    std::unique_ptr<NoteTracker<uint64_t>> on;
+    Event::timeType lastTime;
+    bool finished;
+    state(const std::string& filename, Tune& tune) : file(filename.c_str()), parse(tune) {}
+    bool later(unsigned x, unsigned y) const {
+        const Event& ex = cursors[x].next;
+        const Event& ey = cursors[y].next;
+        return ex.time()>ey.time() || (ex.time()==ey.time() && x>y);
+    }
+    entry& at(uint64_t i) {
+        Assert(popped<=i && i-popped<queue.size());
+        return queue[size_t(i-popped)];
+    }
+    void push(const Event& e) {
+        entry x;
+        x.event = e;
+        queue.push_back(x);
+    }
+    // Check the whole file and find its channels.  Throws parser::badFile if the file is bad.
+    void prepare();
+    void rewind();
+    // Parse, merge, and pair the next event, or finish if there are no more.
+    void step();
+    // Add the "note off" events missing at the end of the file.
+    void finish();
+    // End the "note on" at the front of the queue, which must be awaiting its "note off", at the time of the back.
+    void cutFront();
+};
+
+void TuneStream::state::prepare() {
+    const uint8_t* first = (const uint8_t*)file.begin();
+    parse.findTracks(first, first+file.size(), tracks);
+    parse.buildTempoMap(tracks);
+    // The channels must be known before the first event is played, so parse the whole file once without keeping
+    // the events.  This also finds any errors, so that none can arise while playing.
+    parse.parseTracks(tracks, false);
+    parse.assignChannels(tracks);
+}
+
+void TuneStream::state::rewind() {
+    cursors.clear();
+    heap.clear();
+    queue.clear();
+    popped = 0;
+    on.reset(new NoteTracker<uint64_t>(parse.tune, none));
+    lastTime = 0;
+    finished = false;
+    cursors.reserve(tracks.size());
+    unsigned channelBase = 0;
+    for( unsigned i=0; i<tracks.size(); ++i ) {
+        cursors.push_back(cursor(tracks[i], parse.tempoMap, channelBase));
+        if( cursors.back().advance() )
+            heap.push_back(i);
+        channelBase += unsigned(tracks[i].channels.size());
+    }
+    auto later = [this](unsigned x, unsigned y) {return this->later(x,y);};
+    std::make_heap(heap.begin(), heap.end(), later);
+}
+
+void TuneStream::state::step() {
+    if( heap.empty() ) {
+        finish();
+        return;
+    }
+    auto later = [this](unsigned x, unsigned y) {return this->later(x,y);};
+    std::pop_heap(heap.begin(), heap.end(), later);
+    cursor& c = cursors[heap.back()];
+    const Event e = c.next;
+    if( c.advance() )
+        std::push_heap(heap.begin(), heap.end(), later);
+    else
+        heap.pop_back();
+    // Same fix ups as canonicalizeEvents.
+    bool keep = true;
+    switch( e.kind() ) {
+        case Event::noteOn: {
+            uint64_t& f = (*on)[e];
+            if( f!=none ) {
+                entry& start = at(f);
+                Assert(e.time()>=start.event.time());
+                if( e.time()>start.event.time() ) {
+                    // "note off" is missing.  Create one with same time as second "note on".
+                    Event g(e.time(), e.channel(), Event::noteOff);
+                    g.setNote(e.note(), e.velocity());
+                    start.off = g;
+                    push(g);
+                } else {
+                    // Have a duplicate "note on".  Drop it.
+                    keep = false;
+                }
+            }
+            if( keep )
+                f = popped+queue.size();
+            break;
+        }
+        case Event::noteOff: {
+            uint64_t& f = (*on)[e];
+            if( f!=none ) {
+                at(f).off = e;
+                f = none;
+                if(e.time()>lastTime)
+                    lastTime = e.time();
+            } else {
+                // "note off" with no preceding "note on".  Drop it.
+                keep = false;
+            }
+            break;
+        }
+    }
+    if( keep )
+        push(e);
+}
+
+void TuneStream::state::finish() {
+    // A "note on" awaiting its "note off" cannot have been popped, so all are still in the queue.
+    std::vector<entry> missing;
+    on->forEach( [&]( uint64_t f ){
+        if( f!=none ) {
+            entry& start = at(f);
+            entry final;
+            final.event = Event(Max(lastTime,start.event.time()),start.event.channel(),Event::noteOff);
+            final.event.setNote(start.event.note(),0);
+            start.off = final.event;
+            missing.push_back(final);
+        }
+    });
+    if( !missing.empty() ) {
+        // Merge them into the tail of the queue, as canonicalizeEvents does.
+        auto byTime = [](const entry& x, const entry& y) {
+            return x.event.time()<y.event.time();
+        };
+        std::stable_sort(missing.begin(), missing.end(), byTime);
+        auto i = std::upper_bound(queue.begin(), queue.end(), missing.front(), byTime);
+        std::vector<entry> tail(i, queue.end());
+        queue.erase(i, queue.end());
+        std::merge(tail.begin(), tail.end(), missing.begin(), missing.end(), std::back_inserter(queue), byTime);
+    }
+    finished = true;
+}
+
+void TuneStream::state::cutFront() {
+    entry& start = queue.front();
+    uint64_t& f = (*on)[start.event];
+    Assert(f==popped);
+    // The real "note off" is dropped when it is parsed, as for any "note off" with no "note on".
+    f = none;
+    Event g(queue.back().event.time(), start.event.channel(), Event::noteOff);
+    g.setNote(start.event.note(), 0);
+    start.off = g;
+    if( g.time()>lastTime )
+        lastTime = g.time();
+    // Events not yet parsed are no earlier than the back, so the queue stays sorted.
+    push(g);
+}
+
+TuneStream::TuneStream() {
+    setWindow(30);
+}
+
+// Out of line so that state is a complete type for myState.
+TuneStream::~TuneStream() {}
+
+bool TuneStream::open(const std::string& filename) {
+    close();
+    std::unique_ptr<state> s(new state(filename, myTune));
+    if( !s->file.isOpen() ) {
+        myReadStatus = OpenFailure(filename);
+    } else {
+        try {
+            s->prepare();
+            s->rewind();
+            myState = std::move(s);
+        } catch( const Tune::parser::badFile& e ) {
+            myTune.clear();
+            myReadStatus = e.message;
+            Assert(!myReadStatus.empty());
+        }
+    }
+    return myReadStatus.empty();
+}
+
+void TuneStream::close() {
+    myState.reset();
+    myTune.clear();
+    myReadStatus.clear();
+}
+
+void TuneStream::setWindow(double seconds) {
+    myWindow = Event::timeType(seconds/SecondsPerTock);
+}
+
+void TuneStream::rewind() {
+    Assert(myState);
+    myState->rewind();
+}
+
+void TuneStream::fill() const {
+    state& s = *myState;
+    while( !s.finished ) {
+        if( !s.queue.empty() && s.queue.back().event.time()-s.queue.front().event.time()>=myWindow ) {
+            const state::entry& f = s.queue.front();
+            if( f.event.kind()==Event::noteOn && f.off.kind()!=Event::noteOff )
+                // Waiting for the "note off" of a note longer than the window could take the rest of the file.
+                s.cutFront();
+            break;
+        }
+        s.step();
+    }
+}
+
+bool TuneStream::isEnd() const {
+    fill();
+    return myState->queue.empty();
+}
+
+const Event& TuneStream::front() const {
+    fill();
+    Assert(!myState->queue.empty());
+    return myState->queue.front().event;
+}
+
+const Event& TuneStream::frontOff() const {
+    const Event& on = front();
+    const Event& off = myState->queue.front().off;
+    Assert(on.kind()==Event::noteOn);
+    Assert(off.kind()==Event::noteOff);
+    Assert(on.channel()==off.channel());
+    Assert(on.note()==off.note());
+    return off;
+}
+
+void TuneStream::pop() {
+    fill();
+    Assert(!myState->queue.empty());
+    myState->queue.pop_front();
+    ++myState->popped;
+}
+
 } // namespace Midi
\ No newline at end of file
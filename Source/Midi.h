@@ -26,12 +26,18 @@ MIDI Parsing
 #include <string>
 #include <algorithm>
 #include <cmath>
+#include <memory>
 #include "AssertLib.h"
+#include "ConversionTable.h"
+#include "Utility.h"
+
+class MappedFile;
 
 namespace Midi {
 
 class Tune;
 class ChannelMap;
+class TuneStream;
 
 //! Number of seconds per unit time increment in an Event.
 static const float SecondsPerTock = 1.0f/4096;
@@ -88,6 +94,8 @@ public:
     }
     // Absolute time of the event in tocks (not MIDI ticks).  
     timeType time() const { return myTime; }
+    // Used on copies, e.g. to resume a note part way through.
+    void setTime( timeType time ) { myTime = time; }
 
     // Kind of the event
     eventKind kind() const { return eventKind(myKind); }
@@ -109,22 +117,35 @@ public:
 
 //! Return pitch, in hertz, of MIDI note.
 inline float PitchOfNote(Event::noteType note) {
-    return 440*std::pow(1.059463094f, (int(note)-69));
+    return Synthesizer::NoteToFrequency(note);
 }
 
 class EventSeq {
     std::vector<Event> myEvents;
+    // If not null, the events are [myFirst,myLast), which is owned by someone else, and myEvents is empty.
+    const Event* myFirst;
+    const Event* myLast;
     friend class Tune;
 public:
-    typedef std::vector<Event>::const_iterator iterator;
-    iterator begin() const { return myEvents.begin(); }
-    iterator end() const { return myEvents.end(); }
+    typedef const Event* iterator;
+    EventSeq() : myFirst(nullptr), myLast(nullptr) {}
+    iterator begin() const { return myFirst ? myFirst : myEvents.data(); }
+    iterator end() const { return myFirst ? myLast : myEvents.data()+myEvents.size(); }
+    size_t size() const { return end()-begin(); }
     void clear() {
         myEvents.clear();
+        myFirst = myLast = nullptr;
     }
     void pushBack( const Event& e ) {
+        Assert(!myFirst);
         myEvents.push_back(e);
     }
+    // Refer to [first,last) without copying.  The memory must remain valid until the next call to clear.
+    void view( const Event* first, const Event* last ) {
+        clear();
+        myFirst = first;
+        myLast = last;
+    }
 };
 
 class Channel {
@@ -164,33 +185,75 @@ public:
     friend class Tune;
 };
 
-class Tune {
+class Tune: NoCopy {
     EventSeq myEventSeq;
     ChannelMap myChannelMap;
+    // For each "note on" event, in order, the number of events from it to its "note off" event.
+    SimpleArray<uint32_t> myNoteOffOffsets;
     std::string myReadStatus;
+    // Size and content hash of the MIDI file, for validating a cache.
+    uint64_t mySourceSize;
+    uint64_t mySourceHash;
+    // Cache file that myEventSeq and myNoteOffOffsets refer to, if the tune was read by loadCache.
+    std::unique_ptr<MappedFile> myCacheFile;
+    struct cacheHeader;
+public:
+    // Position in events(): index of an event, and index in noteOffOffsets() of the first "note on" at or after it.
+    struct position {
+        uint32_t event;
+        uint32_t noteOn;
+    };
+    // Seconds between the checkpoints used by seek.
+    static const unsigned checkpointSeconds = 10;
+private:
     class parser;
     friend class parser;
+    friend class TuneStream;
+    // Set myNoteOffOffsets from myEventSeq, which must be in canonical form.
+    void computeNoteOffOffsets();
+    // A place to resume playing, at time checkpointSeconds*k for the kth checkpoint.
+    struct checkpoint {
+        position start;             // First event at or after the time
+        uint32_t firstSounding;     // Notes sounding at start begin at mySoundingNotes[firstSounding]
+    };
+    std::vector<checkpoint> myCheckpoints;
+    // For each checkpoint, the "note on" events before its start whose "note off" is not.
+    std::vector<position> mySoundingNotes;
+    // Set myCheckpoints and mySoundingNotes from myEventSeq and myNoteOffOffsets.
+    void computeCheckpoints();
+    // Content hash of a MIDI file.
+    static uint64_t hashSource( const char* data, size_t size );
 #if ASSERTIONS
     // Check that Tune is in canonical form.
     bool assertOkay() const;
 #endif
 public:
-    Tune() {}
+    Tune();
+    ~Tune();
     bool empty() const {
         return myChannelMap.empty();
     }
-    void clear() {
-        myEventSeq.clear();
-        myChannelMap.clear();
-    }
+    void clear();
     // Events, sorted by time, channel, note, velocity
     const EventSeq& events() const {return myEventSeq;}
     // Number of channels
     const ChannelMap& channels() const {return myChannelMap;}
+    // For each "note on" event, in order, the number of events from it to its "note off" event.
+    const uint32_t* noteOffOffsets() const {return myNoteOffOffsets.begin();}
     // Read from a file.  Return true if successful, false otherwise.
     bool readFromFile( const std::string& filename );
+    // Read MIDI file filename via cacheFilename, which was written by writeCache.
+    // The events are used in place in the mapped cache.  Returns false, leaving the tune empty, 
+    // if the cache is missing, corrupt, or was written for a MIDI file with different content.
+    bool loadCache( const std::string& filename, const std::string& cacheFilename );
+    // Write the tune to cacheFilename.  Returns false on I/O error, or if the tune was read by loadCache.
+    bool writeCache( const std::string& cacheFilename ) const;
     // Return reason that more recent readFromFile failed, or empty string if read succeeded.
     const std::string& readStatus() const {return myReadStatus;}
+    // Return position of first event at or after time t, and set sounding to the notes that are sounding there:
+    // the "note on" events before it, paired with their "note off" events after t.
+    // The cost depends on the number of events within checkpointSeconds before t, not on t itself.
+    position seek( Event::timeType t, std::vector<std::pair<const Event*,const Event*>>& sounding ) const;
     // Invoke f(eventOn,eventOff) for all notes 
     template<typename F>
     void forEachNote(const F& f) const;
@@ -237,6 +300,47 @@ void Tune::forEachNote(const F& f) const {
     }
 }
 
+//! A MIDI file that is parsed incrementally as it is played.
+/** For very long tunes, where a Tune would hold too many events.  Opening the file checks all of it and 
+    finds its channels, but keeps no events.  Events are then parsed, merged, and paired in a window that 
+    runs ahead of the front event, so that each "note on" is available with its "note off".  The window 
+    is stretched as needed to reach the "note off" of the front event, so a note that is never turned off 
+    stretches it to the end of the file.  The events are the same as those of a Tune read from the file. */
+class TuneStream: NoCopy {
+    struct state;
+    std::unique_ptr<state> myState;
+    // Holds the channels.  Its events are always empty.
+    Tune myTune;
+    std::string myReadStatus;
+    Event::timeType myWindow;
+    // Parse until the window is full, or the end of the file is reached.
+    void fill() const;
+public:
+    TuneStream();
+    ~TuneStream();
+    // Open MIDI file filename.  Return true if successful, false otherwise.
+    bool open( const std::string& filename );
+    void close();
+    // True if no file is open.
+    bool empty() const {return !myState;}
+    // Return reason that more recent open failed, or empty string if open succeeded.
+    const std::string& readStatus() const {return myReadStatus;}
+    const ChannelMap& channels() const {return myTune.channels();}
+    // Set how far ahead of the front event the file is parsed.
+    // A note that outlasts the window is ended at the window's far edge, so that the events held stay bounded.
+    void setWindow( double seconds );
+    // Go back to the first event.
+    void rewind();
+    // True if all events have been popped.
+    bool isEnd() const;
+    // First event not yet popped.  Requires !isEnd().
+    const Event& front() const;
+    // The "note off" paired with front(), which must be a "note on".
+    const Event& frontOff() const;
+    // Discard the front event.  The references returned by front() and frontOff() become invalid.
+    void pop();
+};
+
 } // namespace Midi
 
 
@@ -20,6 +20,16 @@ public:
         myEnd = myArray+maxSize;
         myCapacity = maxSize;
     }
+    //! Create queue with no space.  Method assign must be called before use.
+    NonblockingQueue() : myPush(0), myPop(0), myArray(0), myEnd(0), myHead(0), myTail(0), myCapacity(0) {}
+    //! Use array[0:maxSize] as the queue's storage.  The array is owned by the caller.
+    /** Must be called before any other thread uses the queue. */
+    void assign( T* array, size_t maxSize ) {
+        Assert( myArray==0 );
+        myHead = myTail = myArray = array;
+        myEnd = myArray+maxSize;
+        myCapacity = maxSize;
+    }
     T& tail() {
         return *myTail;
     }
@@ -0,0 +1,76 @@
+#include "OfflineRender.h"
+#include "AssertLib.h"
+#include "Synthesizer.h"
+#include "Host.h"
+#include <cstring>
+
+namespace Midi {
+
+//! Render the tune for which preparePlay has been called on orchestra.  t0 is when rendering started.
+static OfflineRenderStats Render( Orchestra& orchestra, const std::vector<const Synthesizer::SoundSet*>& soundSets,
+                                  RenderSink& sink, const OfflineRenderConfig& config, double t0 ) {
+    Assert( config.blockSize>0 );
+    for( size_t k=0; k<soundSets.size() && k<orchestra.channels().size(); ++k )
+        if( soundSets[k] )
+            orchestra.setInstrument(Event::channelType(k), soundSets[k]->makeInstrument());
+    orchestra.commencePlay();
+
+    // Each event may send several messages (e.g. one per SoundFont zone), so dispatch a block's
+    // events in batches that cannot overflow the message queue.
+    const size_t maxEvents = Max( size_t(1), Synthesizer::GetEngineConfig().messageQueueSize/4 );
+
+    std::vector<float> buffer(2*config.blockSize);
+    float* left = &buffer[0];
+    float* right = left+config.blockSize;
+    size_t samples = 0;
+    size_t tail = 0;
+    unsigned now = Synthesizer::SampleClockNow();
+    while( tail<config.maxTail ) {
+        unsigned n;
+        if( !orchestra.isEndOfTune() ) {
+            // Render up to the first event that could not be sent.  At least one sample must be rendered
+            // so that the interrupt handler consumes the messages already sent.  The event may be overdue,
+            // so the difference is signed.
+            unsigned limit = orchestra.dispatchBefore(now+config.blockSize, maxEvents);
+            n = unsigned( Max( 1, Min( int(limit-now), int(config.blockSize) ) ) );
+        } else {
+            if( Synthesizer::ActiveVoiceCount()==0 )
+                break;
+            n = unsigned( Min( size_t(config.blockSize), config.maxTail-tail ) );
+            tail += n;
+        }
+        std::memset( left, 0, n*sizeof(float) );
+        std::memset( right, 0, n*sizeof(float) );
+        Synthesizer::OutputInterruptHandler( left, right, n );
+        sink.write( left, right, n );
+        samples += n;
+        now += n;
+    }
+    // Release keys still down, so that no voice that outlasted maxTail refers to the instruments
+    // that the orchestra deletes.
+    orchestra.stop();
+
+    OfflineRenderStats stats;
+    stats.samples = samples;
+    stats.seconds = HostClockTime()-t0;
+    return stats;
+}
+
+OfflineRenderStats RenderOffline( const Tune& tune, const std::vector<const Synthesizer::SoundSet*>& soundSets,
+                                  RenderSink& sink, const OfflineRenderConfig& config ) {
+    double t0 = HostClockTime();
+    Orchestra orchestra;
+    orchestra.preparePlay(tune);
+    return Render( orchestra, soundSets, sink, config, t0 );
+}
+
+OfflineRenderStats RenderOffline( TuneStream& stream, const std::vector<const Synthesizer::SoundSet*>& soundSets,
+                                  RenderSink& sink, const OfflineRenderConfig& config ) {
+    double t0 = HostClockTime();
+    Orchestra orchestra;
+    // Rewinds the stream
+    orchestra.preparePlay(stream);
+    return Render( orchestra, soundSets, sink, config, t0 );
+}
+
+} // namespace Midi
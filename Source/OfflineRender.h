@@ -0,0 +1,66 @@
+/* Copyright 2014 Arch D. Robison
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/******************************************************************************
+Rendering a MIDI tune faster than real time, without an audio device
+*******************************************************************************/
+
+#ifndef OfflineRender_H
+#define OfflineRender_H
+
+#include <vector>
+#include "Midi.h"
+#include "Orchestra.h"
+#include "RenderSink.h"
+#include "Waveform.h"
+
+namespace Midi {
+
+//! Parameters for RenderOffline.
+struct OfflineRenderConfig {
+    //! Maximum number of samples per call of Synthesizer::OutputInterruptHandler and RenderSink::write.
+    /** Larger blocks amortize per-block overhead.  Events are dispatched on their exact sample regardless. */
+    unsigned blockSize;
+    //! Maximum number of samples rendered after the last event, while released voices die away.
+    unsigned maxTail;
+    OfflineRenderConfig() : blockSize(4096), maxTail(10*Synthesizer::SampleRate) {}
+};
+
+//! Result of RenderOffline.
+struct OfflineRenderStats {
+    size_t samples;             //!< Samples written to each channel of the sink
+    double seconds;             //!< Wall-clock time taken
+    //! Throughput in samples (per channel) per second.
+    double samplesPerSecond() const {return seconds>0 ? samples/seconds : 0;}
+    //! How many times faster than real time the rendering ran.
+    double realTimeFactor() const {return samplesPerSecond()/Synthesizer::SampleRate;}
+};
+
+//! Render tune in stereo to sink as fast as the processor allows.
+/** soundSets[k] is the SoundSet for channel k.  Channels without an entry, or with a null entry, get the
+    same default instrument as Orchestra::commencePlay would give them.
+    The synthesizer must have been initialized, and nothing else may call Synthesizer::OutputInterruptHandler
+    or Synthesizer::Play while rendering is in progress. */
+OfflineRenderStats RenderOffline( const Tune& tune, const std::vector<const Synthesizer::SoundSet*>& soundSets,
+                                  RenderSink& sink, const OfflineRenderConfig& config=OfflineRenderConfig() );
+
+//! Render stream from its beginning, as for RenderOffline of a Tune.
+/** Only the stream's look-ahead window of events is held in memory, so arbitrarily long tunes can be rendered. */
+OfflineRenderStats RenderOffline( TuneStream& stream, const std::vector<const Synthesizer::SoundSet*>& soundSets,
+                                  RenderSink& sink, const OfflineRenderConfig& config=OfflineRenderConfig() );
+
+} // namespace Midi
+
+#endif /* OfflineRender_H */
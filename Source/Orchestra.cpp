@@ -109,11 +109,14 @@ void AdditiveInstrument::noteOn(const Midi::Event& on, const Midi::Event& off) {
     Assert(on.channel()==off.channel());
     // Input parsing should remove on-without-off
     Assert(!keyArray[n]);
-    float freq = Key440AFreq*(std::pow(1.059463094f, (int(n)-69))*(1+(counter+=19)%32*(.005f/32)));
+    float freq = Key440AFreq*(Synthesizer::CentsToRatio((int(n)-69)*100)*(1+(counter+=19)%32*(.005f/32)));
     float speed = KeyAttack.size()*(16.f/Synthesizer::SampleRate);
     Synthesizer::AsrSource* k = Synthesizer::AsrSource::allocate(KeyWave, freq, KeyAttack, speed);
     // N.B. k is nullptr if allocation failed.  
     keyArray[n] = k;
+    if( k )
+        // Steal may clear keyArray[n]
+        k->setHolder(keyArray[n]);
     Play(k, v*(1.0f/512));
 }
 
@@ -160,13 +163,42 @@ Orchestra::~Orchestra() {
 }
 
 void Orchestra::preparePlay( const Tune& tune ) {
-    clear();
+    myStream = nullptr;
     myTune = &tune;
-    computeDuration(tune);
-    myDurationPtr = myDuration.begin();
+    myDurationPtr = tune.noteOffOffsets();
     myEventPtr = tune.events().begin();
     myEndPtr = tune.events().end();
-    myEnsemble.resize(tune.channels().size(),nullptr);
+    prepareChannels(tune.channels());
+}
+
+void Orchestra::preparePlay( TuneStream& stream ) {
+    stream.rewind();
+    myStream = &stream;
+    myTune = nullptr;
+    myDurationPtr = nullptr;
+    myEventPtr = myEndPtr = nullptr;
+    prepareChannels(stream.channels());
+}
+
+void Orchestra::prepareChannels( const ChannelMap& channels ) {
+    clear();
+    myChannels = &channels;
+    myEnsemble.resize(channels.size(),nullptr);
+    myResumedNotes.clear();
+    myStartTime = 0;
+    myHaveSampleTime0 = false;
+    // Start creating default instruments now, so that they are likely ready by commencePlay.
+    std::vector<unsigned> programs;
+    for( size_t k=0; k<channels.size(); ++k )
+        programs.push_back(channels[k].program());
+    PreloadDefaultSoundSets(programs);
+}
+
+bool Orchestra::isReadyToCommence() const {
+    for( unsigned k=0; k<myEnsemble.size(); ++k )
+        if( !myEnsemble[k] && !IsDefaultSoundSetReady((*myChannels)[k].program()) )
+            return false;
+    return true;
 }
 
 void Orchestra::commencePlay() {
@@ -174,7 +206,7 @@ void Orchestra::commencePlay() {
     for( unsigned k=0; k<myEnsemble.size(); ++k ) {
         Instrument*& i = myEnsemble[k];
         if(!i) {
-            const Channel& c = myTune->channels()[k];
+            const Channel& c = (*myChannels)[k];
             try {
                 const auto* s = GetDefaultSoundSet(c.program());
                 if( s )
@@ -186,13 +218,13 @@ void Orchestra::commencePlay() {
             }
         }
         if(!i) {
-            if(myTune->channels()[k].isDrum() )
+            if((*myChannels)[k].isDrum() )
                 i = new NullInstrument();       // FIXME
             else
                 i = new AdditiveInstrument();
         }
     }
-    myTune = nullptr;
+    myChannels = nullptr;
 }
 
 void Orchestra::stop() {
@@ -200,76 +232,110 @@ void Orchestra::stop() {
         i->stop();
 }
 
-/** Since this routine is tightly tied to method update, please keep it lexically close
-    to that method, so that the correspondence can be checked. */
-void Orchestra::computeDuration( const Tune& tune ) {
-    myDuration.clear();
-    NoteTracker<std::pair<const Event*, size_t>> noteStart(tune);
-    for( const Event& e: tune.events() )
-        switch( e.kind() ) {
-            case Event::noteOn:
-            case Event::noteOff: {
-                auto& start = noteStart[e];
-                if(const Event* on = start.first) {
-                    Assert(on->note()==e.note());
-                    // FIXME - should check if difference really fits
-                    myDuration[start.second] = &e-on;
-                    start.first = nullptr;
-                }
-                if( e.kind()==Event::noteOn ) {
-                    start.first = &e;
-                    start.second = myDuration.size();
-                    myDuration.push_back(0);
-                }
-                break;
-            }
-        }
-#if ASSERTIONS
-    noteStart.forEach([](const std::pair<const Event*, size_t>& start) {
-        // Input parsing should canonicalize input so that for any note, 
-        // there is an off for every on, and off precedes next on
-        Assert(!start.first);
-    });
-    auto d = myDuration.begin();
-    Event::timeType t = 0;
-    for(const Event& e: tune.events()) {
-        Assert(e.time()>=t);
-        t = e.time();
-        if( e.kind()==Event::noteOn ) {
-            Assert(d<myDuration.end());
-            const Event& off = (&e)[*d];
-            Assert(e.note()==off.note());
-            Assert(e.channel()==off.channel());
-            ++d;
-        }
+void Orchestra::seek(double seconds) {
+    Assert(canSeek());
+    // Release the keys that are down.  Before commencePlay, there are no instruments yet.
+    for(Instrument* i: myEnsemble)
+        if( i )
+            i->stop();
+    myStartTime = Event::timeType(Max(0.0,seconds)/SecondsPerTock);
+    myResumedNotes.clear();
+    std::vector<std::pair<const Event*,const Event*>> sounding;
+    Tune::position p = myTune->seek(myStartTime, sounding);
+    myEventPtr = myTune->events().begin()+p.event;
+    myDurationPtr = myTune->noteOffOffsets()+p.noteOn;
+    for( auto& n: sounding )
+        myResumedNotes.push_back(std::make_pair(*n.first,*n.second));
+    for( auto& n: myResumedNotes )
+        n.first.setTime(myStartTime);
+    // Map the new position to the sample clock on the next update or dispatchBefore.
+    myHaveSampleTime0 = false;
+}
+
+void Orchestra::resumeNotes() {
+    for( auto& n: myResumedNotes ) {
+        Synthesizer::ScheduleAt( sampleTimeOf(n.first) );
+        myEnsemble[n.first.channel()]->noteOn(n.first,n.second);
     }
-#endif
+    myResumedNotes.clear();
 }
 
+//! How far ahead of time events are sent to the synthesizer, in seconds.
+/** Must exceed the interval between calls to Orchestra::update plus the synthesizer's 
+    block interval, otherwise events sound late.  */
+static const double ScheduleLookahead = 0.05;
+
 void Orchestra::update(double secondsSinceTime0) {
     Assert(Key440AFreq>0);
 
-    // Get current time in MIDI "tick" units
-    auto t = Event::timeType(secondsSinceTime0/SecondsPerTock);
+    const unsigned lookahead = unsigned(ScheduleLookahead*Synthesizer::SampleRate);
+    if( !myHaveSampleTime0 ) {
+        // Map tune time to sample clock.  The lookahead becomes a fixed latency.
+        // secondsSinceTime0 may be less than the lookahead, so convert the terms separately to keep them non-negative.
+        mySampleTime0 = Synthesizer::SampleClockNow() + lookahead - unsigned(Max(0.0,secondsSinceTime0)*Synthesizer::SampleRate);
+        myHaveSampleTime0 = true;
+        resumeNotes();
+    }
+
+    // Get time up to which to dispatch, in MIDI "tick" units.  It is measured on the sample clock that the events
+    // are scheduled against, since the host clock would drift from it over a long piece.  The sample clock
+    // trails mySampleTime0 by at most the lookahead, so the sum does not wrap around.
+    unsigned s = Synthesizer::SampleClockNow() - mySampleTime0 + lookahead;
+    auto t = Event::timeType(s/double(SecondsPerTock*Synthesizer::SampleRate));
 
     // Process MIDI events up to time t
-    for( ; myEventPtr<myEndPtr && myEventPtr->time()<=t; ++myEventPtr) {
-        auto& e = *myEventPtr;
-        switch(e.kind()) {
-            case Event::noteOn: {
-                const Event& off = myEventPtr[*myDurationPtr];
-                Assert(e.note()==off.note());
-                Assert(e.channel()==off.channel());
-                Instrument* i = myEnsemble[e.channel()];
-                i->noteOn(e,off);
-                ++myDurationPtr;
-                break;
-            }
-            case Event::noteOff:
-                myEnsemble[e.channel()]->noteOff(e);
-                break;
+    while( !isEndOfTune() && nextEvent().time()<=t )
+        dispatchNext();
+    Synthesizer::ScheduleNow();
+}
+
+unsigned Orchestra::sampleTimeOf(const Event& e) const {
+    Assert(myHaveSampleTime0);
+    return mySampleTime0 + unsigned(e.time()*double(SecondsPerTock*Synthesizer::SampleRate));
+}
+
+void Orchestra::dispatchNext() {
+    auto& e = nextEvent();
+    Synthesizer::ScheduleAt( sampleTimeOf(e) );
+    switch(e.kind()) {
+        case Event::noteOn: {
+            const Event& off = myStream ? myStream->frontOff() : myEventPtr[*myDurationPtr++];
+            Assert(e.note()==off.note());
+            Assert(e.channel()==off.channel());
+            Instrument* i = myEnsemble[e.channel()];
+            i->noteOn(e,off);
+            break;
+        }
+        case Event::noteOff:
+            myEnsemble[e.channel()]->noteOff(e);
+            break;
+    }
+    if( myStream )
+        myStream->pop();
+    else
+        ++myEventPtr;
+}
+
+unsigned Orchestra::dispatchBefore(unsigned limit, size_t maxEvents) {
+    Assert(Key440AFreq>0);
+
+    if( !myHaveSampleTime0 ) {
+        mySampleTime0 = Synthesizer::SampleClockNow() - unsigned(myStartTime*double(SecondsPerTock*Synthesizer::SampleRate));
+        myHaveSampleTime0 = true;
+        resumeNotes();
+    }
+    for( ; !isEndOfTune(); --maxEvents ) {
+        unsigned s = sampleTimeOf(nextEvent());
+        if( int(s-limit)>=0 )
+            break;
+        if( maxEvents==0 ) {
+            limit = s;
+            break;
         }
+        dispatchNext();
     }
+    Synthesizer::ScheduleNow();
+    return limit;
 }
 
 } // namespace Midi
\ No newline at end of file
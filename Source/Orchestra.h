@@ -38,38 +38,82 @@ public:
 class Orchestra {
     typedef std::vector<Instrument*> ensembleType;
     ensembleType myEnsemble;
-    std::vector<uint16_t> myDuration;
     EventSeq::iterator myEventPtr;
     EventSeq::iterator myEndPtr;
-    std::vector<uint16_t>::const_iterator myDurationPtr;
-    const Midi::Tune* myTune;
+    //! Points to Tune::noteOffOffsets entry for next "note on" event.
+    const uint32_t* myDurationPtr;
+    //! If not null, events come from this stream instead of [myEventPtr,myEndPtr).
+    TuneStream* myStream;
+    //! Tune passed to preparePlay, or nullptr if playing a stream.
+    const Tune* myTune;
+    const ChannelMap* myChannels;
+    //! Notes that seek found sounding, each with its "note on" moved to the time sought.  Sent by resumeNotes.
+    std::vector<std::pair<Event,Event>> myResumedNotes;
+    //! Time of the tune at which playing starts.
+    Event::timeType myStartTime;
+    //! Sample clock value corresponding to time 0 of the tune.  Valid only if myHaveSampleTime0.
+    unsigned mySampleTime0;
+    bool myHaveSampleTime0;
     Orchestra( const Orchestra& ) = delete;
     void operator=( const Orchestra& ) = delete;
-    void clear();
-    void computeDuration(const Tune& tune);
+    //! Set up myEnsemble for the given channels.  Part of preparePlay.
+    void prepareChannels(const ChannelMap& channels);
+    //! Sample clock time at which e should sound.  Requires myHaveSampleTime0.
+    unsigned sampleTimeOf(const Event& e) const;
+    //! Send myResumedNotes to their instruments.  Requires myHaveSampleTime0.
+    void resumeNotes();
+    //! Next event to dispatch.  Requires !isEndOfTune().
+    const Event& nextEvent() const {
+        return myStream ? myStream->front() : *myEventPtr;
+    }
+    //! Send next event to its instrument, scheduled for its exact sample, and advance past it.
+    void dispatchNext();
 public:
     //! Construct player with no tune to play.
-    Orchestra() : myTune(nullptr) {}
+    Orchestra() : myStream(nullptr), myTune(nullptr), myChannels(nullptr), myStartTime(0), myHaveSampleTime0(false) {}
     ~Orchestra();
+    //! Destroy the instruments, releasing their notes.  preparePlay makes new ones.
+    void clear();
     //! Prepare to play tune
     void preparePlay(const Tune& tune);
-    //! Tune passed to preparePlay.  Valid until commencePlay is called.
-    const Midi::Tune& tune() const {return *myTune;}
+    //! Prepare to play stream from its beginning.  The stream must remain open until play is stopped.
+    void preparePlay(TuneStream& stream);
+    //! Channels of the tune passed to preparePlay.  Valid until commencePlay is called.
+    const ChannelMap& channels() const {return *myChannels;}
     //! May be called between preparePlay and commencePlay to assign an instrument.
     /** Instrument will eventually be deleted with "delete". */
     void setInstrument(Event::channelType k, Instrument* i) {
         myEnsemble[k] = i;
     }
+    //! True if commencePlay would not have to wait for default instruments to be created.
+    /** Default instruments are created on worker threads, starting at preparePlay. */
+    bool isReadyToCommence() const;
     //! Assign default instruments and commence playing tune
     void commencePlay();
     //! Stop current tune
     void stop();
+    //! Move to the given time of the tune, and restart the notes sounding there.
+    /** May be called after preparePlay, before or after commencePlay.  Subsequent calls to update must pass 
+        secondsSinceTime0 measured from the start of the tune, i.e. starting at about seconds.
+        The cost depends on the density of the events, not on how far into the tune seconds is.
+        Requires canSeek(). */
+    void seek(double seconds);
+    //! True if seek is supported.  It is not for a TuneStream, which would have to be parsed up to the time sought.
+    bool canSeek() const {return myTune!=nullptr;}
     //! Update player
-    /** Should be polled rapidly (e.g. at video frame rate) */
+    /** Should be polled rapidly (e.g. at video frame rate).  Events are sent to the synthesizer
+        somewhat ahead of time, and scheduled for the exact sample on which they should sound.
+        secondsSinceTime0 is used only by the first call after preparePlay or seek, to map the tune to the
+        sample clock.  Afterwards the sample clock alone decides which events are due. */
     void update(double secondsSinceTime0);
+    //! Send events that sound before sample clock time limit, but at most maxEvents of them.
+    /** Used for offline rendering, where the caller drives OutputInterruptHandler itself.
+        The first call after preparePlay or seek maps the time at which playing starts to the current sample clock.
+        Returns limit if all such events were sent, otherwise the sample time of the first unsent event. */
+    unsigned dispatchBefore(unsigned limit, size_t maxEvents);
     // True if end of tune reached.  
     bool isEndOfTune() const {
-        return myEventPtr>=myEndPtr;
+        return myStream ? myStream->isEnd() : myEventPtr>=myEndPtr;
     }
 };
 
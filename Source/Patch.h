@@ -70,7 +70,7 @@ public:
         Assert(isLooping());
         return myLoopEnd;
     }
-    timeType soundEnd() const {return size()<<Waveform::timeShift;}
+    timeType soundEnd() const {return size()<<timeShift;}
     float sampleRate() const {return mySampleRate;}
     float pitch() const {return myRootFreq;}
 };
@@ -15,6 +15,10 @@ class PoolAllocator {
     T* avail;
     //! Pointer to list of free items
     T* free;
+    //! Start of block, regardless of freeWhenDestroyed.
+    T* first;
+    //! Number of items allocated and not yet destroyed.
+    size_t inUse;
     static T*& next(T* item) {return *(T**)(void*)item;}
 public:
     PoolAllocator( size_t maxSize, bool freeWhenDestroyed=true ) {
@@ -23,8 +27,22 @@ public:
         end = p + maxSize;
         avail = p;
         free = NULL;
+        first = p;
+        inUse = 0;
         begin = freeWhenDestroyed ? p : NULL;
     }
+    //! Create pool with no space.  Method assign must be called before allocating from it.
+    PoolAllocator() : begin(NULL), end(NULL), avail(NULL), free(NULL), first(NULL), inUse(0) {}
+    //! Manage block[0:maxSize] from now on.  The block is owned by the caller.
+    /** Pool must have no items in use. */
+    void assign( void* block, size_t maxSize ) {
+        Assert( sizeof(T)>=sizeof(T*) );
+        Assert( inUse==0 );
+        Assert( !begin );
+        first = avail = (T*)block;
+        end = first + maxSize;
+        free = NULL;
+    }
     ~PoolAllocator() {
         if( begin ) {
 #if ASSERTIONS
@@ -48,6 +66,8 @@ public:
             // Return ponter to fresh memory.
             result = avail++;
         } 
+        if( result )
+            ++inUse;
         return result;
     }
     //! Call destructor for *x and deallocate it.   Deallocation takes O(1) time.
@@ -59,7 +79,16 @@ public:
 #endif
         next(x) = free;
         free = x;
+        --inUse;
     }
+    //! Number of items that can be allocated before allocate returns NULL.
+    size_t available() const {return (end-first)-inUse;}
+    //! True if x points into memory managed by this allocator.
+    bool contains( const void* x ) const {return first<=x && x<end;}
+    //! Start of memory managed by this allocator
+    const void* blockBegin() const {return first;}
+    //! End of memory managed by this allocator
+    const void* blockEnd() const {return end;}
 };
 
 #endif /* PoolAllocator_H */
\ No newline at end of file
@@ -0,0 +1,20 @@
+/******************************************************************************
+ Receiver of rendered stereo output
+*******************************************************************************/
+
+#ifndef RenderSink_H
+#define RenderSink_H
+
+namespace Midi {
+
+//! Receiver of the stereo output of RenderOffline.
+class RenderSink {
+public:
+    //! Consume next n samples of each channel.  The arrays are valid only during the call.
+    virtual void write( const float* left, const float* right, unsigned n ) = 0;
+    virtual ~RenderSink() {}
+};
+
+} // namespace Midi
+
+#endif /* RenderSink_H */
@@ -1,6 +1,7 @@
 #include "SF2Bank.h"
 #include "SF2Reader.h"
 #include "SF2SoundSet.h"
+#include "ReadError.h"
 #include <algorithm>
 #include <vector>
 
@@ -98,11 +99,58 @@ void SF2Bank::dump( const std::string& filename ) {
     fclose(d);
 }
 
-void SF2Bank::load( const std::string& filename ) {
+void SF2Bank::reset() {
+    // Live sound sets, and the voices playing them, view the samples about to be unmapped.
+    Assert(soundSetCount==0);
+    // Release arrays before the mappings that they might view.
+    sampleViews.clear();
+    viewStatus.clear();
+    viewLevels.clear();
+    samples.clear();
+    phdr.clear();
+    inst.clear();
+    shdr.clear();
+    for( bagModGen* b: {&p,&i} ) {
+        b->bag.clear();
+        b->mod.clear();
+        b->gen.clear();
+    }
+    phdrMap.clear();
+    cacheFirstLevel.clear();
+    cacheLevels.clear();
+    cacheLevelData = nullptr;
+    mappedFile.reset();
+    cacheFile.reset();
+    sourceName.clear();
+    sourceSize = sourceTime = 0;
+}
+
+void SF2Bank::initializeViews() {
+    // Views are built lazily by sampleView.
+    sampleViews.resize(shdr.size());
+    viewStatus.resize(shdr.size());
+    std::fill( viewStatus.begin(), viewStatus.end(), viewStatusType::absent );
+    viewLevels.resize(shdr.size());
+}
+
+void SF2Bank::load( const std::string& filename, bool mapSamples ) {
+    reset();
     SF2Reader r;
-    r.open(filename);
+    if( mapSamples ) {
+        mappedFile.reset(new MappedFile(filename.c_str()));
+        if( !mappedFile->isOpen() ) {
+            mappedFile.reset();
+            throw ReadError("cannot map "+filename);
+        }
+        r.open(mappedFile->begin(),mappedFile->size());
+    } else {
+        r.open(filename);
+    }
     r.read(*this);
     r.close();
+    if( HostGetFileInfo(filename.c_str(),sourceSize,sourceTime) )
+        sourceName = filename;
+    initializeViews();
 }
 
 void SF2Bank::createIndex() {
@@ -139,6 +187,7 @@ bool SF2Bank::constructPlayInfo( noteVelocityRange& r, playInfo& pi, const Rec_g
     // Set default values
     pi.index = uint16_t(~0u);
     pi.releaseVolEnv = -12000;
+    pi.initialAttenuation = 0;
     pi.sampleModes = 0;
     pi.overridingRootKey = -1;
 
@@ -148,6 +197,9 @@ bool SF2Bank::constructPlayInfo( noteVelocityRange& r, playInfo& pi, const Rec_g
             case Generator::releaseVolEnv:
                 pi.releaseVolEnv = g->amount.int16;
                 break;
+            case Generator::initialAttenuation:
+                pi.initialAttenuation = g->amount.int16;
+                break;
             case Generator::instrument:
             case Generator::sampleId:
                 pi.index = g->amount.uint16;
@@ -224,6 +276,59 @@ SF2Bank::indexMap::indexMap( const std::vector<std::vector<std::pair<noteVelocit
     myArray.resize(e-myArray.begin());
 }
 
+unsigned SF2Bank::mipLevelsNeeded( const noteVelocityRange& r, const playInfo& pi, bool isDrum ) const {
+    const Rec_shdr& sh = shdr[pi.index];
+    int originalKey = pi.overridingRootKey>=0 ? pi.overridingRootKey : sh.originalPitch;
+    // The highest note steps fastest.  A drum plays every note at its original key.
+    int note = isDrum ? originalKey : r.note.high;
+    SF2Sample::timeType delta = SF2Sample::step( float(sh.sampleRate), (note-originalKey)*100+sh.pitchCorrection );
+    return Min( SF2Sample::mipLevelsFor(delta), maxMipLevels );
+}
+
+const SF2Sample& SF2Bank::sampleView( unsigned k, unsigned levels ) {
+    SF2Sample& w = sampleViews[k];
+    std::unique_lock<std::mutex> lock(viewMutex);
+    // Another thread might be building the view.
+    viewReady.wait( lock, [&]{return viewStatus[k]!=viewStatusType::building;} );
+    if( viewStatus[k]==viewStatusType::absent ) {
+        auto& sh = shdr[k];
+        // SoundFont requires 46 zeros after each sample, so samples[sh.end] serves as the guard sample.
+        w.view( samples.begin()+sh.start, sh.end-sh.start );
+        w.mySampleRate = sh.sampleRate;
+        w.myOriginalPitch = sh.originalPitch;
+        w.myPitchCorrection = sh.pitchCorrection;
+        w.myLoopStart = (sh.startLoop-sh.start)*w.unitTime;
+        w.myLoopEnd = (sh.endLoop-sh.start)*w.unitTime;
+        viewLevels[k] = 0;
+        if( cacheFile ) {
+            // Levels were built by the process that wrote the cache, for every instrument that uses the sample.
+            for( uint32_t j=cacheFirstLevel[k]; j<cacheFirstLevel[k+1]; ++j )
+                w.appendMipLevelView( cacheLevelData+cacheLevels[j].offset, size_t(cacheLevels[j].size) );
+            viewLevels[k] = maxMipLevels;
+        }
+        viewStatus[k] = viewStatusType::ready;
+    }
+    if( viewLevels[k]<levels ) {
+        // Build without holding the lock, so that other threads can build other views.
+        viewStatus[k] = viewStatusType::building;
+        lock.unlock();
+        try {
+            w.buildMipLevels(levels);
+        } catch( ... ) {
+            // Levels that were completed are kept.  The next caller will try for the rest.
+            lock.lock();
+            viewStatus[k] = viewStatusType::ready;
+            viewReady.notify_all();
+            throw;
+        }
+        lock.lock();
+        viewLevels[k] = uint8_t(levels);
+        viewStatus[k] = viewStatusType::ready;
+        viewReady.notify_all();
+    }
+    return w;
+}
+
 SF2SoundSet* SF2Bank::createSoundSet( unsigned preset, unsigned bank ) {
     phdrMapItem k;
     k.setLookupKey(preset,bank);
@@ -252,24 +357,31 @@ SF2SoundSet* SF2Bank::createSoundSet( unsigned preset, unsigned bank ) {
     }
     indexMap sampleIdMap( instrumentList );
 
-    // Get samples and add them to s
-    s.mySamples.resize(sampleIdMap.size());
-    for( unsigned si=0; si<sampleIdMap.size(); ++si ) {
-        auto& sh = this->shdr[sampleIdMap[si]];
-        Assert(samples[sh.end]==0);
-        SF2Sample& w = s.mySamples[si];
-        size_t n = sh.end-sh.start;
-        w.resize(n);
-        std::transform( samples.begin()+sh.start, samples.begin()+sh.end, w.begin(), [&]( int in ) {
-            return in*(1.0f/32767);
-        });
-        w.complete(false);
-        w.mySampleRate = sh.sampleRate;
-        w.myOriginalPitch = sh.originalPitch;
-        w.myPitchCorrection = sh.pitchCorrection;
-        w.myLoopStart = (sh.startLoop-sh.start)*w.unitTime;
-        w.myLoopEnd = (sh.endLoop-sh.start)*w.unitTime;
+    // Find how many mip levels of each sample the notes of s need.
+    std::vector<uint8_t> levels(sampleIdMap.size(),0);
+    for( const auto& list: instrumentList )
+        for( const auto& z: list ) {
+            uint8_t& l = levels[sampleIdMap.find(z.second.index)];
+            l = Max( l, uint8_t(mipLevelsNeeded(z.first,z.second,s.myIsDrum)) );
+        }
+
+    // Add samples to s.  They are shared with other sound sets, so only the first use of a sample costs more than O(1).
+    if( mappedFile ) {
+        // Start paging in the samples that will be played in place, so that the audio thread does not fault on them.
+        // Samples that need more mip levels are skipped, since building the levels reads them right away.
+        std::lock_guard<std::mutex> lock(viewMutex);
+        for( unsigned si=0; si<sampleIdMap.size(); ++si ) {
+            unsigned k = sampleIdMap[si];
+            bool inPlace = viewStatus[k]==viewStatusType::absent ? levels[si]==0 || cacheFile : viewLevels[k]>=levels[si];
+            if( inPlace ) {
+                auto& sh = shdr[k];
+                HostPrefetchFile( (const char*)(samples.begin()+sh.start), (sh.end-sh.start+1)*sizeof(int16_t) );
+            }
+        }
     }
+    s.mySamples.resize(sampleIdMap.size());
+    for( unsigned si=0; si<sampleIdMap.size(); ++si )
+        s.mySamples[si] = &sampleView(sampleIdMap[si],levels[si]);
 
     // Add instruments to s
     s.myInstrumentMap.resize(instrumentList.size());
@@ -281,5 +393,7 @@ SF2SoundSet* SF2Bank::createSoundSet( unsigned preset, unsigned bank ) {
     // Add presets to s
     instrumentMap.crunch(presetList);
     s.myPresetMap.initialize(presetList.data(), presetList.size());
+    s.myBank = this;
+    ++soundSetCount;
     return &s;
 }
\ No newline at end of file
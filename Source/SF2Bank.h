@@ -6,7 +6,13 @@
 #include <cstdio>
 #include <cmath>
 #include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "Utility.h"
+#include "ConversionTable.h"
+#include "MappedFile.h"
 #include "SF2SoundSet.h"
 
 class SF2Bank {
@@ -55,7 +61,7 @@ class SF2Bank {
             uint8_t val8[2];
         };
         // Volume envelope in sec
-        float volEnvSec() const {return exp2(int16/1200.f);}
+        float volEnvSec() const {return Synthesizer::TimecentsToSeconds(int16);}
     };
 
     enum class SampleLink : uint16_t {
@@ -118,7 +124,30 @@ class SF2Bank {
     SimpleArray<Rec_inst,1> inst;
     bagModGen i;
     SimpleArray<Rec_shdr,1> shdr;
+    //! All samples in the file.  A view into *mappedFile if the bank was loaded with mapSamples=true.
     SimpleArray<int16_t> samples;
+    std::unique_ptr<MappedFile> mappedFile;
+    //! Element k is the view of the sample described by shdr[k], if viewStatus[k]==ready.
+    /** Shared by all sound sets created from the bank. */
+    SimpleArray<SF2Sample> sampleViews;
+    enum class viewStatusType : uint8_t {
+        absent,
+        building,
+        ready
+    };
+    //! Element k is status of sampleViews[k].  Guarded by viewMutex.
+    SimpleArray<viewStatusType> viewStatus;
+    //! Element k is the number of mip levels that sampleViews[k] has been asked for.  Guarded by viewMutex.
+    SimpleArray<uint8_t> viewLevels;
+    std::mutex viewMutex;
+    //! Signaled when a view becomes ready.
+    std::condition_variable viewReady;
+    //! Notes may be transposed up to 256x.  See SF2Source::allocate.
+    static const unsigned maxMipLevels = 8;
+    //! Get view for shdr[k], building it on first use, with at least the given number of mip levels if it can have them.
+    /** Thread safe.  Levels are added to a view that is in use only beyond those that its users asked for, 
+        which mipLevelFor never reads when given the steps that they were asked for. */
+    const SF2Sample& sampleView( unsigned k, unsigned levels );
     
     class phdrMapItem {
         uint16_t preset;
@@ -137,6 +166,33 @@ class SF2Bank {
     SimpleArray<phdrMapItem> phdrMap;
     void createIndex();
 
+    // Identity of the SoundFont file, for validating a cache.
+    std::string sourceName;
+    uint64_t sourceSize;
+    uint64_t sourceTime;
+
+    // Members used if the bank was loaded by loadCache.  See SF2BankCache.cpp for the file format.
+    struct cacheHeader;
+    struct cacheLevel {
+        uint64_t offset;            // Offset of level's samples from cacheLevelData
+        uint64_t size;              // Number of samples, not counting the guard sample
+    };
+    std::unique_ptr<MappedFile> cacheFile;
+    //! Mip levels of shdr[k] are cacheLevels[cacheFirstLevel[k]:cacheFirstLevel[k+1]].
+    SimpleArray<uint32_t,1> cacheFirstLevel;
+    SimpleArray<cacheLevel> cacheLevels;
+    const int16_t* cacheLevelData;
+
+    //! Number of sets returned by createSoundSet that have not been deleted.
+    /** Their samples view the mappings, so the bank must not be reset while any remain. */
+    std::atomic<unsigned> soundSetCount;
+    friend class SF2SoundSet;
+
+    //! Make bank empty and release its mappings.  Requires soundSetCount==0.
+    void reset();
+    //! Set up sampleViews for freshly loaded shdr.
+    void initializeViews();
+
     void dumpGen(FILE* f, const Rec_gen& g) const;
 
     friend class SF2Reader;
@@ -144,14 +200,33 @@ class SF2Bank {
     typedef SF2SoundSet::noteVelocityRange noteVelocityRange;
     class indexMap;
     bool constructPlayInfo( noteVelocityRange& r, playInfo& pi, const Rec_gen* first, const Rec_gen* last ) const;
+    //! Number of mip levels of shdr[pi.index] needed to play the notes in r.
+    unsigned mipLevelsNeeded( const noteVelocityRange& r, const playInfo& pi, bool isDrum ) const;
     template<typename Container>
     void constructPlayInfoList( Container& list, unsigned firstZone, unsigned lastZone, const bagModGen& b );
 public:
-    SF2Bank() {}
+    SF2Bank() : sourceSize(0), sourceTime(0), cacheLevelData(nullptr), soundSetCount(0) {}
     bool empty() const {return phdrMap.size()==0;}
-    void load( const std::string& filename );
+    //! Load a SoundFont file.  Throws ReadError if the file cannot be read.
+    /** Every SoundSet created from the previous contents must have been deleted.  If mapSamples is true, the file is mapped into memory and only the hydra is read eagerly.  Sample data
+        is paged in by the OS when a SoundSet that uses it is created, and since the pages are backed by the file,
+        the OS can evict them under memory pressure. */
+    void load( const std::string& filename, bool mapSamples=false );
+    //! Load SoundFont filename via cacheFilename, which was written by writeCache.
+    /** Nothing is parsed or decimated: the tables and mip levels are used in place in the mapped cache, and samples
+        in the mapped SoundFont, as for load(filename,true).  Every SoundSet created from the previous contents
+        must have been deleted.  Returns false, leaving the bank empty, if the cache 
+        is missing, corrupt, from another version, or does not match the size and time of filename. */
+    bool loadCache( const std::string& filename, const std::string& cacheFilename );
+    //! Build the mip levels that instruments might need of each sample, and write them with the tables to cacheFilename.
+    /** Returns false on I/O error.  The bank must have been loaded with mapSamples=true.  May be called concurrently with createSoundSet.
+        The levels of each sample are freed once written, so they do not stay resident.  If cancel is not null
+        and *cancel becomes true, stops early, removes the partial file, and returns false. */
+    bool writeCache( const std::string& cacheFilename, const std::atomic<bool>* cancel=nullptr );
     void dump( const std::string& filename );
     //! Returns nullptr if instrument/bank combination does not exit.
+    /** The SoundSet refers to samples owned by the bank, so it must be deleted before the bank is destroyed
+        or loaded again.  May be called concurrently by multiple threads, but not concurrently with load. */
     SF2SoundSet* createSoundSet( unsigned preset, unsigned bank );
 };
 
@@ -0,0 +1,236 @@
+/******************************************************************************
+ Cache of a parsed SoundFont bank, with the mip levels of its samples.
+
+ The cache file is laid out so that it can be mapped and used in place:
+
+     cacheHeader
+     path of SoundFont file (header.pathSize bytes, no terminating null)
+     sections, each aligned on an 8-byte boundary, as described by header.section
+
+ Samples are not copied into the cache, because they are used in place in the mapped SoundFont.
+ Like the SoundFont itself, the cache is little-endian.
+*******************************************************************************/
+
+#include "SF2Bank.h"
+#include "CacheFile.h"
+#include "AssertLib.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static const char CacheMagic[8] = {'W','a','S','F','2','C','c','h'};
+
+//! Increment when the format changes, or when the layout of any record in SF2Bank changes.
+static const uint32_t CacheVersion = 1;
+
+enum CacheSection {
+    cs_phdr,
+    cs_pbag,
+    cs_pmod,
+    cs_pgen,
+    cs_inst,
+    cs_ibag,
+    cs_imod,
+    cs_igen,
+    cs_shdr,
+    cs_phdrMap,
+    cs_firstLevel,
+    cs_levels,
+    cs_levelData,
+    cs_count
+};
+
+struct SF2Bank::cacheHeader {
+    char magic[8];
+    //! CacheVersion, or 0 if writing the cache did not finish.
+    uint32_t version;
+    uint32_t pathSize;
+    uint64_t sourceSize;
+    uint64_t sourceTime;
+    //! Offset in SoundFont file of the first sample
+    uint64_t sampleOffset;
+    uint64_t sampleCount;
+    CacheSectionInfo section[cs_count];
+};
+
+//! Make a refer to section s of cache file f, if the section is valid.
+template<typename T, size_t E>
+static bool ViewSection( SimpleArray<T,E>& a, const MappedFile& f, const CacheSectionInfo& s ) {
+    const T* first = CacheSectionBegin<T>( f, s, E );
+    if( !first )
+        return false;
+    a.view( (T*)first, size_t(s.count) );
+    return true;
+}
+
+//! True if field f of the records a[0:a.size()+1] is nondecreasing and at most limit.
+/** The records index ranges [a[k].*f,a[k+1].*f) of another array with limit elements. */
+template<typename T, typename U>
+static bool IndicesOkay( const SimpleArray<T,1>& a, U T::*f, size_t limit ) {
+    for( size_t k=0; k<a.size(); ++k )
+        if( a[k].*f>a[k+1].*f )
+            return false;
+    return a[a.size()].*f<=limit;
+}
+
+//! True if every generator in gen of kind oper has a value less than limit.
+template<typename Gen, typename Oper>
+static bool GenValuesOkay( const SimpleArray<Gen,1>& gen, Oper oper, size_t limit ) {
+    for( size_t k=0; k<gen.size(); ++k )
+        if( gen[k].oper==oper && gen[k].amount.uint16>=limit )
+            return false;
+    return true;
+}
+
+bool SF2Bank::loadCache( const std::string& filename, const std::string& cacheFilename ) {
+    reset();
+    uint64_t size, time;
+    if( !HostGetFileInfo(filename.c_str(),size,time) )
+        return false;
+    std::unique_ptr<MappedFile> c(new MappedFile(cacheFilename.c_str()));
+    if( !c->isOpen() || c->size()<sizeof(cacheHeader) )
+        return false;
+    cacheHeader h;
+    memcpy( &h, c->begin(), sizeof(h) );
+    if( memcmp(h.magic,CacheMagic,8)!=0 || h.version!=CacheVersion || h.sourceSize!=size || h.sourceTime!=time )
+        return false;
+    if( h.pathSize!=filename.size() || c->size()-sizeof(h)<h.pathSize || memcmp(c->begin()+sizeof(h),filename.data(),h.pathSize)!=0 )
+        return false;
+    std::unique_ptr<MappedFile> m(new MappedFile(filename.c_str()));
+    if( !m->isOpen() || h.sampleOffset%2!=0 || h.sampleOffset>m->size() || (m->size()-h.sampleOffset)/2<h.sampleCount )
+        return false;
+    const CacheSectionInfo* s = h.section;
+    SimpleArray<int16_t> levelData;
+    bool okay = ViewSection(phdr,*c,s[cs_phdr]) && 
+                ViewSection(p.bag,*c,s[cs_pbag]) && ViewSection(p.mod,*c,s[cs_pmod]) && ViewSection(p.gen,*c,s[cs_pgen]) &&
+                ViewSection(inst,*c,s[cs_inst]) &&
+                ViewSection(i.bag,*c,s[cs_ibag]) && ViewSection(i.mod,*c,s[cs_imod]) && ViewSection(i.gen,*c,s[cs_igen]) &&
+                ViewSection(shdr,*c,s[cs_shdr]) && ViewSection(phdrMap,*c,s[cs_phdrMap]) &&
+                ViewSection(cacheFirstLevel,*c,s[cs_firstLevel]) && ViewSection(cacheLevels,*c,s[cs_levels]) &&
+                ViewSection(levelData,*c,s[cs_levelData]) &&
+                cacheFirstLevel.size()==shdr.size() && cacheFirstLevel[shdr.size()]==cacheLevels.size();
+    if( okay ) 
+        // Check levels, since they are used without bounds checks.  Each is followed by a guard sample.
+        for( const cacheLevel& l: cacheLevels ) 
+            if( l.offset>levelData.size() || levelData.size()-l.offset<l.size+1 ) {
+                okay = false;
+                break;
+            }
+    if( okay ) {
+        // Check the indices that createSoundSet follows from presets to instruments to samples.
+        okay = IndicesOkay(phdr,&Rec_phdr::presetBagIndex,p.bag.size()) &&
+               IndicesOkay(p.bag,&Rec_bag::genIndex,p.gen.size()) && IndicesOkay(p.bag,&Rec_bag::modIndex,p.mod.size()) &&
+               IndicesOkay(inst,&Rec_inst::instBagIndex,i.bag.size()) &&
+               IndicesOkay(i.bag,&Rec_bag::genIndex,i.gen.size()) && IndicesOkay(i.bag,&Rec_bag::modIndex,i.mod.size()) &&
+               GenValuesOkay(p.gen,Generator::instrument,inst.size()) && GenValuesOkay(i.gen,Generator::sampleId,shdr.size());
+        for( size_t k=0; okay && k<phdrMap.size(); ++k )
+            okay = phdrMap[k].phdrIndex<phdr.size();
+    }
+    if( okay ) 
+        // Check what sampleView relies on, as SF2Reader does for a SoundFont.
+        for( size_t k=0; k<shdr.size(); ++k ) {
+            const Rec_shdr& sh = shdr[k];
+            if( cacheFirstLevel[k]>cacheFirstLevel[k+1] || sh.start>sh.end || sh.end>=h.sampleCount ) {
+                okay = false;
+                break;
+            }
+        }
+    if( !okay ) {
+        reset();
+        return false;
+    }
+    cacheLevelData = levelData.begin();
+    samples.view( (int16_t*)(m->begin()+h.sampleOffset), size_t(h.sampleCount) );
+    mappedFile = std::move(m);
+    cacheFile = std::move(c);
+    sourceName = filename;
+    sourceSize = size;
+    sourceTime = time;
+    initializeViews();
+    return true;
+}
+
+bool SF2Bank::writeCache( const std::string& cacheFilename, const std::atomic<bool>* cancel ) {
+    if( !mappedFile || sourceName.empty() )
+        return false;
+    FILE* f = fopen(cacheFilename.c_str(),"wb");
+    if( !f )
+        return false;
+    cacheHeader h;
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, CacheMagic, 8 );
+    // Version is patched when the rest has been written.
+    h.version = 0;
+    h.pathSize = uint32_t(sourceName.size());
+    h.sourceSize = sourceSize;
+    h.sourceTime = sourceTime;
+    h.sampleOffset = (const char*)samples.begin()-mappedFile->begin();
+    h.sampleCount = samples.size();
+    CacheSectionInfo* s = h.section;
+    CacheWriter w( f, 0 );
+    w.write( &h, sizeof(h) );
+    w.write( sourceName.data(), sourceName.size() );
+    w.writeSection( s[cs_phdr], phdr );
+    w.writeSection( s[cs_pbag], p.bag );
+    w.writeSection( s[cs_pmod], p.mod );
+    w.writeSection( s[cs_pgen], p.gen );
+    w.writeSection( s[cs_inst], inst );
+    w.writeSection( s[cs_ibag], i.bag );
+    w.writeSection( s[cs_imod], i.mod );
+    w.writeSection( s[cs_igen], i.gen );
+    w.writeSection( s[cs_shdr], shdr );
+    w.writeSection( s[cs_phdrMap], phdrMap );
+    // Build the mip levels of one sample at a time, since building them all is what a warm start avoids.
+    // They are built apart from sampleViews, so that they are freed once written, and the levels 
+    // table is written after them, since their sizes are not known until they are built.
+    // Find the most mip levels of each sample that any instrument might need.  Whether an instrument is played 
+    // as a drum depends on the preset that uses it, so both ways are counted.
+    std::vector<uint8_t> levelsNeeded(shdr.size(),0);
+    for( unsigned j=0; j<inst.size(); ++j ) {
+        std::vector<std::pair<noteVelocityRange,playInfo>> zones;
+        constructPlayInfoList( zones, inst[j].instBagIndex, inst[j+1].instBagIndex, this->i );
+        for( const auto& z: zones ) 
+            if( z.second.index<shdr.size() ) {
+                uint8_t& l = levelsNeeded[z.second.index];
+                l = Max( l, uint8_t(Max(mipLevelsNeeded(z.first,z.second,false),mipLevelsNeeded(z.first,z.second,true))) );
+            }
+    }
+    std::vector<uint32_t> firstLevel;
+    std::vector<cacheLevel> levels;
+    uint64_t levelDataSize = 0;
+    w.beginSection( s[cs_levelData], 0 );
+    for( unsigned k=0; k<shdr.size() && w.okay(); ++k ) {
+        if( cancel && *cancel ) {
+            fclose(f);
+            remove(cacheFilename.c_str());
+            return false;
+        }
+        firstLevel.push_back(uint32_t(levels.size()));
+        auto& sh = shdr[k];
+        Synthesizer::Waveform16 sample;
+        sample.view( samples.begin()+sh.start, sh.end-sh.start );
+        sample.buildMipLevels(levelsNeeded[k]);
+        for( const Synthesizer::Waveform16* v = sample.coarser(); v; v = v->coarser() ) {
+            cacheLevel l;
+            l.offset = levelDataSize;
+            l.size = v->size();
+            levels.push_back(l);
+            levelDataSize += v->size()+1;
+            w.write( v->begin(), (v->size()+1)*sizeof(int16_t) );
+        }
+    }
+    s[cs_levelData].count = levelDataSize;
+    firstLevel.push_back(uint32_t(levels.size()));
+    w.writeSection( s[cs_firstLevel], firstLevel.data(), shdr.size(), 1, sizeof(uint32_t) );
+    w.writeSection( s[cs_levels], levels.data(), levels.size(), 0, sizeof(cacheLevel) );
+    bool okay = w.okay();
+    if( okay ) {
+        h.version = CacheVersion;
+        okay = fseek(f,0,SEEK_SET)==0 && fwrite(&h,sizeof(h),1,f)==1;
+    }
+    if( fclose(f)!=0 )
+        okay = false;
+    if( !okay )
+        remove(cacheFilename.c_str());
+    return okay;
+}
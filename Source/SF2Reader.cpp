@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <cstdint>
 #include <cerrno>
+#include <cstring>
 #include <string>
 #include "ReadError.h"
 #include "AssertLib.h"
@@ -52,17 +53,19 @@ ChunkId SF2Reader::chunkHeader::id() const {
     return ChunkId::unknown;
 };
 
-SF2Reader::SF2Reader() : myFile(nullptr), myBank(nullptr) {
+SF2Reader::SF2Reader() : myFile(nullptr), myCursor(nullptr), myEnd(nullptr), myBank(nullptr) {
 }
 
 SF2Reader::~SF2Reader() {
-    if(myFile) 
+    if(myFile || myCursor) 
         close();
 }
 
 void SF2Reader::close() {
-    std::fclose(myFile);
+    if(myFile)
+        std::fclose(myFile);
     myFile = nullptr;
+    myCursor = myEnd = nullptr;
 }
 
 void SF2Reader::open(const std::string& filename) {
@@ -71,11 +74,31 @@ void SF2Reader::open(const std::string& filename) {
         throw ReadError("cannot open "+filename+": "+strerror(errno));
 }
 
+void SF2Reader::open(const char* first, size_t size) {
+    Assert(first);
+    myCursor = first;
+    myEnd = first+size;
+}
+
 void SF2Reader::readBytes( char* dst, size_t n ) {
-    if(fread(dst, 1, n, myFile)!=n)
+    if(myCursor) {
+        if(size_t(myEnd-myCursor)<n)
+            throw ReadError("read failed");
+        memcpy(dst, myCursor, n);
+        myCursor += n;
+    } else if(fread(dst, 1, n, myFile)!=n)
         throw ReadError("read failed");
 }
 
+void SF2Reader::skip( size_t n ) {
+    if(myCursor) {
+        if(size_t(myEnd-myCursor)<n)
+            throw ReadError("read failed");
+        myCursor += n;
+    } else 
+        fseek(myFile,n,SEEK_CUR);
+}
+
 void SF2Reader::readExpect(const char* tag) {
     Assert(std::strlen(tag)==4);
     char tmp[4];
@@ -122,8 +145,16 @@ void SF2Reader::readSdtaList() {
     read(smplHeader);
     if( smplHeader.id()!=ChunkId::smpl )
         throw ReadError("smpl subchunk expected");
-    myBank->samples.resize(smplHeader.chunkSize/2);
-    readArray(myBank->samples.begin(),myBank->samples.size());
+    if(myCursor) {
+        // Chunks start on even offsets, so the samples are aligned.  Pages are read when a sample is first used.
+        if(size_t(myEnd-myCursor)<smplHeader.chunkSize)
+            throw ReadError("smpl chunk truncated");
+        myBank->samples.view((int16_t*)myCursor,smplHeader.chunkSize/2);
+        skip(smplHeader.chunkSize);
+    } else {
+        myBank->samples.resize(smplHeader.chunkSize/2);
+        readArray(myBank->samples.begin(),myBank->samples.size());
+    }
     if( size_t m = listHeader.chunkSize-4-8-smplHeader.chunkSize ) {
         // FIXME - use 24-bit data
         skip(m);
@@ -189,6 +220,10 @@ void SF2Reader::read( SF2Bank& bank ) {
     readInfoList();
     readSdtaList();
     readPdtaList();
+    // Check sample bounds now, because a bad bound would otherwise read beyond a mapped file.
+    for( auto& sh: myBank->shdr )
+        if( sh.start>sh.end || sh.end>=myBank->samples.size() )
+            throw ReadError("shdr "+std::string(sh.name,strnlen(sh.name,20))+" out of bounds");
     myBank->createIndex();
     myBank = nullptr;
 }
@@ -10,6 +10,9 @@ class SF2Reader {
     struct chunkHeader;
 
     FILE* myFile;
+    //! If non-null, reading is from [myCursor,myEnd) of a mapped file instead of from myFile.
+    const char* myCursor;
+    const char* myEnd;
     SF2Bank* myBank;
     void readBytes( char* dst, size_t n );
     template<typename T>
@@ -28,13 +31,15 @@ class SF2Reader {
     void readInfoList();
     void readSdtaList();
     void readPdtaList();
-    void skip( size_t n ) {
-        fseek(myFile,n,SEEK_CUR);
-    }
+    void skip( size_t n );
     void createIndex();
 public:
     SF2Reader();
     void open(const std::string& filename);
+    //! Read from image [first,first+size) of a file mapped into memory.
+    /** The hydra is copied into the bank, but the bank's samples become a view into the image,
+        so the image must outlive the bank's use of them. */
+    void open(const char* first, size_t size);
     void read( SF2Bank& bank );
     void close();
     ~SF2Reader();
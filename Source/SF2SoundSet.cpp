@@ -7,14 +7,18 @@
 #include "Midi.h"
 #include <cstdio>
 #include <cstdint>
+#include <cmath>
+#include <cstring>
 
 using namespace Synthesizer;
 
 //! Source based on a Patch object.
 class SF2Source: public Synthesizer::Source {
 private:
-    typedef Synthesizer::Waveform Waveform;
+    typedef Synthesizer::Waveform16 Waveform;
     const Waveform* waveform;
+    //! Instance of Waveform::resample for the instrument's interpolation policy.
+    Waveform::resampleType resample;
     float volume;
     float releaseSlope;
     Waveform::timeType waveDelta;
@@ -36,12 +40,18 @@ private:
     /*override*/ unsigned update( float* acc, unsigned n );
     /*override*/ void destroy();
     /*override*/ void receive( const Synthesizer::PlayerMessage& m );
+    /*override*/ float level() const {return volume;}
 public:
-    static SF2Source* allocate( const SF2SoundSet& set, unsigned note, unsigned velocity );
+    static SF2Source* allocate( const SF2SoundSet& set, unsigned note, unsigned velocity, Interpolation interpolation );
     bool isLooping() const {return loopStart<~0u;}
     void release();
 };
 
+SF2SoundSet::~SF2SoundSet() {
+    if( myBank )
+        --myBank->soundSetCount;
+}
+
 Midi::Instrument* SF2SoundSet::makeInstrument() const {
     return new SF2Instrument(*this);
 }
@@ -50,7 +60,7 @@ Midi::Instrument* SF2SoundSet::makeInstrument() const {
 // SF2Instrument
 //-----------------------------------------------------------
 
-SF2Instrument::SF2Instrument(const SF2SoundSet& s): mySet(s) {
+SF2Instrument::SF2Instrument(const SF2SoundSet& s): mySet(s), myInterpolation(GetEngineConfig().interpolation) {
     for( int note=0; note<128; ++note )
         keyArray[note] = nullptr;
 }
@@ -58,10 +68,11 @@ void SF2Instrument::noteOn( const Event& on, const Event& /*off*/ ) {
     unsigned note = on.note();
     unsigned velocity = on.velocity();
     Assert(!keyArray[note]);
-    if(SF2Source* k = SF2Source::allocate(mySet, note, velocity)) {
+    if(SF2Source* k = SF2Source::allocate(mySet, note, velocity, myInterpolation)) {
         if(k->isLooping()) {
-            // Source must be explicitly released
+            // Source must be explicitly released, unless it is stolen first.
             keyArray[note] = k;
+            k->setHolder(keyArray[note]);
         } else {
             // Source must *not be explicitly released, since it may be destroyed before the release.
         }
@@ -116,52 +127,88 @@ void SF2SoundSet::noteVelocityMap::initialize( std::pair<noteVelocityRange,playI
     array.resize(i-data);
     for( size_t k=0; k<array.size(); ++k ) 
         array[k] = data[k];
+    buildTable();
+}
+
+void SF2SoundSet::noteVelocityMap::buildTable() {
+    Assert(array.size()<uncovered);
+    // A new class starts wherever some range starts or stops.
+    bool isBoundary[128] = {true};
+    for( const auto& item: array ) {
+        const range& v = item.first.velocity;
+        if( v.low<128 ) 
+            isBoundary[v.low] = true;
+        if( v.high<127 ) 
+            isBoundary[v.high+1] = true;
+    }
+    uint8_t representative[128];
+    unsigned c = 0;
+    for( unsigned v=0; v<128; ++v ) {
+        if( isBoundary[v] && v>0 ) 
+            ++c;
+        if( isBoundary[v] ) 
+            representative[c] = v;
+        velocityClass[v] = c;
+    }
+    classCount = c+1;
+    // Fill table with first matching item, as a linear search would find.
+    table.resize(128*classCount);
+    for( unsigned note=0; note<128; ++note )
+        for( c=0; c<classCount; ++c ) {
+            uint16_t k = 0;
+            while( k<array.size() && !(array[k].first.note.contains(note) && array[k].first.velocity.contains(representative[c])) )
+                ++k;
+            table[note*classCount+c] = k<array.size() ? k : uncovered;
+        }
 }
 
 const SF2SoundSet::playInfo& SF2SoundSet::noteVelocityMap::find( unsigned note, unsigned velocity ) const {
-    auto* end = array.end();
-    for( const auto* p=array.begin(); p!=end; ++p )
-        if( p->first.note.contains(note) && p->first.velocity.contains(velocity) )
-            return p->second;
-    // Construction should ensure that all rangage are covered.
-    Assert(0);
-    return end[-1].second;
+    Assert(note<128 && velocity<128);
+    uint16_t k = table[note*classCount+velocityClass[velocity]];
+    if( k==uncovered ) {
+        // Construction should ensure that all ranges are covered.
+        Assert(0);
+        return array.end()[-1].second;
+    }
+    return array[k].second;
 }
 
 //-----------------------------------------------------------
 // PatchSource
 //-----------------------------------------------------------
-static PoolAllocator<SF2Source> SF2SourceAllocator(64,false);
+static VoicePool<SF2Source> SF2SourceAllocator(&EngineConfig::sf2SourceCount);
 
-SF2Source* SF2Source::allocate( const SF2SoundSet& set, unsigned note, unsigned velocity ) {
-    SF2Source* s = SF2SourceAllocator.allocate();
+SF2Source* SF2Source::allocate( const SF2SoundSet& set, unsigned note, unsigned velocity, Interpolation interpolation ) {
+    SF2Source* s = AllocateVoice(SF2SourceAllocator);
     if( s ) {
         new(s) SF2Source; 
         auto& preset = set.myPresetMap.find(note,velocity);
         auto& inst = set.myInstrumentMap[preset.index].find(note,velocity);
-        auto& sample = set.mySamples[inst.index];
+        auto& sample = *set.mySamples[inst.index];
         int originalKey = inst.overridingRootKey>=0 ? inst.overridingRootKey : sample.myOriginalPitch;
         if( set.myIsDrum )
             note = originalKey;
-        // FIXME - really need only one pow in statement below, instead of three.
-        float relativeFrequency = Midi::PitchOfNote(note)/Midi::PitchOfNote(originalKey)*pow(2.0f,sample.myPitchCorrection*(1.0f/1200));
-        s->waveform = &sample;
+        s->resample = Waveform::resampler(interpolation);
         s->waveIndex = 0;
-        s->waveDelta = unsigned( sample.sampleRate()/Synthesizer::SampleRate*Waveform::unitTime*relativeFrequency + 0.5f);
-        s->volume = velocity*(1.0f/127);
+        s->waveDelta = SF2Sample::step( sample.sampleRate(), (int(note)-originalKey)*100+sample.myPitchCorrection );
+        // Use mip level that keeps the step at most about one sample.  Times at level k are those at level 0 shifted right by k.
+        unsigned level;
+        s->waveform = &sample.mipLevelFor(s->waveDelta,level);
+        // Attenuation at the preset level is an offset to that of the instrument.
+        s->volume = velocity*(1.0f/127)*CentibelsToGain( Max(0,preset.initialAttenuation+inst.initialAttenuation) );
         Assert( s->waveDelta<=Waveform::unitTime*256 ); // Sanity check
         Assert( s->waveDelta>=Waveform::unitTime/256 ); // Sanity check
-        s->tableEnd = sample.size() << SF2Sample::timeShift;
+        s->tableEnd = s->waveform->size() << SF2Sample::timeShift;
         if( inst.sampleModes&1 ) {
-            s->loopStart = sample.myLoopStart;
-            s->loopEnd = sample.myLoopEnd;
+            s->loopStart = sample.myLoopStart>>level;
+            s->loopEnd = sample.myLoopEnd>>level;
         } else {
             s->loopStart = ~0u;
             s->loopEnd = ~0u;
         }
         s->exitLoopOnRelease = inst.sampleModes==3;
         s->state = ADSR::sustain;
-        s->releaseSlope = Synthesizer::SampleRate/exp2((preset.releaseVolEnv+inst.releaseVolEnv)*(1.0f/1200));
+        s->releaseSlope = Synthesizer::SampleRate/TimecentsToSeconds(preset.releaseVolEnv+inst.releaseVolEnv);
         Assert(s->assertOkay());
     } 
     return s;
@@ -173,9 +220,8 @@ void SF2Source::destroy() {
 
 void SF2Source::release() {
     Assert( (size_t(player)&3)==0 );
-    PlayerMessage* m = PlayerMessageQueue.startPush();
-    m->kind = PlayerMessageKind::Release;
-    m->player = player;
+    noteRelease();
+    StartPlayerMessage( PlayerMessageKind::Release, player );
     PlayerMessageQueue.finishPush();
 }
 
@@ -196,13 +242,15 @@ bool SF2Source::assertOkay() {
 }
 #endif
 
+//! Multiply acc[0:m] by volume, which falls by releaseSlope per sample until it reaches zero.  Returns final volume.
 static float applyRelease( float* acc, float volume, float releaseSlope, unsigned m ) {
-    for( size_t i=0; i<m; ++i ) {
-        acc[i] *= volume;
-        volume -= releaseSlope;
-        if( volume<0 ) volume = 0;
-    }
-    return volume;
+    // Number of samples before volume reaches zero.
+    unsigned z = m;
+    if( releaseSlope>0 && volume<m*releaseSlope ) 
+        z = unsigned(std::ceil(volume/releaseSlope));
+    ApplyGainRamp( acc, z, volume, -releaseSlope );
+    std::memset( acc+z, 0, (m-z)*sizeof(float) );
+    return Max( volume-m*releaseSlope, 0.0f );
 }
 
 unsigned SF2Source::update( float* acc, unsigned requested ) {
@@ -226,7 +274,7 @@ unsigned SF2Source::update( float* acc, unsigned requested ) {
             n = 0;
         }
 #pragma warning( disable : 4146 )
-        waveIndex = waveform->resample(acc, waveIndex, waveDelta, m);
+        waveIndex = (waveform->*resample)(acc, waveIndex, waveDelta, m);
         if( state==ADSR::release ) {
             volume = applyRelease(acc, volume, releaseSlope, m);
             if( volume<=1E-5 ) {
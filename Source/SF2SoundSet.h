@@ -10,8 +10,10 @@
 class SF2Source;
 class SF2SoundSet;
 class SF2Bank;
+class SF2Bank;
 
-class SF2Sample: public Synthesizer::Waveform {
+//! Sample from a SoundFont.  Kept as 16-bit integers, as in the file, to halve its memory.
+class SF2Sample: public Synthesizer::Waveform16 {
     // ~timeType(0) if not a looping patch.
     timeType myLoopStart;
     // ~timeType(0) if not a looping patch.
@@ -36,8 +38,12 @@ public:
         Assert(isLooping());
         return myLoopEnd;
     }
-    timeType soundEnd() const {return size()<<Waveform::timeShift;}
+    timeType soundEnd() const {return size()<<timeShift;}
     float sampleRate() const {return mySampleRate;}
+    //! Step through level 0 of a sample taken at sampleRate, to play it the given cents above its recorded pitch.
+    static timeType step( float sampleRate, int cents ) {
+        return timeType( sampleRate/Synthesizer::SampleRate*unitTime*Synthesizer::CentsToRatio(cents) + 0.5f );
+    }
 };
 
 class SF2SoundSet: public Synthesizer::SoundSet {
@@ -47,6 +53,7 @@ class SF2SoundSet: public Synthesizer::SoundSet {
     struct playInfo {
         uint16_t index;
         int16_t releaseVolEnv;
+        int16_t initialAttenuation;     // Centibels
         uint8_t sampleModes:2;
         int8_t overridingRootKey;
 
@@ -71,9 +78,21 @@ class SF2SoundSet: public Synthesizer::SoundSet {
         range velocity;
     };
 
+    //! Map from (note,velocity) to playInfo.
+    /** Lookup is constant time via a table indexed by note and velocity class.  Velocities in the same class 
+        are contained by the same ranges, so there are few classes, typically one per velocity layer. */
     class noteVelocityMap {
         typedef std::pair<noteVelocityRange,playInfo> itemType;
         SimpleArray<itemType> array;
+        //! Value in table for a (note,velocity) pair not covered by any range.
+        static const uint16_t uncovered = 0xFFFF;
+        //! Number of velocity classes
+        unsigned classCount;
+        //! Velocity class of each velocity
+        uint8_t velocityClass[128];
+        //! Element [note*classCount+velocityClass[velocity]] is index into array, or uncovered.
+        SimpleArray<uint16_t> table;
+        void buildTable();
         // Major key=low end of note range.  Minor key=low end of velocity range.
         struct orderByLow {
             bool operator()( const itemType& x, const itemType& y ) {
@@ -90,17 +109,22 @@ class SF2SoundSet: public Synthesizer::SoundSet {
     noteVelocityMap myPresetMap
         ;                    // Index is into myInstrumentMap
     SimpleArray<noteVelocityMap> myInstrumentMap;   // Index is into mySamples
-    SimpleArray<SF2Sample> mySamples;
+    //! Samples are owned by the SF2Bank that created the set.
+    SimpleArray<const SF2Sample*> mySamples;
     bool myIsDrum;
     std::string myName;
+    //! Bank that created the set.  It counts the sets that view its samples.
+    SF2Bank* myBank;
+    SF2SoundSet() : myBank(nullptr) {}
     friend class SF2Bank;
     friend class SF2Source;
 public:
-    const SF2Sample* begin() const {return mySamples.begin();}
-    const SF2Sample* end() const {return mySamples.end();} 
+    ~SF2SoundSet();
+    const SF2Sample* const* begin() const {return mySamples.begin();}
+    const SF2Sample* const* end() const {return mySamples.end();} 
     size_t size() const {return mySamples.size();}
     bool empty() const {return size()==0;}
-    const SF2Sample& operator[]( size_t k ) const {return mySamples[k];}
+    const SF2Sample& operator[]( size_t k ) const {return *mySamples[k];}
     const SF2Sample& find( float freq ) const;
     /*override*/ Midi::Instrument* makeInstrument() const;
 };
@@ -111,11 +135,13 @@ class SF2Instrument: public Midi::Instrument {
     ~SF2Instrument();
     SF2Source* keyArray[128]; 
     const SF2SoundSet& mySet;
+    Synthesizer::Interpolation myInterpolation;
     /*override*/ void noteOn( const Event& on, const Event& off );
     /*override*/ void noteOff( const Event& off );
     /*override*/ void stop();
     void release( int note );
 public:
+    //! Notes are resampled with the interpolation of the engine configuration.
     SF2Instrument(const SF2SoundSet&);
 };
 
@@ -0,0 +1,258 @@
+#include "StereoMix.h"
+#include "AssertLib.h"
+#include "Utility.h"
+#include <cstring>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+// MSVC lets any function use any instruction set, and does not contract a*b+c to FMA under /fp:precise.
+#define NO_FP_CONTRACT
+#define TARGET_ISA(isa)
+#else
+#include <cpuid.h>
+// Contraction to FMA would break bit-exactness with StereoMixScalar.
+#define NO_FP_CONTRACT __attribute__((optimize("fp-contract=off")))
+#define TARGET_ISA(isa) __attribute__((target(isa))) NO_FP_CONTRACT
+#endif
+
+// AVX-512 intrinsics first appeared in VS2017.
+#if !defined(_MSC_VER) || _MSC_VER>=1910
+#define HAVE_AVX512 1
+#else
+#define HAVE_AVX512 0
+#endif
+
+namespace Synthesizer {
+
+//-----------------------------------------------------------
+// Kernels
+// Each kernel must do a separate multiply and add (not FMA),
+// so that results are bit-for-bit identical to StereoMixScalar.
+//-----------------------------------------------------------
+
+NO_FP_CONTRACT
+void StereoMixScalar( float* left, float* right, const float* srcL, const float* srcR, float volL, float volR, unsigned n ) {
+    for( unsigned k=0; k<n; ++k ) {
+        left[k] += srcL[k]*volL;
+        right[k] += srcR[k]*volR;
+    }
+}
+
+NO_FP_CONTRACT
+void StereoMixTwoTapScalar( float* left, float* right, const float* srcL, const float* srcR, const float volL[2], const float volR[2], unsigned n ) {
+    const float* prevL = srcL-1;
+    const float* prevR = srcR-1;
+    for( unsigned k=0; k<n; ++k ) {
+        left[k] += srcL[k]*volL[0] + prevL[k]*volL[1];
+        right[k] += srcR[k]*volR[0] + prevR[k]*volR[1];
+    }
+}
+
+TARGET_ISA("sse2")
+static void StereoMixSSE2( float* left, float* right, const float* srcL, const float* srcR, float volL, float volR, unsigned n ) {
+    __m128 vl = _mm_set1_ps(volL);
+    __m128 vr = _mm_set1_ps(volR);
+    unsigned k = 0;
+    for( ; k+4<=n; k+=4 ) {
+        _mm_storeu_ps(left+k, _mm_add_ps(_mm_loadu_ps(left+k), _mm_mul_ps(_mm_loadu_ps(srcL+k), vl)));
+        _mm_storeu_ps(right+k, _mm_add_ps(_mm_loadu_ps(right+k), _mm_mul_ps(_mm_loadu_ps(srcR+k), vr)));
+    }
+    StereoMixScalar(left+k, right+k, srcL+k, srcR+k, volL, volR, n-k);
+}
+
+TARGET_ISA("sse2")
+static void StereoMixTwoTapSSE2( float* left, float* right, const float* srcL, const float* srcR, const float volL[2], const float volR[2], unsigned n ) {
+    __m128 vl0 = _mm_set1_ps(volL[0]), vl1 = _mm_set1_ps(volL[1]);
+    __m128 vr0 = _mm_set1_ps(volR[0]), vr1 = _mm_set1_ps(volR[1]);
+    unsigned k = 0;
+    for( ; k+4<=n; k+=4 ) {
+        __m128 l = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(srcL+k), vl0), _mm_mul_ps(_mm_loadu_ps(srcL+k-1), vl1));
+        __m128 r = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(srcR+k), vr0), _mm_mul_ps(_mm_loadu_ps(srcR+k-1), vr1));
+        _mm_storeu_ps(left+k, _mm_add_ps(_mm_loadu_ps(left+k), l));
+        _mm_storeu_ps(right+k, _mm_add_ps(_mm_loadu_ps(right+k), r));
+    }
+    StereoMixTwoTapScalar(left+k, right+k, srcL+k, srcR+k, volL, volR, n-k);
+}
+
+TARGET_ISA("avx2")
+static void StereoMixAVX2( float* left, float* right, const float* srcL, const float* srcR, float volL, float volR, unsigned n ) {
+    __m256 vl = _mm256_set1_ps(volL);
+    __m256 vr = _mm256_set1_ps(volR);
+    unsigned k = 0;
+    for( ; k+8<=n; k+=8 ) {
+        _mm256_storeu_ps(left+k, _mm256_add_ps(_mm256_loadu_ps(left+k), _mm256_mul_ps(_mm256_loadu_ps(srcL+k), vl)));
+        _mm256_storeu_ps(right+k, _mm256_add_ps(_mm256_loadu_ps(right+k), _mm256_mul_ps(_mm256_loadu_ps(srcR+k), vr)));
+    }
+    // Avoid AVX-SSE transition penalty before running the tail.
+    _mm256_zeroupper();
+    StereoMixScalar(left+k, right+k, srcL+k, srcR+k, volL, volR, n-k);
+}
+
+TARGET_ISA("avx2")
+static void StereoMixTwoTapAVX2( float* left, float* right, const float* srcL, const float* srcR, const float volL[2], const float volR[2], unsigned n ) {
+    __m256 vl0 = _mm256_set1_ps(volL[0]), vl1 = _mm256_set1_ps(volL[1]);
+    __m256 vr0 = _mm256_set1_ps(volR[0]), vr1 = _mm256_set1_ps(volR[1]);
+    unsigned k = 0;
+    for( ; k+8<=n; k+=8 ) {
+        __m256 l = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(srcL+k), vl0), _mm256_mul_ps(_mm256_loadu_ps(srcL+k-1), vl1));
+        __m256 r = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(srcR+k), vr0), _mm256_mul_ps(_mm256_loadu_ps(srcR+k-1), vr1));
+        _mm256_storeu_ps(left+k, _mm256_add_ps(_mm256_loadu_ps(left+k), l));
+        _mm256_storeu_ps(right+k, _mm256_add_ps(_mm256_loadu_ps(right+k), r));
+    }
+    _mm256_zeroupper();
+    StereoMixTwoTapScalar(left+k, right+k, srcL+k, srcR+k, volL, volR, n-k);
+}
+
+#if HAVE_AVX512
+TARGET_ISA("avx512f")
+static void StereoMixAVX512( float* left, float* right, const float* srcL, const float* srcR, float volL, float volR, unsigned n ) {
+    __m512 vl = _mm512_set1_ps(volL);
+    __m512 vr = _mm512_set1_ps(volR);
+    unsigned k = 0;
+    for( ; k+16<=n; k+=16 ) {
+        _mm512_storeu_ps(left+k, _mm512_add_ps(_mm512_loadu_ps(left+k), _mm512_mul_ps(_mm512_loadu_ps(srcL+k), vl)));
+        _mm512_storeu_ps(right+k, _mm512_add_ps(_mm512_loadu_ps(right+k), _mm512_mul_ps(_mm512_loadu_ps(srcR+k), vr)));
+    }
+    _mm256_zeroupper();
+    StereoMixScalar(left+k, right+k, srcL+k, srcR+k, volL, volR, n-k);
+}
+
+TARGET_ISA("avx512f")
+static void StereoMixTwoTapAVX512( float* left, float* right, const float* srcL, const float* srcR, const float volL[2], const float volR[2], unsigned n ) {
+    __m512 vl0 = _mm512_set1_ps(volL[0]), vl1 = _mm512_set1_ps(volL[1]);
+    __m512 vr0 = _mm512_set1_ps(volR[0]), vr1 = _mm512_set1_ps(volR[1]);
+    unsigned k = 0;
+    for( ; k+16<=n; k+=16 ) {
+        __m512 l = _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(srcL+k), vl0), _mm512_mul_ps(_mm512_loadu_ps(srcL+k-1), vl1));
+        __m512 r = _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(srcR+k), vr0), _mm512_mul_ps(_mm512_loadu_ps(srcR+k-1), vr1));
+        _mm512_storeu_ps(left+k, _mm512_add_ps(_mm512_loadu_ps(left+k), l));
+        _mm512_storeu_ps(right+k, _mm512_add_ps(_mm512_loadu_ps(right+k), r));
+    }
+    _mm256_zeroupper();
+    StereoMixTwoTapScalar(left+k, right+k, srcL+k, srcR+k, volL, volR, n-k);
+}
+#endif /* HAVE_AVX512 */
+
+//-----------------------------------------------------------
+// Dispatch
+//-----------------------------------------------------------
+
+StereoMixType StereoMix = StereoMixScalar;
+StereoMixTwoTapType StereoMixTwoTap = StereoMixTwoTapScalar;
+static const char* TheStereoMixName = "scalar";
+
+const char* StereoMixName() {
+    return TheStereoMixName;
+}
+
+static void CpuId( int info[4], int leaf ) {
+#if defined(_MSC_VER)
+    __cpuidex(info, leaf, 0);
+#else
+    unsigned a, b, c, d;
+    __cpuid_count(leaf, 0, a, b, c, d);
+    info[0] = a; info[1] = b; info[2] = c; info[3] = d;
+#endif
+}
+
+//! Return bits of XCR0, which indicate which register states the OS saves on a context switch.
+static unsigned long long XGetBv() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned a, d;
+    __asm__ __volatile__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (unsigned long long)d<<32 | a;
+#endif
+}
+
+enum class MixIsa {
+    scalar,
+    sse2,
+    avx2,
+    avx512
+};
+
+static MixIsa DetectMixIsa() {
+    int info[4];
+    CpuId(info, 0);
+    int maxLeaf = info[0];
+    CpuId(info, 1);
+    if( !(info[3] & 1<<26) )
+        return MixIsa::scalar;
+    bool osxsave = (info[2] & 1<<27)!=0;
+    bool avx = (info[2] & 1<<28)!=0;
+    if( !osxsave || !avx || maxLeaf<7 )
+        return MixIsa::sse2;
+    unsigned long long xcr0 = XGetBv();
+    if( (xcr0&0x6)!=0x6 )
+        // OS does not save YMM state
+        return MixIsa::sse2;
+    CpuId(info, 7);
+    bool avx2 = (info[1] & 1<<5)!=0;
+    bool avx512f = (info[1] & 1<<16)!=0;
+    if( avx512f && (xcr0&0xE6)==0xE6 )
+        return MixIsa::avx512;
+    return avx2 ? MixIsa::avx2 : MixIsa::sse2;
+}
+
+#if ASSERTIONS
+//! Check that kernels produce exactly the same bits as their scalar reference versions.
+static bool AssertBitExact( StereoMixType kernel, StereoMixTwoTapType twoTap ) {
+    const unsigned n = 103;     // Deliberately not a multiple of any vector width
+    float src[n+8];
+    float expected[2][n], actual[2][n];
+    for( unsigned k=0; k<n+8; ++k )
+        src[k] = RandomFloat(2.0f)-1.0f;
+    for( unsigned k=0; k<n; ++k ) {
+        expected[0][k] = actual[0][k] = RandomFloat(1.0f);
+        expected[1][k] = actual[1][k] = -RandomFloat(1.0f);
+    }
+    // Use overlapping, misaligned sources, as Player::update does.
+    StereoMixScalar(expected[0], expected[1], src+1, src+6, 0.3f, 0.7f, n);
+    kernel(actual[0], actual[1], src+1, src+6, 0.3f, 0.7f, n);
+    Assert( std::memcmp(expected, actual, sizeof(expected))==0 );
+    const float volL[2] = {0.25f, 0.05f};
+    const float volR[2] = {0.6f, 0.4f};
+    StereoMixTwoTapScalar(expected[0], expected[1], src+1, src+6, volL, volR, n);
+    twoTap(actual[0], actual[1], src+1, src+6, volL, volR, n);
+    Assert( std::memcmp(expected, actual, sizeof(expected))==0 );
+    return true;
+}
+#endif /* ASSERTIONS */
+
+void InitializeStereoMix() {
+    switch( DetectMixIsa() ) {
+#if HAVE_AVX512
+        case MixIsa::avx512:
+            Assert(AssertBitExact(StereoMixAVX512, StereoMixTwoTapAVX512));
+            StereoMix = StereoMixAVX512;
+            StereoMixTwoTap = StereoMixTwoTapAVX512;
+            TheStereoMixName = "AVX-512";
+            break;
+#else
+        case MixIsa::avx512:
+#endif
+        case MixIsa::avx2:
+            Assert(AssertBitExact(StereoMixAVX2, StereoMixTwoTapAVX2));
+            StereoMix = StereoMixAVX2;
+            StereoMixTwoTap = StereoMixTwoTapAVX2;
+            TheStereoMixName = "AVX2";
+            break;
+        case MixIsa::sse2:
+            Assert(AssertBitExact(StereoMixSSE2, StereoMixTwoTapSSE2));
+            StereoMix = StereoMixSSE2;
+            StereoMixTwoTap = StereoMixTwoTapSSE2;
+            TheStereoMixName = "SSE2";
+            break;
+        case MixIsa::scalar:
+            StereoMix = StereoMixScalar;
+            StereoMixTwoTap = StereoMixTwoTapScalar;
+            TheStereoMixName = "scalar";
+            break;
+    }
+}
+
+} // namespace Synthesizer
@@ -0,0 +1,36 @@
+#ifndef StereoMix_H
+#define StereoMix_H
+
+namespace Synthesizer {
+
+//! Accumulate srcL[0:n]*volL into left[0:n] and srcR[0:n]*volR into right[0:n].
+/** srcL and srcR may overlap each other, but must not overlap left or right. */
+typedef void (*StereoMixType)( float* left, float* right, const float* srcL, const float* srcR, float volL, float volR, unsigned n );
+
+//! Fastest mixing kernel supported by the processor.
+/** Set by InitializeStereoMix.  Defaults to StereoMixScalar. */
+extern StereoMixType StereoMix;
+
+//! Reference version of StereoMix.  All other kernels must be bit-for-bit identical to it.
+void StereoMixScalar( float* left, float* right, const float* srcL, const float* srcR, float volL, float volR, unsigned n );
+
+//! Like StereoMix, but each channel is a two-tap interpolation of its source.
+/** Accumulates srcL[k]*volL[0]+srcL[k-1]*volL[1] into left[k], and likewise for right.
+    Used to implement fractional delays.  Note that srcL[-1] and srcR[-1] are read. */
+typedef void (*StereoMixTwoTapType)( float* left, float* right, const float* srcL, const float* srcR, const float volL[2], const float volR[2], unsigned n );
+
+//! Fastest two-tap mixing kernel supported by the processor.
+extern StereoMixTwoTapType StereoMixTwoTap;
+
+//! Reference version of StereoMixTwoTap.
+void StereoMixTwoTapScalar( float* left, float* right, const float* srcL, const float* srcR, const float volL[2], const float volR[2], unsigned n );
+
+//! Set StereoMix and StereoMixTwoTap according to processor features.  Called by Synthesizer::Initialize.
+void InitializeStereoMix();
+
+//! Name of instruction set used by the kernels, e.g. "AVX2".  For diagnostics.
+const char* StereoMixName();
+
+} // namespace Synthesizer
+
+#endif /* StereoMix_H */
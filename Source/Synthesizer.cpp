@@ -2,8 +2,17 @@
 #include "PoolAllocator.h"
 #include "Synthesizer.h"
 #include "Patch.h"
+#include "StereoMix.h"
+#include "ConversionTable.h"
+#include "Host.h"
 #include <cstring>
 #include <cstdio>
+#include <algorithm>
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 namespace Synthesizer {
 
@@ -16,32 +25,134 @@ class Player;
 // Player
 //-----------------------------------------------------------
 
-static const size_t PlayerCountMax = 256;
-
 class Player {
-    void output( float* dst, const float* src, float vol, unsigned n ) {
-        for( unsigned k=0; k<n; ++k )
-            dst[k] += src[k]*vol;
-    }
 public:
     Source* source;
+    //! Delay of each channel, in whole samples.
+    /** While both are nonzero, they count down the common part of the delay.  Afterwards,
+        they are the lags of the left and right taps behind the head of the delay line. */
     unsigned delay[2];
-    float volume[2]; 
+    //! Weight of tap at delay[c] and tap at delay[c]+1 for channel c.
+    /** volume[c][1] is nonzero only if a fractional delay is in use. */
+    float volume[2][2];
     //! Number of samples taken after source finished.
-    /** Always <=delayBufSize until Player is done.*/
+    /** Always <=delayBufSize+1 until Player is done.*/
     unsigned postSource;
+    //! Maximum difference between left and right delays.
     static const unsigned delayBufSize = 64;
-    float delayBuf[delayBufSize];
     static const unsigned chunkMaxSize = 1024;
     //! Accumulate into left and right.  Return false if done.
-    bool update( float* left, float* right, unsigned n );
+    /** If pre is not NULL, it holds the next preCount samples of the source, and the source is not called.
+        Having preCount less than sourceDemand(n) indicates that the source has reached its end. */
+    bool update( float* left, float* right, unsigned n, const float* pre=NULL, unsigned preCount=0 );
+    //! Number of samples that update(left,right,n) would request from the source.
+    unsigned sourceDemand( unsigned n ) const {
+        if( postSource>0 )
+            return 0;
+        if( delay[0]>0 && delay[1]>0 )
+            return n-Min( n, Min( delay[0], delay[1] ) );
+        return n;
+    }
     unsigned delayDiff() const {
         int d = delay[0]-delay[1];
         return d>=0 ? d : -d;
     }
+    //! Initialize the delay line to silence.
+    void clearRing();
+    //! Samples left in fade-out of a stolen voice.  Meaningful only if stolen is true.
+    unsigned fadeLeft;
+    //! True if the interrupt handler received a Steal message for this player.
+    bool stolen;
+    //! Length of fade-out for a stolen voice.  5 msec is short enough to free slots quickly, and long enough not to click.
+    static const unsigned stealFadeSize = SampleRate/200;
+    //! Copy of source->level(), stored by the interrupt handler after each chunk and read by stealCost.
+    /** Atomic because the source's own fields are written by the interrupt handler while stealCost runs. */
+    std::atomic<float> sourceLevel;
+    // Fields below are accessed only by the thread that calls Play.
+    //! True if a Steal message was sent for this player.
+    bool stealPending;
+    //! Value of SampleClock when Play was called.
+    unsigned startTime;
+    //! Index of player in VoiceList
+    size_t voiceIndex;
+    //! Estimate of how much losing this voice would be noticed.
+    float stealCost( unsigned now ) const;
+    //! Clear client's pointer to s, so that client stops sending messages to s.
+    static void detachHolder( Source* s );
+    void destroySource() {source->destroy();}
+private:
+    //! Size of circular delay line.  Must be a power of two.
+    static const unsigned ringSize = 256;
+    //! Maximum number of samples that can be written to ring without overwriting history needed by a tap.
+    static const unsigned ringStepMax = ringSize-(delayBufSize+1);
+    //! Index into ring of next sample to be written.
+    unsigned ringHead;
+    //! ringStorage[0] is a copy of ring[ringSize-1], so that ring[-1] is valid for the second tap.
+    float ringStorage[1+ringSize];
+    float* ring() {return ringStorage+1;}
+    //! Accumulate k samples from the taps into left and right.  The k samples must already be in the ring.
+    void mixTaps( float* left, float* right, unsigned k );
+    //! Apply fade-out to acc[0:m].  Returns number of samples before the fade reached silence.
+    unsigned fade( float* acc, unsigned m );
 };
 
-bool Player::update( float* left, float* right, unsigned n ) {
+void Player::clearRing() {
+    ringHead = 0;
+    // Only the history behind the head is read before being written.
+    std::memset( ringStorage+ringSize-delayBufSize-1, 0, sizeof(float)*(delayBufSize+2) );
+    ringStorage[0] = 0;
+}
+
+void Player::mixTaps( float* left, float* right, unsigned k ) {
+    const unsigned mask = ringSize-1;
+    unsigned i = ringHead-delay[0] & mask;
+    unsigned j = ringHead-delay[1] & mask;
+    bool twoTap = volume[0][1]!=0 || volume[1][1]!=0;
+    while( k>0 ) {
+        // Mix segment where neither tap wraps around.
+        unsigned s = Min( k, Min( ringSize-i, ringSize-j ) );
+        if( twoTap )
+            StereoMixTwoTap( left, right, ring()+i, ring()+j, volume[0], volume[1], s );
+        else
+            StereoMix( left, right, ring()+i, ring()+j, volume[0][0], volume[1][0], s );
+        i = i+s & mask;
+        j = j+s & mask;
+        left += s;
+        right += s;
+        k -= s;
+    }
+}
+
+float Player::stealCost( unsigned now ) const {
+    // Released voices are on their way out anyway.
+    const float releasedWeight = 0.25f;
+    float cost = Max( volume[0][0]+volume[0][1], volume[1][0]+volume[1][1] )*sourceLevel.load(std::memory_order_relaxed);
+    if( source->releaseSent )
+        cost *= releasedWeight;
+    // Older voices are more likely to be masked by newer ones.  A voice scheduled ahead of now has not 
+    // started yet, so its age is zero rather than the wrapped-around difference.
+    int delta = int(now-startTime);
+    float age = Max(0,delta)*(1.0f/SampleRate);
+    return cost/(1+age);
+}
+
+void Player::detachHolder( Source* s ) {
+    if( Source** h = s->holder ) {
+        Assert( *h==s );
+        *h = NULL;
+        s->holder = NULL;
+    }
+}
+
+unsigned Player::fade( float* acc, unsigned m ) {
+    unsigned k = Min( m, fadeLeft );
+    for( unsigned i=0; i<k; ++i )
+        acc[i] *= (fadeLeft-i)*(1.0f/stealFadeSize);
+    fadeLeft -= k;
+    return fadeLeft>0 ? m : k;
+}
+
+bool Player::update( float* left, float* right, unsigned n, const float* pre, unsigned preCount ) {
     Assert( 0<n );
     Assert( n<=chunkMaxSize );
     if( delay[0]>0 && delay[1]>0 ) {
@@ -59,129 +170,523 @@ bool Player::update( float* left, float* right, unsigned n ) {
     unsigned d = Max(delay[0],delay[1]);
     Assert( d<=delayBufSize );
     Assert( d==delayDiff() );
-    float buf[chunkMaxSize+delayBufSize];
-    std::memcpy( buf, delayBuf, sizeof(float)*d );
-    if( postSource>0 ) {
-        std::memset( buf+d, 0, n*sizeof(float) );
-        postSource += n;
-    } else {
-        unsigned m = source->update( buf+d, n );
-        if( m<n ) {
-            std::memset( buf+d+m, 0, (n-m)*sizeof(float) );
-            postSource = n-m;
+    while( n>0 ) {
+        // Write source samples directly into the ring, then read both taps in place.
+        unsigned k = Min( n, Min( ringStepMax, ringSize-ringHead ) );
+        float* dst = ring()+ringHead;
+        if( postSource>0 ) {
+            std::memset( dst, 0, k*sizeof(float) );
+            postSource += k;
+        } else {
+            unsigned m;
+            if( pre ) {
+                m = Min( k, preCount );
+                std::memcpy( dst, pre, m*sizeof(float) );
+                pre += m;
+                preCount -= m;
+            } else {
+                m = source->update( dst, k );
+            }
+            if( stolen )
+                m = fade( dst, m );
+            if( m<k ) {
+                std::memset( dst+m, 0, (k-m)*sizeof(float) );
+                postSource = k-m;
+            }
+        }
+        if( ringHead+k==ringSize )
+            ringStorage[0] = ring()[ringSize-1];
+        mixTaps( left, right, k );
+        ringHead = ringHead+k & ringSize-1;
+        left += k;
+        right += k;
+        n -= k;
+    }
+    // The "+1" accounts for the second tap of a fractional delay.
+    return postSource<=d+1;
+}
+
+//-----------------------------------------------------------
+// RenderPool (renders the live players on multiple cores)
+//-----------------------------------------------------------
+
+//! Fixed set of real-time threads that help the interrupt handler render players.
+/** The players are split into contiguous slices, one per lane.  The calling thread and
+    the workers claim lanes with an atomic counter, so the caller never waits for a worker 
+    to wake up: it renders any lanes that no worker has claimed, and then spins only until 
+    lanes that workers claimed are done.  Idle workers wait on a semaphore, which render signals
+    without blocking.  Each lane accumulates into a private buffer, and 
+    the buffers are summed in lane order, so that output is deterministic no matter which 
+    thread rendered which lane.  Workers only call Player::update.  All other bookkeeping, 
+    notably pushes onto FreePlayerQueue, stays on the interrupt handler's thread. */
+class RenderPool: NoCopy {
+public:
+    //! Maximum number of lanes, including the caller's lane.
+    static const unsigned laneMax = 8;
+    //! Fewer players per lane than this are not worth the cost of waking workers.
+    static const size_t minPlayersPerLane = 8;
+    RenderPool() : myLanes(nullptr), myLaneCount(1), myClaim(0), myFinished(0), myStop(false), myWake(nullptr), mySleeperCount(0) {}
+    ~RenderPool() {stop();}
+    //! Start worker threads so that there are laneCount lanes in total.
+    void start( unsigned laneCount );
+    //! Stop and join worker threads.
+    void stop();
+    //! Accumulate next m samples of players[0:n] into left and right.
+    /** Sets done[i] to true iff players[i] finished. */
+    void render( float* left, float* right, Player* const* players, size_t n, unsigned m, bool* done );
+private:
+    struct lane {
+        float left[Player::chunkMaxSize];
+        float right[Player::chunkMaxSize];
+        //! Output of a group of sources rendered together.
+        float batch[4][Player::chunkMaxSize];
+    };
+    lane* myLanes;
+    unsigned myLaneCount;
+    std::vector<std::thread> myThreads;
+    static const unsigned laneBits = 4;
+    static const unsigned laneMask = (1<<laneBits)-1;
+    //! Next lane of the current job to claim in the low laneBits, and number of the job in the other bits.
+    /** Lanes at or beyond myLaneCount are not there, so a job is fully claimed once the low bits reach myLaneCount. */
+    std::atomic<unsigned> myClaim;
+    //! Number of lanes of the current job that have been rendered.
+    std::atomic<unsigned> myFinished;
+    //! True if workers should exit.
+    std::atomic<bool> myStop;
+    //! Idle workers wait on this.
+    HostSemaphore* myWake;
+    //! Number of workers that are waiting on myWake, or about to, and have not been signaled.
+    std::atomic<unsigned> mySleeperCount;
+    // Current job.  Written before the job is published in myClaim.
+    Player* const* myPlayers;
+    size_t myPlayerCount;
+    unsigned myChunkSize;
+    bool* myDone;
+    //! Claim and render lanes of the current job until none are left.  Returns true if any were claimed.
+    bool claimLanes();
+    void renderLane( unsigned k );
+    void workerLoop();
+    //! Like render, but without parallelism.  Uses l.batch as scratch space.
+    static void renderSerial( lane& l, float* left, float* right, Player* const* players, size_t n, unsigned m, bool* done );
+};
+
+void RenderPool::start( unsigned laneCount ) {
+    Assert( myThreads.empty() );
+    myLaneCount = Clip( 1u, laneMax, laneCount );
+    Assert( myLaneCount<=laneMask );
+    myLanes = new lane[myLaneCount];
+    // Job 0 has no lanes left to claim.
+    myClaim = myLaneCount;
+    myStop = false;
+    myWake = HostCreateSemaphore();
+    for( unsigned k=1; k<myLaneCount; ++k )
+        myThreads.push_back(std::thread(&RenderPool::workerLoop, this));
+}
+
+void RenderPool::stop() {
+    myStop = true;
+    if( !myThreads.empty() )
+        HostSignalSemaphore( myWake, unsigned(myThreads.size()) );
+    for( auto& t: myThreads )
+        t.join();
+    myThreads.clear();
+    if( myWake ) {
+        HostDestroySemaphore( myWake );
+        myWake = nullptr;
+    }
+    mySleeperCount = 0;
+    delete[] myLanes;
+    myLanes = nullptr;
+    myLaneCount = 1;
+}
+
+void RenderPool::renderLane( unsigned k ) {
+    lane& l = myLanes[k];
+    unsigned m = myChunkSize;
+    std::memset( l.left, 0, m*sizeof(float) );
+    std::memset( l.right, 0, m*sizeof(float) );
+    size_t first = myPlayerCount*k/myLaneCount;
+    size_t last = myPlayerCount*(k+1)/myLaneCount;
+    renderSerial( l, l.left, l.right, myPlayers+first, last-first, m, myDone+first );
+}
+
+static bool IsSimpleSource( const Source* s );
+
+//! If true, renderSerial renders SimpleSource voices four at a time, instead of one at a time via Source::update.
+/** The output of each voice is the same either way, but summation order differs.  A constant, so that the 
+    audio thread does not read a flag that another thread might write. */
+static const bool BatchRender = true;
+
+void RenderPool::renderSerial( lane& l, float* left, float* right, Player* const* players, size_t n, unsigned m, bool* done ) {
+    // Indices of players in group waiting to be rendered together.
+    size_t group[4];
+    unsigned g = 0;
+    for( size_t i=0; i<n; ++i ) {
+        Player* p = players[i];
+        if( BatchRender && IsSimpleSource(p->source) && p->sourceDemand(m)>0 ) {
+            group[g++] = i;
+            if( g==4 ) {
+                SimpleSource* src[4];
+                float* acc[4];
+                unsigned demand[4], count[4];
+                for( unsigned j=0; j<4; ++j ) {
+                    Player* q = players[group[j]];
+                    src[j] = static_cast<SimpleSource*>(q->source);
+                    acc[j] = l.batch[j];
+                    demand[j] = q->sourceDemand(m);
+                }
+                SimpleSource::update4( src, acc, demand, count );
+                for( unsigned j=0; j<4; ++j ) 
+                    done[group[j]] = !players[group[j]]->update(left,right,m,acc[j],count[j]);
+                g = 0;
+            }
+        } else {
+            done[i] = !p->update(left,right,m);
+        }
+    }
+    // Leftovers are not worth batching.
+    for( unsigned j=0; j<g; ++j )
+        done[group[j]] = !players[group[j]]->update(left,right,m);
+}
+
+bool RenderPool::claimLanes() {
+    bool claimed = false;
+    unsigned c = myClaim.load(std::memory_order_acquire);
+    while( (c&laneMask)<myLaneCount ) 
+        // Acquire pairs with the release in render, so that the job is visible.
+        if( myClaim.compare_exchange_weak(c,c+1,std::memory_order_acquire,std::memory_order_acquire) ) {
+            renderLane(c&laneMask);
+            myFinished.fetch_add(1,std::memory_order_release);
+            claimed = true;
+            c = myClaim.load(std::memory_order_acquire);
         }
+    return claimed;
+}
+
+void RenderPool::workerLoop() {
+    HostSetRealTimeThreadPriority();
+    while( !myStop.load(std::memory_order_relaxed) ) {
+        if( claimLanes() )
+            continue;
+        // Announce the wait before checking for work one last time.  The sequentially consistent operations
+        // here and in render ensure that either this check sees the job, or render sees this sleeper and signals it.
+        mySleeperCount.fetch_add(1,std::memory_order_seq_cst);
+        if( (myClaim.load(std::memory_order_seq_cst)&laneMask)<myLaneCount || myStop.load(std::memory_order_seq_cst) )
+            // Claim it without waiting.  A signal meant for this worker may arrive later, and cause one spurious wakeup.
+            continue;
+        HostWaitSemaphore( myWake );
+    }
+}
+
+void RenderPool::render( float* left, float* right, Player* const* players, size_t n, unsigned m, bool* done ) {
+    if( myLaneCount==1 || n<myLaneCount*minPlayersPerLane ) {
+        // Not worth going parallel.  Accumulate directly into output.
+        renderSerial( myLanes[0], left, right, players, n, m, done );
+        return;
     }
-    output( left, buf+d-delay[0], volume[0], n );
-    output( right, buf+d-delay[1], volume[1], n );
-    std::memcpy( delayBuf, buf+n, sizeof(float)*d );
-    return postSource<=d;
+    myPlayers = players;
+    myPlayerCount = n;
+    myChunkSize = m;
+    myDone = done;
+    myFinished.store(0,std::memory_order_relaxed);
+    // Publish the job.  All lanes of the previous job were claimed and finished, so no worker is reading the fields above.
+    unsigned job = (myClaim.load(std::memory_order_relaxed)>>laneBits)+1;
+    myClaim.store(job<<laneBits,std::memory_order_seq_cst);
+    // Wake waiting workers.  A worker that wakes late finds the lanes claimed, and waits again.
+    if( unsigned sleepers = mySleeperCount.exchange(0,std::memory_order_seq_cst) )
+        HostSignalSemaphore( myWake, sleepers );
+    // Render the lanes that no worker claims.
+    claimLanes();
+    // Wait for lanes that workers claimed.  Each is being rendered, so the wait is at most the time to render a lane.
+    while( myFinished.load(std::memory_order_acquire)!=myLaneCount )
+        _mm_pause();
+    // Sum lanes in fixed order.  Scaling by 1 is exact.
+    for( unsigned k=0; k<myLaneCount; ++k )
+        StereoMix( left, right, myLanes[k].left, myLanes[k].right, 1.0f, 1.0f, m );
 }
 
+static RenderPool TheRenderPool;
+
 //-----------------------------------------------------------
 // Communication between thread and interrupt handler
 //-----------------------------------------------------------
 
 //! Queue for sending messages from main code to interrupt handler.
 /** Allow for one sustain and one release message.  FIXME - determine right queue bound */
-NonblockingQueue<PlayerMessage> PlayerMessageQueue(1024);
+NonblockingQueue<PlayerMessage> PlayerMessageQueue;
 
 //! Queue for sending freed Players from interrupt handler to normal code. 
-static NonblockingQueue<Player*> FreePlayerQueue(PlayerCountMax);
+static NonblockingQueue<Player*> FreePlayerQueue;
 
-static inline float Hypot( float x, float y ) {
-    return sqrt(x*x+y*y);
+//! Number of samples generated by OutputInterruptHandler.  Wraps around.
+/** Written only by interrupt handler. */
+static std::atomic<unsigned> SampleClock(0);
+
+//! Time stamped on new messages, if ScheduleIsNow is false.  Accessed only by thread that calls Play.
+static unsigned ScheduleTime;
+static bool ScheduleIsNow = true;
+
+unsigned SampleClockNow() {
+    return SampleClock.load(std::memory_order_acquire);
 }
 
-void Play( Source* src, float volume, float x, float y ) {
-    static PoolAllocator<Player> playerAllocator(PlayerCountMax, false);
+void ScheduleAt( unsigned t ) {
+    ScheduleTime = t;
+    ScheduleIsNow = false;
+}
 
-    // Drain queue of freed players
-    while( Player** p = FreePlayerQueue.startPop() ) {
-        (*p)->source->destroy();
-        playerAllocator.destroy(*p);
+void ScheduleNow() {
+    ScheduleIsNow = true;
+}
+
+PlayerMessage* StartPlayerMessage( PlayerMessageKind kind, Player* p ) {
+    PlayerMessage* m = PlayerMessageQueue.startPush();
+    m->kind = kind;
+    m->player = p;
+    // A time that is already past takes effect immediately.
+    m->time = ScheduleIsNow ? SampleClockNow() : ScheduleTime;
+    return m;
+}
+
+//! Players that have been started and not yet reclaimed.  Accessed only by thread that calls Play.
+static SimpleBag<Player*> VoiceList;
+
+static PoolAllocator<Player> PlayerAllocator;
+
+//! Players that the interrupt handler is rendering.  Accessed only by interrupt handler.
+static SimpleBag<Player*> LivePlayerSet;
+
+//! PlayerDone[i] is set if LivePlayerSet.begin()[i] finished during a chunk.
+static bool* PlayerDone;
+
+static VoiceStealStats TheVoiceStealStats;
+
+//! Reclaim players that the interrupt handler has finished with.
+static void ReclaimPlayers() {
+    while( Player** f = FreePlayerQueue.startPop() ) {
+        Player* p = *f;
+        // Move last voice into the vacated slot.
+        Player* last = VoiceList.end()[-1];
+        last->voiceIndex = p->voiceIndex;
+        VoiceList.erase(VoiceList.begin()+p->voiceIndex);
+        p->destroySource();
+        PlayerAllocator.destroy(p);
         FreePlayerQueue.finishPop();
     }
+}
+
+bool StealVoice( const void* first, const void* last ) {
+    ReclaimPlayers();
+    unsigned now = SampleClock.load(std::memory_order_relaxed);
+    Player* victim = NULL;
+    float victimCost = 0;
+    for( Player* p: VoiceList ) 
+        if( !p->stealPending && first<=p->source && p->source<last ) {
+            float c = p->stealCost(now);
+            if( !victim || c<victimCost ) {
+                victim = p;
+                victimCost = c;
+            }
+        }
+    if( !victim ) 
+        return false;
+    victim->stealPending = true;
+    Player::detachHolder(victim->source);
+    StartPlayerMessage( PlayerMessageKind::Steal, victim );
+    PlayerMessageQueue.finishPush();
+    ++TheVoiceStealStats.stolen;
+    return true;
+}
+
+void CountDroppedVoice() {
+    ++TheVoiceStealStats.dropped;
+}
+
+VoiceStealStats GetVoiceStealStats() {
+    return TheVoiceStealStats;
+}
+
+size_t ActiveVoiceCount() {
+    ReclaimPlayers();
+    return VoiceList.end()-VoiceList.begin();
+}
+
+bool FractionalDelay = false;
+
+static inline float Hypot( float x, float y ) {
+    return sqrt(x*x+y*y);
+}
+
+void Play( Source* src, float volume, float x, float y ) {
+    ReclaimPlayers();
     if( !src ) 
         // Allocation of Source failed.
         return;
-    Player* p = playerAllocator.allocate();
+    Player* p = PlayerAllocator.allocate();
+    if( PlayerAllocator.available()<StealReserve )
+        StealVoice( NULL, reinterpret_cast<const void*>(~size_t(0)) );
+    if( !p ) {
+        // Out of players.  Drop the source as if it had never been allocated.
+        CountDroppedVoice();
+        Player::detachHolder(src);
+        src->destroy();
+        return;
+    }
     src->player = p;
     p->source = src;
-    p->volume[0] = volume*cos(atan2(y,-x)/2);
-    p->volume[1] = volume*cos(atan2(y,x)/2);
+    float v[2];
+    PanGain( x, y, v[0], v[1] );
+    v[0] *= volume;
+    v[1] *= volume;
     float c = (Player::delayBufSize-1)/2;         // The "-1" is supposed to provide a safety margin for roundoff issues
-    p->delay[0] = Min( ~0u, unsigned(Hypot(x+1,y)*c) );
-    p->delay[1] = Min( ~0u, unsigned(Hypot(x-1,y)*c) );
-    Assert( p->delayDiff()<=Player::delayBufSize );                  
+    float t[2] = {Hypot(x+1,y)*c, Hypot(x-1,y)*c};
+    for( int k=0; k<2; ++k ) {
+        p->delay[k] = Min( ~0u, unsigned(t[k]) );
+        p->volume[k][0] = v[k];
+        p->volume[k][1] = 0;
+    }
+    if( FractionalDelay ) {
+        // Round the common part of the delay down, and split the difference between the 
+        // lagging channel's two taps.  Only the difference between the ears is audible.
+        int lag = t[0]<t[1];
+        float common = Min( t[0], t[1] );
+        float diff = t[lag]-common;
+        unsigned base = Min( ~0u, unsigned(common) );
+        unsigned whole = unsigned(diff);
+        float f = diff-whole;
+        p->delay[1-lag] = base;
+        p->delay[lag] = base+whole;
+        p->volume[lag][0] = v[lag]*(1-f);
+        p->volume[lag][1] = v[lag]*f;
+    }
+    Assert( p->delayDiff()<Player::delayBufSize );                  
     p->postSource = 0;
-    std::memset( p->delayBuf, 0, sizeof(float)*p->delayDiff() );
+    p->clearRing();
+    p->stolen = false;
+    // The interrupt handler has not seen the source yet, so reading its level here is safe.
+    p->sourceLevel.store(src->level(),std::memory_order_relaxed);
+    p->stealPending = false;
+    p->voiceIndex = VoiceList.end()-VoiceList.begin();
+    VoiceList.push(p);
 
     // Send message to interrupt handler.
-    PlayerMessage* m = PlayerMessageQueue.startPush();
-    m->kind = PlayerMessageKind::Start;
-    m->player = p;
+    PlayerMessage* m = StartPlayerMessage( PlayerMessageKind::Start, p );
+    p->startTime = m->time;
     PlayerMessageQueue.finishPush();
 }
 
-void OutputInterruptHandler( Waveform::sampleType* left, Waveform::sampleType* right, unsigned n ) {
-    static SimpleBag<Player*> livePlayerSet(PlayerCountMax);
-
-    // Read incoming messages
-    while(PlayerMessage* m = PlayerMessageQueue.startPop()) {
-        Player* p = m->player;
-        Assert( (size_t(p)&3)==0 );
-        Assert( p->source->player==p ); 
-        if( m->kind==PlayerMessageKind::Start ) {
-            // Starting a new player
-            livePlayerSet.push(p);
-        } else {
-            // Continuing an old player
-            p->source->receive(*m);
-        }
-        PlayerMessageQueue.finishPop();
+//! Start fading out p if it is still live.  Called only by interrupt handler.
+static void ReceiveSteal( Player* p ) {
+    // The victim may have finished, and even been reclaimed, since it was picked.
+    // It is live iff it is still in the set.  Linear search is okay since stealing is rare.
+    if( std::find(LivePlayerSet.begin(),LivePlayerSet.end(),p)!=LivePlayerSet.end() && !p->stolen ) {
+        p->stolen = true;
+        p->fadeLeft = Player::stealFadeSize;
     }
+}
 
+void OutputInterruptHandler( Waveform::sampleType* left, Waveform::sampleType* right, unsigned n ) {
+    unsigned now = SampleClock.load(std::memory_order_relaxed);
     // Get n samples
     while(n>0) {
         // Get samples in chunks of up to Player::chunkMaxSize
         unsigned m = Min(n,Player::chunkMaxSize);
-        // For each player, make it contribute m samples 
-        for(Player** pp = livePlayerSet.begin(); pp<livePlayerSet.end();) {
-            Player& p = **pp;
-            if( p.update(left,right,m) ) {
-                // Player not finished
-                ++pp;
+        // Act on messages that are due.  Stop the chunk where the next message is due, 
+        // so that it takes effect on the exact sample.
+        while(PlayerMessage* msg = PlayerMessageQueue.startPop()) {
+            int wait = int(msg->time-now);
+            if( wait>0 ) {
+                m = Min(m,unsigned(wait));
+                break;
+            }
+            Player* p = msg->player;
+            Assert( (size_t(p)&3)==0 );
+            if( msg->kind==PlayerMessageKind::Steal ) {
+                ReceiveSteal(p);
             } else {
+                Assert( p->source->player==p ); 
+                if( msg->kind==PlayerMessageKind::Start ) {
+                    // Starting a new player
+                    LivePlayerSet.push(p);
+                } else {
+                    // Continuing an old player
+                    p->source->receive(*msg);
+                }
+            }
+            PlayerMessageQueue.finishPop();
+        }
+        // For each player, make it contribute m samples 
+        size_t count = LivePlayerSet.end()-LivePlayerSet.begin();
+        TheRenderPool.render( left, right, LivePlayerSet.begin(), count, m, PlayerDone );
+        // Walk backwards so that erase does not move unvisited players.
+        for( size_t i=count; i-->0; ) 
+            if( PlayerDone[i] ) {
                 // Player is finished.  Send back for reclamation and erase from LivePlayerSet.
                 Player** f = FreePlayerQueue.startPush();
                 Assert(f);
-                *f = &p;
+                *f = LivePlayerSet.begin()[i];
                 FreePlayerQueue.finishPush();
-                livePlayerSet.erase(pp);
+                LivePlayerSet.erase(LivePlayerSet.begin()+i);
+            } else {
+                Player* p = LivePlayerSet.begin()[i];
+                p->sourceLevel.store(p->source->level(),std::memory_order_relaxed);
             }
-        }
         n-=m;
         left+=m;
         right+=m;
+        now+=m;
+    }
+    SampleClock.store(now,std::memory_order_release);
+}
+
+//-----------------------------------------------------------
+// Envelopes
+//-----------------------------------------------------------
+
+void ApplyGainRamp( float* acc, unsigned n, float g0, float dg ) {
+    __m128 g = _mm_add_ps( _mm_set1_ps(g0), _mm_mul_ps(_mm_set1_ps(dg), _mm_setr_ps(0,1,2,3)) );
+    const __m128 step = _mm_set1_ps(4*dg);
+    unsigned k = 0;
+    for( ; k+4<=n; k+=4 ) {
+        _mm_storeu_ps( acc+k, _mm_mul_ps(_mm_loadu_ps(acc+k),g) );
+        g = _mm_add_ps(g,step);
+    }
+    for( ; k<n; ++k )
+        acc[k] *= g0+k*dg;
+}
+
+Envelope::timeType ApplyEnvelope( float* acc, unsigned n, const Envelope& e, Envelope::timeType j, Envelope::timeType dj ) {
+    const Envelope::sampleType* p = e.begin();
+    // The envelope is piecewise linear, so keep each period within about one step of the table.
+    unsigned period = dj==0 ? EnvelopeControlPeriod : Clip( 1u, EnvelopeControlPeriod, Envelope::unitTime/dj );
+    for( unsigned k=0; k<n; k+=period ) {
+        unsigned b = Min( n-k, period );
+        // Exact gain at first and last sample of the period
+        float g0 = e.interpolate(p,j);
+        float g1 = e.interpolate(p,j+(b-1)*dj);
+        ApplyGainRamp( acc+k, b, g0, b>1 ? (g1-g0)/(b-1) : 0 );
+        j += b*dj;
     }
+    return j;
 }
 
 //-----------------------------------------------------------
 // SimpleSource
 //-----------------------------------------------------------
-static PoolAllocator<SimpleSource> SimpleSourceAllocator(64,false);
+static VoicePool<SimpleSource> SimpleSourceAllocator(&EngineConfig::simpleSourceCount);
 
 SimpleSource* SimpleSource::allocate( const Waveform& w, float freq ) {
     Assert( !w.isCyclic() );
     Assert( 1.f/1000 <= freq && freq <= 1000.f );   // Sanity check
-    SimpleSource* s = SimpleSourceAllocator.allocate();
-    Assert(s);
+    SimpleSource* s = AllocateVoice(SimpleSourceAllocator);
     if( s ) {
         new(s) SimpleSource;
-        s->waveform = &w;
         s->waveLowIndex = 0;
         s->waveHighIndex = 0;
         s->waveDelta = Waveform::timeType(freq*Waveform::unitTime);
+        // Read from a coarser copy if one exists, for less aliasing and less memory traffic.
+        unsigned level;
+        s->waveform = &w.mipLevelFor(s->waveDelta,level);
         Assert( s->waveDelta>0 );
         Assert( s->waveDelta<=Waveform::unitTime*128 );   // Sanity check
     }
@@ -196,16 +701,78 @@ void SimpleSource::receive( const PlayerMessage& m ) {
     Assert(0);
 }
 
+static bool IsSimpleSource( const Source* s ) {
+    return SimpleSourceAllocator.contains(s);
+}
+
+unsigned SimpleSource::available( unsigned n ) const {
+    unsigned m = n;
+    int o = waveform->size() - waveHighIndex;
+    Assert( int(o)>=0 );
+    if( o <= ~0u<<Waveform::timeShift>>Waveform::timeShift ) 
+        m = Min(m,((o<<Waveform::timeShift)-waveLowIndex)/waveDelta);
+    return m;
+}
+
+void SimpleSource::update4( SimpleSource* const src[4], float* const acc[4], const unsigned n[4], unsigned count[4] ) {
+    // Number of samples that all four sources can produce.
+    unsigned common = ~0u;
+    // Gather state of the four sources into SIMD lanes.
+    const Waveform::sampleType* w[4];
+    Waveform::timeType i[4], di[4];
+    for( unsigned v=0; v<4; ++v ) {
+        count[v] = src[v]->available(n[v]);
+        common = Min( common, count[v] );
+        w[v] = src[v]->waveform->begin() + src[v]->waveHighIndex;
+        i[v] = src[v]->waveLowIndex;
+        di[v] = src[v]->waveDelta;
+    }
+    __m128i vi = _mm_loadu_si128((const __m128i*)i);
+    const __m128i vdi = _mm_loadu_si128((const __m128i*)di);
+    const __m128i fractionMask = _mm_set1_epi32(Waveform::unitTime-1);
+    const __m128 scale = _mm_set1_ps(1.0f/Waveform::unitTime);
+    unsigned k = 0;
+    for( ; k+4<=common; k+=4 ) {
+        // out[t] holds sample k+t of each source.  Arithmetic matches Waveform::interpolate.
+        __m128 out[4];
+        for( unsigned t=0; t<4; ++t ) {
+            unsigned j[4];
+            _mm_storeu_si128((__m128i*)j, _mm_srli_epi32(vi,Waveform::timeShift));
+            // Load each pair of adjacent samples with one 64-bit load, then separate the pairs.
+            __m128 p0 = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(w[0]+j[0])));
+            __m128 p1 = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(w[1]+j[1])));
+            __m128 p2 = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(w[2]+j[2])));
+            __m128 p3 = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(w[3]+j[3])));
+            __m128 lo = _mm_unpacklo_ps(p0,p1);
+            __m128 hi = _mm_unpacklo_ps(p2,p3);
+            __m128 s0 = _mm_movelh_ps(lo,hi);
+            __m128 s1 = _mm_movehl_ps(hi,lo);
+            __m128 f = _mm_mul_ps( _mm_cvtepi32_ps(_mm_and_si128(vi,fractionMask)), scale );
+            out[t] = _mm_add_ps( s0, _mm_mul_ps(_mm_sub_ps(s1,s0), f) );
+            vi = _mm_add_epi32(vi,vdi);
+        }
+        // Transpose so that out[v] holds samples k..k+3 of source v.
+        _MM_TRANSPOSE4_PS( out[0], out[1], out[2], out[3] );
+        for( unsigned v=0; v<4; ++v )
+            _mm_storeu_ps( acc[v]+k, out[v] );
+    }
+    // Scatter state back, and let each source finish on its own.
+    _mm_storeu_si128((__m128i*)i, vi);
+    for( unsigned v=0; v<4; ++v ) {
+        SimpleSource& s = *src[v];
+        s.waveLowIndex = i[v] & Waveform::unitTime-1;
+        s.waveHighIndex += i[v]>>Waveform::timeShift;
+        unsigned r = s.update( acc[v]+k, count[v]-k );
+        Assert( r==count[v]-k );
+    }
+}
+
 unsigned SimpleSource::update( float* acc, unsigned n ) {
     Assert( (((long long)waveHighIndex<<Waveform::timeShift)+waveLowIndex) % waveDelta == 0 );
     const Waveform::sampleType* w = waveform->begin() + waveHighIndex;
     Waveform::timeType di = waveDelta;
     Waveform::timeType i = waveLowIndex;
-    unsigned m = n;
-    int o = waveform->size() - waveHighIndex;
-    Assert( int(o)>=0 );
-    if( o <= ~0u<<Waveform::timeShift>>Waveform::timeShift ) 
-        m = Min(m,((o<<Waveform::timeShift)-i)/di);
+    unsigned m = available(n);
     for( unsigned k=0; k<m; ++k ) {
         // Create wave sample by interpolating waveTable  
         acc[k] = waveform->interpolate(w,i);
@@ -221,14 +788,13 @@ unsigned SimpleSource::update( float* acc, unsigned n ) {
 //-----------------------------------------------------------
 // DynamicSource
 //-----------------------------------------------------------
-static PoolAllocator<DynamicSource> DynamicSourceAllocator(256,false);
+static VoicePool<DynamicSource> DynamicSourceAllocator(&EngineConfig::dynamicSourceCount);
 
 DynamicSource* DynamicSource::allocate( const Waveform& w, float freq ) {
     Assert( w.size()<<Waveform::timeShift>>Waveform::timeShift == w.size() );
     Assert( w.isCompleted() );
     Assert( 1.f/1000 <= freq && freq <= 1000.f );   // Sanity check
-    DynamicSource* s = DynamicSourceAllocator.allocate();
-    Assert(s);
+    DynamicSource* s = AllocateVoice(DynamicSourceAllocator);
     if( s ) {
         new(s) DynamicSource;
         s->waveform = &w;
@@ -294,10 +860,10 @@ unsigned DynamicSource::update( float* acc, unsigned n ) {
 }
 
 void DynamicSource::changeVolume( float newVolume, float deadline, bool releaseWhenDone ) {
+    if( releaseWhenDone )
+        noteRelease();
     // Send message
-    PlayerMessage* m = PlayerMessageQueue.startPush();
-    m->kind = PlayerMessageKind::ChangeVolume;
-    m->player = player;
+    PlayerMessage* m = StartPlayerMessage( PlayerMessageKind::ChangeVolume, player );
     m->dynamic.newVolume = newVolume;
     m->dynamic.deadline = unsigned(SampleRate*deadline);
     m->dynamic.release = releaseWhenDone;
@@ -308,14 +874,14 @@ void DynamicSource::changeVolume( float newVolume, float deadline, bool releaseW
 //-----------------------------------------------------------
 // AsrSource
 //-----------------------------------------------------------
-static PoolAllocator<AsrSource> AsrSourceAllocator(64,false);
+static VoicePool<AsrSource> AsrSourceAllocator(&EngineConfig::asrSourceCount);
 
 AsrSource* AsrSource::allocate( const Waveform& w, float freq, const Envelope& attack, float speed ) {
     Assert( w.size()<<Waveform::timeShift>>Waveform::timeShift == w.size() );
     Assert( w.isCompleted() );
     Assert( 1.f/1000 <= freq && freq <= 1000.f );   // Sanity check
     Assert( 1.f/1000000 <= speed && speed <= 1.0f/20 );
-    AsrSource* s = AsrSourceAllocator.allocate();
+    AsrSource* s = AllocateVoice(AsrSourceAllocator);
     if( s ) {
         new(s) AsrSource;
         s->waveform = &w;
@@ -355,7 +921,6 @@ unsigned AsrSource::update( float* acc, unsigned n ) {
     Waveform::timeType wrap = waveform->limit(); 
     Waveform::timeType di = waveDelta;
     while( n>0 ) {
-        const Envelope::sampleType* e = envelope->begin();
         Envelope::timeType limit = envelope->limit(); 
         // Set m to number of samples to compute this time around the while loop.
         Waveform::timeType dj = envDelta;
@@ -364,13 +929,14 @@ unsigned AsrSource::update( float* acc, unsigned n ) {
         Waveform::timeType i = waveIndex;
         for( unsigned k=0; k<m; ++k ) {
             // Create wave sample by interpolating waveTable  
-            acc[k] = waveform->interpolate(w,i)*envelope->interpolate(e,j);
+            acc[k] = waveform->interpolate(w,i);
             // Update waveIndex and wrap around if necessary. 
             i += di;
             if( i>=wrap )
                 i -= wrap;
-            j += dj;
         }
+        // Segment ends exactly at limit, so only the gain within it is approximated.
+        j = ApplyEnvelope( acc, m, *envelope, j, dj );
         n -= m;
         acc += m;
         waveIndex = i;
@@ -396,17 +962,92 @@ unsigned AsrSource::update( float* acc, unsigned n ) {
 }
 
 void AsrSource::changeEnvelope(Envelope& e, float speed) {
+    if( !e.isSustain() )
+        noteRelease();
     // Send message
-    PlayerMessage* m = PlayerMessageQueue.startPush();
-    m->kind = PlayerMessageKind::ChangeEnvelope;
-    m->player = player;
+    PlayerMessage* m = StartPlayerMessage( PlayerMessageKind::ChangeEnvelope, player );
     m->midi.envelope = &e;
     m->midi.envDelta = Envelope::timeType(speed*Envelope::unitTime);
     Assert( (size_t(player)&3)==0 );
     PlayerMessageQueue.finishPush();
 }
 
-void Initialize() {
+//-----------------------------------------------------------
+// Engine memory
+//-----------------------------------------------------------
+
+static EngineConfig TheEngineConfig;
+
+const EngineConfig& GetEngineConfig() {
+    return TheEngineConfig;
+}
+
+VoicePoolBase* VoicePoolBase::root;
+
+VoicePoolBase::VoicePoolBase( size_t EngineConfig::*count, size_t itemSize ) : myCount(count), myItemSize(itemSize) {
+    myNext = root;
+    root = this;
+}
+
+//! Carves one block of memory into the pieces needed by the engine.
+/** A Slab with a NULL base only measures how big the block must be. */
+class Slab: NoCopy {
+    char* myBase;
+    size_t mySize;
+public:
+    Slab( char* base ) : myBase(base), mySize(0) {}
+    bool isMeasuring() const {return !myBase;}
+    size_t size() const {return mySize;}
+    //! Return space for n items of given size.  Pieces are 16-byte multiples, so that each has the alignment of the base.
+    void* take( size_t n, size_t itemSize ) {
+        char* p = myBase ? myBase+mySize : NULL;
+        mySize += n*itemSize+15 & ~size_t(15);
+        return p;
+    }
+};
+
+void Initialize( const EngineConfig& config ) {
+    static char* engineMemory;
+    Assert( !engineMemory );
+    TheEngineConfig = config;
+    // Either measure the engine's memory, or assign it, depending upon whether slab is measuring.
+    auto layOut = [&]( Slab& slab ) {
+        size_t n = config.playerCount;
+        void* players = slab.take( n, sizeof(Player) );
+        void* freePlayers = slab.take( n, sizeof(Player*) );
+        void* voices = slab.take( n, sizeof(Player*) );
+        void* live = slab.take( n, sizeof(Player*) );
+        void* done = slab.take( n, sizeof(bool) );
+        void* messages = slab.take( config.messageQueueSize, sizeof(PlayerMessage) );
+        bool assign = !slab.isMeasuring();
+        if( assign ) {
+            PlayerAllocator.assign( players, n );
+            FreePlayerQueue.assign( (Player**)freePlayers, n );
+            VoiceList.assign( voices, n );
+            LivePlayerSet.assign( live, n );
+            PlayerDone = (bool*)done;
+            PlayerMessageQueue.assign( (PlayerMessage*)messages, config.messageQueueSize );
+        }
+        for( VoicePoolBase* p=VoicePoolBase::root; p; p=p->myNext ) {
+            size_t m = config.*p->myCount;
+            void* block = slab.take( m, p->myItemSize );
+            if( assign )
+                p->assign( block, m );
+        }
+    };
+    Slab measure(NULL);
+    layOut( measure );
+    engineMemory = (char*)operator new( measure.size() );
+    Slab slab(engineMemory);
+    layOut( slab );
+    Assert( slab.size()==measure.size() );
+
+    InitializeStereoMix();
+    TheVoiceStealStats.stolen = 0;
+    TheVoiceStealStats.dropped = 0;
+    // Leave one hardware thread for the user interface.
+    unsigned n = std::thread::hardware_concurrency();
+    TheRenderPool.start( n>1 ? n-1 : 1 );
 }
 
 } // namespace Synthesizer
\ No newline at end of file
@@ -4,8 +4,10 @@
 #include "Utility.h"
 #include "Waveform.h"
 #include "NonblockingQueue.h"
+#include "PoolAllocator.h"
 #include <new>
 #include <cstdint>
+#include <type_traits>
 
 class PatchSample;
 
@@ -32,11 +34,24 @@ private:
     char myIsSustain;
 };
 
+//! Number of samples per envelope control period.  
+/** ApplyEnvelope computes the gain exactly at the first and last sample of each period, 
+    and ramps linearly in between.  Periods are shorter for envelopes that are played quickly. */
+const unsigned EnvelopeControlPeriod = 32;
+
+//! Multiply acc[k] by g0+k*dg for k in [0,n).  Vectorized.
+void ApplyGainRamp( float* acc, unsigned n, float g0, float dg );
+
+//! Multiply acc[k] by e at time j+k*dj for k in [0,n), evaluating e only at the control rate.  Returns j+n*dj.
+/** Requires that j+(n-1)*dj be inside e. */
+Envelope::timeType ApplyEnvelope( float* acc, unsigned n, const Envelope& e, Envelope::timeType j, Envelope::timeType dj );
+
 enum class PlayerMessageKind: char {
     Start,
     ChangeVolume,                   // Used by DynamicSource
     ChangeEnvelope,                 // Used by AsrSource
-    Release                         // Used by PatchSource
+    Release,                        // Used by PatchSource
+    Steal                           // Used by StealVoice
 };
 
 class Player;
@@ -45,6 +60,8 @@ class PlayerMessage {   // FIXME - find a better name
 public:
     PlayerMessageKind kind;             // Really a PlayerMessageKind
     Player* player;
+    //! Sample clock value at which message takes effect.  See ScheduleAt.
+    unsigned time;
     union {
         struct {                        // kind==WMK_ChangeEnvelope
             const Envelope* envelope;
@@ -60,6 +77,22 @@ public:
 
 extern NonblockingQueue<PlayerMessage> PlayerMessageQueue;
 
+//! Start pushing a message of the given kind for player p, stamped with the current schedule time.
+/** Caller must fill in any other fields and call PlayerMessageQueue.finishPush(). */
+PlayerMessage* StartPlayerMessage( PlayerMessageKind kind, Player* p );
+
+//! Index of next sample to be produced by OutputInterruptHandler.  Wraps around.
+unsigned SampleClockNow();
+
+//! Make messages sent after this call take effect when the sample clock reaches t.
+/** Messages take effect in the order sent, so a message never takes effect before its predecessors.  
+    A message whose time has passed takes effect at the start of the next block.  Affects Play 
+    and messages sent by sources.  Call only from the thread that calls Play. */
+void ScheduleAt( unsigned t );
+
+//! Make messages sent after this call take effect as soon as possible.  This is the default.
+void ScheduleNow();
+
 class Player;
 class PlayerMessage;
 
@@ -67,6 +100,16 @@ class PlayerMessage;
 class Source: NoCopy {
 protected:
     Player* player;
+    //! Client's pointer to this source, or NULL.  See setHolder.
+    Source** holder;
+    //! True if source has been told to finish on its own.  Accessed only by thread that calls Play.
+    bool releaseSent;
+    Source() : player(NULL), holder(NULL), releaseSent(false) {}
+    //! Record that the source was told to finish on its own.  Client no longer holds it.
+    void noteRelease() {
+        releaseSent = true;
+        holder = NULL;
+    }
     friend void Play( Source* src, float volume, float x, float y );
     friend void OutputInterruptHandler( Waveform::sampleType* left, Waveform::sampleType* right, unsigned n );
     friend class Player;
@@ -75,7 +118,19 @@ protected:
     virtual void destroy() = 0;
     //! Asynchronously called when a message is received by the interrupt handler.
     virtual void receive( const PlayerMessage& m ) = 0;
+    //! Rough current gain of the source.  Used to pick a voice to steal.
+    /** Called by Play before the source starts, and afterwards only by the interrupt handler, after each chunk. */
+    virtual float level() const {return 1.0f;}
 public:
+    //! Declare that client retains pointer p to this source, so that it can send messages later.
+    /** If the source is stolen, p is set to NULL, and the client must not send it further messages. 
+        The declaration lapses when the source is released. */
+    template<typename T>
+    void setHolder( T*& p ) {
+        static_assert( std::is_base_of<Source,T>::value, "p must point to a Source" );
+        Assert( p==this );
+        holder = reinterpret_cast<Source**>(&p);
+    }
 };
 
 //! Sound source that plays back pre-recorded waveform, without elaborate modifications.
@@ -87,6 +142,11 @@ class SimpleSource: public Source {
     /*override*/ unsigned update( float* acc, unsigned n );
     /*override*/ void destroy();  
     /*override*/ void receive( const PlayerMessage& m );
+    //! Number of samples, up to n, that source can produce before reaching its end.
+    unsigned available( unsigned n ) const;
+    //! Equivalent to count[v] = src[v]->update(acc[v],n[v]) for v in [0,4), but advances the four sources together.
+    static void update4( SimpleSource* const src[4], float* const acc[4], const unsigned n[4], unsigned count[4] );
+    friend class RenderPool;
 public:
     //! Construct source from given waveform, to be played at relative frequency freq.  Default is to play at original frequency.
     static SimpleSource* allocate( const Waveform& w, float freq=1.0f );
@@ -105,6 +165,7 @@ private:
     /*override*/ unsigned update( float* acc, unsigned n );
     /*override*/ void destroy();
     /*override*/ void receive( const PlayerMessage& m );
+    /*override*/ float level() const {return currentVolume;}
 public:
     static DynamicSource* allocate( const Waveform& w, float freq=1.0f );
     //! Cause volume to change smoothly to given value by given deadline.
@@ -132,19 +193,111 @@ public:
     void changeEnvelope(Envelope& e, float speed=1.0f );
 };
 
-//! Intialize synthesizer global structures.
-void Initialize();
+//! Capacities of the synthesizer's pools and queues.
+/** Defaults suit a modest machine.  All memory for them is allocated by Initialize, 
+    in one block, so the interrupt handler never allocates memory. */
+struct EngineConfig {
+    //! Maximum number of voices playing at once.
+    size_t playerCount;
+    //! Maximum number of live sources of each kind.
+    size_t simpleSourceCount;
+    size_t dynamicSourceCount;
+    size_t asrSourceCount;
+    size_t sf2SourceCount;
+    //! Capacity of PlayerMessageQueue.  Should allow for several messages per voice.
+    size_t messageQueueSize;
+    //! Interpolation used by SoundFont instruments to resample their samples.
+    Interpolation interpolation;
+    EngineConfig() : 
+        playerCount(256), 
+        simpleSourceCount(64), 
+        dynamicSourceCount(256), 
+        asrSourceCount(64), 
+        sf2SourceCount(64), 
+        messageQueueSize(1024),
+        interpolation(Interpolation::linear)
+    {}
+};
+
+//! Configuration passed to Initialize.
+const EngineConfig& GetEngineConfig();
+
+//! Pool of one kind of Source.  Its memory is assigned by Initialize.
+/** Sources defined outside Synthesizer.cpp get their pools from here too, so that one 
+    EngineConfig covers all of them.  Pools must be objects with static storage duration. */
+class VoicePoolBase: NoCopy {
+    VoicePoolBase* myNext;
+    size_t EngineConfig::*myCount;
+    size_t myItemSize;
+    //! List of all pools, in order of construction.
+    static VoicePoolBase* root;
+    virtual void assign( void* block, size_t maxSize ) = 0;
+    friend void Initialize( const EngineConfig& config );
+protected:
+    VoicePoolBase( size_t EngineConfig::*count, size_t itemSize );
+};
+
+template<typename T>
+class VoicePool: public VoicePoolBase, public PoolAllocator<T> {
+    /*override*/ void assign( void* block, size_t maxSize ) {PoolAllocator<T>::assign(block,maxSize);}
+public:
+    //! Create pool whose capacity will be given by the field count of the EngineConfig.
+    VoicePool( size_t EngineConfig::*count ) : VoicePoolBase(count,sizeof(T)) {}
+};
+
+//! Intialize synthesizer global structures.  Must be called exactly once, before any other synthesizer routine.
+void Initialize( const EngineConfig& config=EngineConfig() );
 
 //! Fill left and right with next n samples
 void OutputInterruptHandler( Waveform::sampleType* left, Waveform::sampleType* right, unsigned n );
 
 void InputInterruptHandler( const Waveform::sampleType* wave, size_t n );
 
+//! If true, Play gives sources sub-sample inter-aural delay, so that nearby positions pan smoothly.
+/** Costs no extra memory, but mixing of off-center sources does two multiplies per sample per channel. 
+    Should be set only from the thread that calls Play. */
+extern bool FractionalDelay;
+
 //! Start playing src.  Method src->destroy() will be invoked after src->update() returns.
 /** No-op if src is NULL.  Doing so allows clients to SimplesSource to not have to check
     whether SimpleSource::allocate returns NULL. */
 void Play( Source* src, float volume=1.0f, float x=0, float y=1.0f );
 
+//! Number of free slots in a voice pool below which allocating a voice steals another one.
+/** A stolen voice is faded out over a few msec before its slot is free, hence the need for a reserve. */
+const size_t StealReserve = 4;
+
+//! Fade out the playing voice that is cheapest to lose and whose Source lies in [first,last).
+/** Prefers quiet, released, and old voices.  Returns false if there was no candidate.
+    Call only from the thread that calls Play. */
+bool StealVoice( const void* first, const void* last );
+
+//! Record that a voice could not be allocated at all.
+void CountDroppedVoice();
+
+//! Allocate memory for a Source from pool, stealing a voice if the pool is nearly exhausted.
+/** Returns NULL if the pool is exhausted anyway. */
+template<typename T>
+T* AllocateVoice( PoolAllocator<T>& pool ) {
+    T* s = pool.allocate();
+    if( pool.available()<StealReserve ) 
+        StealVoice( pool.blockBegin(), pool.blockEnd() );
+    if( !s )
+        CountDroppedVoice();
+    return s;
+}
+
+//! Counts of voices stolen and dropped since Initialize.  For monitoring.
+struct VoiceStealStats {
+    unsigned long stolen;       //!< Voices faded out to make room for new ones
+    unsigned long dropped;      //!< Voices never played because their pool was exhausted
+};
+
+VoiceStealStats GetVoiceStealStats();
+
+//! Number of voices started by Play that the interrupt handler has not finished with.
+size_t ActiveVoiceCount();
+
 } // namespace Synthesizer
 
 #define INJECT_SOUND 0
@@ -14,8 +14,8 @@ ToneInstrument::ToneInstrument(const ToneSet& toneSet) : myToneSet(toneSet) {
 void ToneInstrument::noteOn( const Event& on, const Event& off ) {
     if( myToneSet.patch().empty() ) 
         return;
-    int note = on.note();   // Used signed type, so that "note-69" can go negative
-    float freq = 440*std::pow(1.059463094f, note-69);
+    int note = on.note();
+    float freq = Midi::PitchOfNote(note);
     const PatchSample& ps = myToneSet.patch().find(freq);
     playSource(ps,note,freq/ps.pitch(),on.velocity()*(1.0f/127));
 }
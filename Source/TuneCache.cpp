@@ -0,0 +1,185 @@
+/******************************************************************************
+ Cache of a parsed MIDI tune.
+
+ The cache file is laid out so that it can be mapped and used in place:
+
+     cacheHeader
+     sections, each aligned on an 8-byte boundary, as described by header.section
+
+ The events and note-off offsets are exactly what Tune holds after parsing a MIDI file, and
+ the channels are what ChannelMap::assign produced, so reloading does no parsing or sorting.
+ The cache is in host byte order.
+*******************************************************************************/
+
+#include "Midi.h"
+#include "CacheFile.h"
+#include "AssertLib.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace Midi {
+
+static const char CacheMagic[8] = {'W','a','T','u','n','e','C','h'};
+
+//! Increment when the format changes, or when the layout of Event changes.
+static const uint32_t CacheVersion = 1;
+
+enum CacheSection {
+    cs_events,
+    cs_noteOffOffsets,
+    cs_programs,                //!< Program of each channel
+    cs_nameOffsets,             //!< Name of channel k is names[nameOffsets[k]:nameOffsets[k+1]]
+    cs_names,
+    cs_sortedByName,
+    cs_count
+};
+
+struct Tune::cacheHeader {
+    char magic[8];
+    //! CacheVersion, or 0 if writing the cache did not finish.
+    uint32_t version;
+    uint32_t eventSize;
+    uint64_t sourceSize;
+    uint64_t sourceHash;
+    CacheSectionInfo section[cs_count];
+};
+
+uint64_t Tune::hashSource( const char* data, size_t size ) {
+    // FNV-1a.  MIDI files are small enough that hashing a byte at a time is cheap compared to parsing.
+    uint64_t h = 14695981039346656037ull;
+    for( size_t i=0; i<size; ++i ) {
+        h ^= uint8_t(data[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+bool Tune::loadCache( const std::string& filename, const std::string& cacheFilename ) {
+    clear();
+    std::unique_ptr<MappedFile> c(new MappedFile(cacheFilename.c_str()));
+    if( !c->isOpen() || c->size()<sizeof(cacheHeader) )
+        return false;
+    cacheHeader h;
+    memcpy( &h, c->begin(), sizeof(h) );
+    if( memcmp(h.magic,CacheMagic,8)!=0 || h.version!=CacheVersion || h.eventSize!=sizeof(Event) )
+        return false;
+    {
+        MappedFile m(filename.c_str());
+        if( !m.isOpen() || m.size()!=h.sourceSize || hashSource(m.begin(),m.size())!=h.sourceHash )
+            return false;
+    }
+    const CacheSectionInfo* s = h.section;
+    const Event* events = CacheSectionBegin<Event>( *c, s[cs_events] );
+    const uint32_t* offsets = CacheSectionBegin<uint32_t>( *c, s[cs_noteOffOffsets] );
+    const uint8_t* programs = CacheSectionBegin<uint8_t>( *c, s[cs_programs] );
+    const uint32_t* nameOffsets = CacheSectionBegin<uint32_t>( *c, s[cs_nameOffsets], 1 );
+    const char* names = CacheSectionBegin<char>( *c, s[cs_names] );
+    const Event::channelType* sorted = CacheSectionBegin<Event::channelType>( *c, s[cs_sortedByName] );
+    const size_t nEvent = size_t(s[cs_events].count);
+    const size_t nOffset = size_t(s[cs_noteOffOffsets].count);
+    const size_t nChannel = size_t(s[cs_programs].count);
+    if( !events || !offsets || !programs || !nameOffsets || !names || !sorted ||
+        s[cs_nameOffsets].count!=nChannel || s[cs_sortedByName].count!=nChannel || nChannel>size_t(Event::channelType(~0u)) )
+        return false;
+    // Check everything that Orchestra and NoteTracker use without bounds checks.
+    for( size_t k=0; k<nChannel; ++k )
+        if( nameOffsets[k]>nameOffsets[k+1] || sorted[k]>=nChannel )
+            return false;
+    if( nameOffsets[nChannel]>s[cs_names].count )
+        return false;
+    size_t d = 0;
+    Event::timeType t = 0;
+    // Whether each note is down, to check that "note on" and "note off" events alternate, as in canonical form.
+    std::vector<bool> down(nChannel*128);
+    for( size_t i=0; i<nEvent; ++i ) {
+        const Event& e = events[i];
+        if( e.time()<t )
+            return false;
+        t = e.time();
+        if( e.kind()==Event::noteOn || e.kind()==Event::noteOff ) {
+            if( e.channel()>=nChannel || e.myNote>=128 )
+                return false;
+            std::vector<bool>::reference isDown = down[e.channel()*128+e.myNote];
+            if( isDown!=(e.kind()==Event::noteOff) )
+                return false;
+            isDown = e.kind()==Event::noteOn;
+            if( e.kind()==Event::noteOn ) {
+                if( d>=nOffset || offsets[d]>=nEvent-i )
+                    return false;
+                const Event& off = events[i+offsets[d]];
+                if( off.kind()!=Event::noteOff || off.channel()!=e.channel() || off.myNote!=e.myNote )
+                    return false;
+                ++d;
+            }
+        }
+    }
+    if( d!=nOffset || std::find(down.begin(), down.end(), true)!=down.end() )
+        return false;
+
+    for( size_t k=0; k<nChannel; ++k ) {
+        Channel ch(programs[k]);
+        ch.myName.assign( names+nameOffsets[k], nameOffsets[k+1]-nameOffsets[k] );
+        myChannelMap.pushBack(ch);
+    }
+    myChannelMap.mySortedByName.assign( sorted, sorted+nChannel );
+    myEventSeq.view( events, events+nEvent );
+    myNoteOffOffsets.view( (uint32_t*)offsets, nOffset );
+    computeCheckpoints();
+    mySourceSize = h.sourceSize;
+    mySourceHash = h.sourceHash;
+    myCacheFile = std::move(c);
+    myReadStatus.clear();
+    Assert(assertOkay());
+    return true;
+}
+
+bool Tune::writeCache( const std::string& cacheFilename ) const {
+    // A tune read by loadCache is already cached, perhaps in cacheFilename itself, which is mapped.
+    if( myCacheFile || mySourceSize==0 )
+        return false;
+    const size_t nChannel = myChannelMap.size();
+    std::vector<uint8_t> programs;
+    std::vector<uint32_t> nameOffsets;
+    std::string names;
+    for( size_t k=0; k<nChannel; ++k ) {
+        programs.push_back(myChannelMap[k].program());
+        nameOffsets.push_back(uint32_t(names.size()));
+        names += myChannelMap[k].name();
+    }
+    nameOffsets.push_back(uint32_t(names.size()));
+
+    FILE* f = fopen(cacheFilename.c_str(),"wb");
+    if( !f )
+        return false;
+    cacheHeader h;
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, CacheMagic, 8 );
+    // Version is patched when the rest has been written.
+    h.version = 0;
+    h.eventSize = sizeof(Event);
+    h.sourceSize = mySourceSize;
+    h.sourceHash = mySourceHash;
+    CacheSectionInfo* s = h.section;
+    CacheWriter w( f, 0 );
+    w.write( &h, sizeof(h) );
+    w.writeSection( s[cs_events], myEventSeq.begin(), myEventSeq.size(), 0, sizeof(Event) );
+    w.writeSection( s[cs_noteOffOffsets], myNoteOffOffsets );
+    w.writeSection( s[cs_programs], programs.data(), nChannel, 0, sizeof(uint8_t) );
+    w.writeSection( s[cs_nameOffsets], nameOffsets.data(), nChannel, 1, sizeof(uint32_t) );
+    w.writeSection( s[cs_names], names.data(), names.size(), 0, sizeof(char) );
+    w.writeSection( s[cs_sortedByName], myChannelMap.mySortedByName.data(), nChannel, 0, sizeof(Event::channelType) );
+    bool okay = w.okay();
+    if( okay ) {
+        h.version = CacheVersion;
+        okay = fseek(f,0,SEEK_SET)==0 && fwrite(&h,sizeof(h),1,f)==1;
+    }
+    if( fclose(f)!=0 )
+        okay = false;
+    if( !okay )
+        remove(cacheFilename.c_str());
+    return okay;
+}
+
+} // namespace Midi
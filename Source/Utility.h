@@ -108,23 +108,36 @@ template<typename T, size_t Extra=0>
 class SimpleArray {
     T* myStart;
     size_t mySize;
+    //! False if myStart was supplied by method view.
+    bool myOwnsSpace;
     void operator=( const SimpleArray& ) = delete;
     SimpleArray( const SimpleArray& ) = delete;
 public:
-    SimpleArray() : myStart(0), mySize(0) {}
+    SimpleArray() : myStart(0), mySize(0), myOwnsSpace(true) {}
     SimpleArray( size_t n ) {
         myStart = new T[n];
         mySize = n;
+        myOwnsSpace = true;
     }
     ~SimpleArray() {clear();}
     size_t size() const {return mySize;}
     void clear() {
         if( myStart ) {
-            delete[] myStart; 
+            if( myOwnsSpace )
+                delete[] myStart; 
             myStart = 0; 
             mySize=0;
+            myOwnsSpace = true;
         }
     }
+    //! Make the array refer to start[0:n+Extra] without copying.  The memory is owned by the caller.
+    /** It must remain valid until the array is destroyed or the next call to clear, resize, or assign. */
+    void view( T* start, size_t n ) {
+        clear();
+        myStart = start;
+        mySize = n;
+        myOwnsSpace = false;
+    }
     void resize( size_t n ) {
         clear();
         if( n+Extra>0 ) {
@@ -166,14 +179,25 @@ class SimpleBag {
     T* myBegin;
     T* myEnd;
     T* myLimit;
+    bool myOwnsSpace;
 public:
     //! Create bag and reserve space for maxSize items.
     SimpleBag( size_t maxSize ) {
         myEnd = myBegin = (T*)operator new(sizeof(T)*maxSize);
         myLimit = myBegin + maxSize;
+        myOwnsSpace = true;
     }
+    //! Create bag with no space.  Method assign must be called before pushing items.
+    SimpleBag() : myBegin(0), myEnd(0), myLimit(0), myOwnsSpace(false) {}
     ~SimpleBag() {
-        operator delete(myBegin);
+        if( myOwnsSpace )
+            operator delete(myBegin);
+    }
+    //! Use raw memory for maxSize items at space as the bag's storage.  The memory is owned by the caller.
+    void assign( void* space, size_t maxSize ) {
+        Assert( !myOwnsSpace && myBegin==myEnd );
+        myEnd = myBegin = (T*)space;
+        myLimit = myBegin + maxSize;
     }
     bool isEmpty() {
         Assert( myBegin<=myEnd );
@@ -223,7 +223,7 @@ public:
 void WaInstrument::noteOn(const Midi::Event& on, const  Midi::Event& off) {
     Assert(on.note()==off.note());
     Assert(on.channel()==off.channel());
-    float desiredPitch = 440*std::pow(1.059463094f, on.note()-69);
+    float desiredPitch = Midi::PitchOfNote(on.note());
     float duration = (off.time()-on.time())*Midi::SecondsPerTock;
     auto wa = myWaSet.lookup(desiredPitch, duration);
     float relativeFreq = desiredPitch/wa->freq;
@@ -0,0 +1,192 @@
+#include "WavReader.h"
+#include "AssertLib.h"
+#include "ReadError.h"
+#include "Utility.h"
+#include <cstring>
+#include <emmintrin.h>
+
+namespace Synthesizer {
+
+//! Read little-endian 16-bit unsigned integer.
+static unsigned Get16( const char* p ) {
+    const byte* b = (const byte*)p;
+    return b[0] | b[1]<<8;
+}
+
+//! Read little-endian 32-bit unsigned integer.
+static uint32_t Get32( const char* p ) {
+    const byte* b = (const byte*)p;
+    return b[0] | b[1]<<8 | b[2]<<16 | uint32_t(b[3])<<24;
+}
+
+unsigned WavLayout::frameSize() const {
+    switch( encoding ) {
+        case WavEncoding::uint8: return channels;
+        case WavEncoding::int16: return 2*channels;
+        case WavEncoding::int24: return 3*channels;
+        default:
+        case WavEncoding::int32:
+        case WavEncoding::float32: return 4*channels;
+    }
+}
+
+WavLayout ParseWav( const char* first, size_t size ) {
+    const char* last = first+size;
+    if( size<12 || memcmp(first,"RIFF",4)!=0 || memcmp(first+8,"WAVE",4)!=0 )
+        throw ReadError("not a RIFF WAVE file");
+    const char* fmt = NULL;
+    size_t fmtSize = 0;
+    const char* data = NULL;
+    size_t dataSize = 0;
+    for( const char* p = first+12; last-p>=8 && !(fmt && data); ) {
+        size_t n = Get32(p+4);
+        const char* body = p+8;
+        // Writers that stream sometimes leave the size of the last chunk unpatched, so clip it to the file.
+        n = Min( n, size_t(last-body) );
+        if( memcmp(p,"fmt ",4)==0 ) {
+            fmt = body;
+            fmtSize = n;
+        } else if( memcmp(p,"data",4)==0 ) {
+            data = body;
+            dataSize = n;
+        }
+        // Chunks are padded to an even size.
+        p = body+n+(n&1);
+    }
+    if( !fmt || fmtSize<16 )
+        throw ReadError("WAV file lacks fmt chunk");
+    if( !data )
+        throw ReadError("WAV file lacks data chunk");
+
+    unsigned format = Get16(fmt);
+    if( format==0xFFFE ) {
+        // WAVE_FORMAT_EXTENSIBLE.  The first two bytes of the subformat GUID are the format code.
+        if( fmtSize<40 )
+            throw ReadError("WAV extensible fmt chunk too short");
+        format = Get16(fmt+24);
+    }
+    WavLayout w;
+    w.channels = Get16(fmt+2);
+    w.sampleRate = Get32(fmt+4);
+    unsigned blockAlign = Get16(fmt+12);
+    if( w.channels<1 || w.channels>2 )
+        throw ReadError("WAV file must be mono or stereo");
+    if( w.sampleRate==0 )
+        throw ReadError("WAV file has zero sample rate");
+    // Use the container size, not bitsPerSample, since samples are left-justified within their container.
+    unsigned bytes = blockAlign/w.channels;
+    if( bytes*w.channels!=blockAlign )
+        throw ReadError("WAV block alignment inconsistent with channel count");
+    if( format==1 ) {
+        switch( bytes ) {
+            case 1: w.encoding = WavEncoding::uint8; break;
+            case 2: w.encoding = WavEncoding::int16; break;
+            case 3: w.encoding = WavEncoding::int24; break;
+            case 4: w.encoding = WavEncoding::int32; break;
+            default: throw ReadError("unsupported WAV integer sample size");
+        }
+    } else if( format==3 ) {
+        if( bytes!=4 )
+            throw ReadError("unsupported WAV float sample size");
+        w.encoding = WavEncoding::float32;
+    } else {
+        throw ReadError("unsupported WAV format (compressed?)");
+    }
+    w.data = data;
+    w.frames = dataSize/blockAlign;
+    return w;
+}
+
+//! Convert n mono 16-bit samples.
+static void ConvertInt16Mono( float* dst, const char* src, size_t n ) {
+    const __m128 scale = _mm_set1_ps(1.0f/(1<<15));
+    size_t k = 0;
+    for( ; k+8<=n; k+=8 ) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src+2*k));
+        // Sign-extend by unpacking into the upper halves and shifting down.
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x,x),16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x,x),16);
+        _mm_storeu_ps( dst+k, _mm_mul_ps(_mm_cvtepi32_ps(lo),scale) );
+        _mm_storeu_ps( dst+k+4, _mm_mul_ps(_mm_cvtepi32_ps(hi),scale) );
+    }
+    for( ; k<n; ++k )
+        dst[k] = int16_t(Get16(src+2*k))*(1.0f/(1<<15));
+}
+
+//! Convert n stereo 16-bit frames, averaging the channels.
+static void ConvertInt16Stereo( float* dst, const char* src, size_t n ) {
+    const __m128 scale = _mm_set1_ps(1.0f/(1<<16));
+    const __m128i ones = _mm_set1_epi16(1);
+    size_t k = 0;
+    for( ; k+4<=n; k+=4 ) {
+        // Multiply-add against ones sums each left/right pair into a 32-bit integer.
+        __m128i x = _mm_loadu_si128((const __m128i*)(src+4*k));
+        _mm_storeu_ps( dst+k, _mm_mul_ps(_mm_cvtepi32_ps(_mm_madd_epi16(x,ones)),scale) );
+    }
+    for( ; k<n; ++k )
+        dst[k] = (int16_t(Get16(src+4*k))+int16_t(Get16(src+4*k+2)))*(1.0f/(1<<16));
+}
+
+//! Convert n stereo float frames, averaging the channels.
+static void ConvertFloatStereo( float* dst, const char* src, size_t n ) {
+    const __m128 half = _mm_set1_ps(0.5f);
+    size_t k = 0;
+    for( ; k+4<=n; k+=4 ) {
+        __m128 a = _mm_loadu_ps((const float*)(src+8*k));
+        __m128 b = _mm_loadu_ps((const float*)(src+8*k+16));
+        __m128 left = _mm_shuffle_ps(a,b,_MM_SHUFFLE(2,0,2,0));
+        __m128 right = _mm_shuffle_ps(a,b,_MM_SHUFFLE(3,1,3,1));
+        _mm_storeu_ps( dst+k, _mm_mul_ps(_mm_add_ps(left,right),half) );
+    }
+    for( ; k<n; ++k ) {
+        float s[2];
+        memcpy( s, src+8*k, 8 );
+        dst[k] = (s[0]+s[1])*0.5f;
+    }
+}
+
+//! Return sample i of w, scaled to [-1,1).  Used for the less common encodings.
+static float GetSample( const WavLayout& w, size_t i ) {
+    switch( w.encoding ) {
+        case WavEncoding::uint8:
+            return (byte(w.data[i])-128)*(1.0f/(1<<7));
+        case WavEncoding::int16:
+            return int16_t(Get16(w.data+2*i))*(1.0f/(1<<15));
+        case WavEncoding::int24: {
+            const byte* b = (const byte*)w.data+3*i;
+            // Assemble in upper 24 bits so that the shift sign-extends.
+            return (int32_t(uint32_t(b[0])<<8 | uint32_t(b[1])<<16 | uint32_t(b[2])<<24)>>8)*(1.0f/(1<<23));
+        }
+        case WavEncoding::int32:
+            return int32_t(Get32(w.data+4*i))*(1.0f/(1u<<31));
+        default:
+        case WavEncoding::float32: {
+            float s;
+            memcpy( &s, w.data+4*i, 4 );
+            return s;
+        }
+    }
+}
+
+void ConvertWavToMono( float* dst, const WavLayout& w, size_t n ) {
+    Assert( n<=w.frames );
+    if( w.encoding==WavEncoding::int16 ) {
+        if( w.channels==1 )
+            ConvertInt16Mono( dst, w.data, n );
+        else
+            ConvertInt16Stereo( dst, w.data, n );
+    } else if( w.encoding==WavEncoding::float32 ) {
+        if( w.channels==1 )
+            memcpy( dst, w.data, n*sizeof(float) );
+        else
+            ConvertFloatStereo( dst, w.data, n );
+    } else if( w.channels==1 ) {
+        for( size_t k=0; k<n; ++k )
+            dst[k] = GetSample(w,k);
+    } else {
+        for( size_t k=0; k<n; ++k )
+            dst[k] = (GetSample(w,2*k)+GetSample(w,2*k+1))*0.5f;
+    }
+}
+
+} // namespace Synthesizer
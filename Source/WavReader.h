@@ -0,0 +1,43 @@
+/******************************************************************************
+ Parsing and conversion of WAV file images
+*******************************************************************************/
+
+#ifndef WavReader_H
+#define WavReader_H
+
+#include <cstddef>
+
+namespace Synthesizer {
+
+//! Encoding of samples in a WAV file.
+enum class WavEncoding {
+    uint8,      //!< Unsigned 8-bit integer
+    int16,
+    int24,
+    int32,
+    float32
+};
+
+//! Location and format of the sample data in a WAV file image.
+struct WavLayout {
+    const char* data;           //!< First byte of the interleaved sample data
+    size_t frames;              //!< Number of samples per channel
+    unsigned channels;          //!< 1 or 2
+    unsigned sampleRate;        //!< Samples per second per channel
+    WavEncoding encoding;
+    //! Bytes per frame
+    unsigned frameSize() const;
+};
+
+//! Find the sample data in a WAV file image [first,first+size).
+/** Walks the RIFF chunk list, skipping chunks other than "fmt " and "data" (e.g. "LIST" and "fact").
+    Throws ReadError if the image is malformed or its format is not supported. */
+WavLayout ParseWav( const char* first, size_t size );
+
+//! Set dst[0:n] to frames [0:n) of w mixed down to mono, scaled to [-1,1).
+/** The 16-bit and float encodings, which are by far the most common, are converted with SSE. */
+void ConvertWavToMono( float* dst, const WavLayout& w, size_t n );
+
+} // namespace Synthesizer
+
+#endif /* WavReader_H */
@@ -0,0 +1,205 @@
+#include "WavWriter.h"
+#include "AssertLib.h"
+#include "Waveform.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace Synthesizer {
+
+//! Header of a WAV file with a single "fmt " chunk followed by a "data" chunk.
+struct WavFileHeader {
+    // Each declaration is 4 bytes
+    char chunkId[4];
+    uint32_t chunkSize;
+    char format[4];
+    char subchunk1Id[4];
+    uint32_t subchunk1Size;
+    uint16_t audioFormat, numChannels;
+    uint32_t sampleRate;
+    uint32_t byteRate;
+    uint16_t blockAlign, bitsPerSample;
+    char subchunk2Id[4];
+    uint32_t subchunk2Size;
+};
+
+static unsigned BytesPerSample( WavFormat format ) {
+    switch( format ) {
+        case WavFormat::int16: return 2;
+        case WavFormat::int24: return 3;
+        default:
+        case WavFormat::float32: return 4;
+    }
+}
+
+WavWriter::WavWriter( const char* filename, WavFormat format, bool dither, float normalizePeak ) :
+    myFilename(filename),
+    myFormat(format),
+    myDither(dither),
+    myError(false),
+    myNormalizePeak(normalizePeak),
+    myPeak(0),
+    mySize(0),
+    myRandom(0x9E3779B9)
+{
+    Assert( sizeof(WavFileHeader)==44 );
+    if( myNormalizePeak>0 ) {
+        // Spool raw interleaved floats.  The WAV file is written by close.
+        openSpool();
+    } else {
+        myFile = fopen(filename,"wb");
+        // Sizes are patched by close.
+        if( myFile && !writeHeader(myFile,0) )
+            myError = true;
+    }
+}
+
+void WavWriter::openSpool() {
+    myFile = NULL;
+    // Never reuse the name of an existing file, since close removes the spool file.
+    for( unsigned k=0; k<1000; ++k ) {
+        char suffix[16];
+        sprintf( suffix, ".%u.tmp", k );
+        std::string name = myFilename+suffix;
+        if( FILE* f = fopen(name.c_str(),"rb") ) {
+            fclose(f);
+            continue;
+        }
+        myFile = fopen(name.c_str(),"wb");
+        if( myFile )
+            mySpoolName = name;
+        return;
+    }
+}
+
+WavWriter::~WavWriter() {
+    close();
+}
+
+bool WavWriter::writeHeader( FILE* f, size_t frames ) const {
+    const unsigned bytes = BytesPerSample(myFormat);
+    WavFileHeader w;
+    std::memset(&w,0,sizeof(w));
+    memcpy( w.chunkId, "RIFF", 4 );
+    memcpy( w.format, "WAVE", 4 );
+    memcpy( w.subchunk1Id, "fmt ", 4 );
+    w.subchunk1Size = 16;
+    w.audioFormat = myFormat==WavFormat::float32 ? 3 : 1;     // IEEE float or PCM
+    w.numChannels = 2;
+    w.sampleRate = SampleRate;
+    w.bitsPerSample = 8*bytes;
+    w.blockAlign = w.numChannels * bytes;
+    w.byteRate = w.sampleRate * w.blockAlign;
+    memcpy( w.subchunk2Id, "data", 4 );
+    // Sizes saturate if the file exceeds what RIFF can describe.
+    const size_t maxData = 0xFFFFFFFFu-(sizeof(w)-8);
+    size_t data = Min( maxData/w.blockAlign, frames )*w.blockAlign;
+    w.subchunk2Size = uint32_t(data);
+    w.chunkSize = uint32_t(data+sizeof(w)-8);
+    return fwrite(&w,sizeof(w),1,f)==1;
+}
+
+float WavWriter::random() {
+    // Xorshift generator.  Far better than needed for dither, and cheaper than rand().
+    myRandom ^= myRandom<<13;
+    myRandom ^= myRandom>>17;
+    myRandom ^= myRandom<<5;
+    return (myRandom>>8)*(1.0f/(1<<24));
+}
+
+bool WavWriter::writeFrames( FILE* f, const float* src, unsigned n, float gain ) {
+    Assert( n<=bufferFrames );
+    const unsigned m = 2*n;
+    if( myFormat==WavFormat::float32 ) {
+        float* dst = (float*)myBuffer;
+        for( unsigned k=0; k<m; ++k )
+            dst[k] = src[k]*gain;
+    } else {
+        const bool wide = myFormat==WavFormat::int24;
+        const float scale = wide ? float((1<<23)-1) : float((1<<15)-1);
+        for( unsigned k=0; k<m; ++k ) {
+            float a = src[k]*gain*scale;
+            if( myDither )
+                // Difference of two uniform variates has triangular distribution over [-1,1] LSB.
+                a += random()-random();
+            int i = int(std::floor(Clip(-scale,scale,a)+0.5f));
+            if( wide ) {
+                char* d = myBuffer+3*k;
+                d[0] = char(i);
+                d[1] = char(i>>8);
+                d[2] = char(i>>16);
+            } else {
+                ((int16_t*)myBuffer)[k] = int16_t(i);
+            }
+        }
+    }
+    const unsigned bytes = BytesPerSample(myFormat);
+    return fwrite(myBuffer,bytes*m,1,f)==1;
+}
+
+void WavWriter::write( const float* left, const float* right, unsigned n ) {
+    if( !myFile )
+        return;
+    mySize += n;
+    while( n>0 ) {
+        unsigned m = Min(n,bufferFrames);
+        float p = myPeak;
+        for( unsigned k=0; k<m; ++k ) {
+            myFrames[2*k] = left[k];
+            myFrames[2*k+1] = right[k];
+            p = Max(p,Max(std::fabs(left[k]),std::fabs(right[k])));
+        }
+        myPeak = p;
+        bool okay;
+        if( myNormalizePeak>0 )
+            okay = fwrite(myFrames,sizeof(float)*2*m,1,myFile)==1;
+        else
+            okay = writeFrames(myFile,myFrames,m,1.0f);
+        if( !okay )
+            myError = true;
+        left += m;
+        right += m;
+        n -= m;
+    }
+}
+
+bool WavWriter::close() {
+    if( !myFile )
+        return false;
+    if( myNormalizePeak>0 ) {
+        // Second pass: re-read the spooled samples and write them rescaled.
+        if( fclose(myFile)!=0 )
+            myError = true;
+        myFile = NULL;
+        FILE* in = fopen(mySpoolName.c_str(),"rb");
+        FILE* out = fopen(myFilename.c_str(),"wb");
+        if( in && out && writeHeader(out,mySize) ) {
+            const float gain = myPeak>0 ? myNormalizePeak/myPeak : 1.0f;
+            for( size_t i=0; i<mySize; ) {
+                unsigned m = unsigned(Min(mySize-i,size_t(bufferFrames)));
+                if( fread(myFrames,sizeof(float)*2*m,1,in)!=1 || !writeFrames(out,myFrames,m,gain) ) {
+                    myError = true;
+                    break;
+                }
+                i += m;
+            }
+        } else {
+            myError = true;
+        }
+        if( in )
+            fclose(in);
+        if( out && fclose(out)!=0 )
+            myError = true;
+        remove(mySpoolName.c_str());
+    } else {
+        // Patch the sizes in the header.
+        if( fseek(myFile,0,SEEK_SET)!=0 || !writeHeader(myFile,mySize) )
+            myError = true;
+        if( fclose(myFile)!=0 )
+            myError = true;
+        myFile = NULL;
+    }
+    return !myError;
+}
+
+} // namespace Synthesizer
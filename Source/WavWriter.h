@@ -0,0 +1,75 @@
+/******************************************************************************
+ Streaming output of stereo WAV files
+*******************************************************************************/
+
+#ifndef WavWriter_H
+#define WavWriter_H
+
+#include <cstdio>
+#include <string>
+#include "Utility.h"
+#include "RenderSink.h"
+
+namespace Synthesizer {
+
+//! Sample format of a file written by WavWriter.
+enum class WavFormat {
+    int16,
+    int24,
+    float32
+};
+
+//! Writes a stereo WAV file block by block, so that memory usage does not grow with the length of the file.
+/** The header is written when the file is opened, and its sizes are patched by close.
+    Assumes a little-endian host, as does Waveform::writeToFile. */
+class WavWriter: public Midi::RenderSink, NoCopy {
+public:
+    //! Open filename for writing.  Use isOpen to check for success.
+    /** If dither is true, the integer formats get triangular (TPDF) dither of one LSB.
+        If normalizePeak>0, samples are spooled to a temporary file and rescaled by close so that
+        the largest magnitude becomes normalizePeak.  The integer formats clip samples to [-1,1]. */
+    WavWriter( const char* filename, WavFormat format, bool dither=true, float normalizePeak=0 );
+    //! Calls close.
+    ~WavWriter();
+    bool isOpen() const {return myFile!=NULL;}
+    //! Append n samples to each channel.
+    /*override*/ void write( const float* left, const float* right, unsigned n );
+    //! Finish writing the file.  Returns false if the file could not be opened, was already closed, or an I/O error occurred.
+    bool close();
+    //! Largest magnitude passed to write so far.
+    float peak() const {return myPeak;}
+    //! Number of samples per channel passed to write so far.
+    size_t size() const {return mySize;}
+private:
+    //! Frames converted per call to fwrite.
+    static const unsigned bufferFrames = 1024;
+    std::string myFilename;
+    //! The WAV file, or the spool file if normalizing.
+    FILE* myFile;
+    WavFormat myFormat;
+    bool myDither;
+    bool myError;
+    float myNormalizePeak;
+    float myPeak;
+    size_t mySize;
+    //! State of random number generator for dither.
+    uint32_t myRandom;
+    //! Interleaved frames, before conversion.
+    float myFrames[bufferFrames*2];
+    //! Converted frames.  Large enough for bufferFrames frames of the widest format.
+    char myBuffer[bufferFrames*2*4];
+    //! Name of spool file if normalizing, otherwise empty.
+    std::string mySpoolName;
+    //! Set mySpoolName to a name near myFilename that no file has, and open that file in myFile.
+    void openSpool();
+    //! Write WAV header for myFormat to f, for a data chunk with the given number of frames.
+    bool writeHeader( FILE* f, size_t frames ) const;
+    //! Convert n interleaved frames of src, scaled by gain, to myFormat in myBuffer, and append them to f.
+    bool writeFrames( FILE* f, const float* src, unsigned n, float gain );
+    //! Uniform random number in [0,1)
+    float random();
+};
+
+} // namespace Synthesizer
+
+#endif /* WavWriter_H */
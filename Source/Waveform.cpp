@@ -3,9 +3,149 @@
 #include "Utility.h"
 #include <cstring>
 #include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include "WavReader.h"
+#include "MappedFile.h"
+#include "ReadError.h"
 
 namespace Synthesizer {
 
+//-----------------------------------------------------------
+// SincInterpolation
+//-----------------------------------------------------------
+
+float SincInterpolation::table[1<<SincInterpolation::phaseBits][SincInterpolation::taps];
+
+//! Builds SincInterpolation::table during static initialization.
+struct SincTableBuilder {
+    SincTableBuilder() {
+        const double pi = 3.14159265358979323846;
+        const int n = SincInterpolation::taps;
+        for( int p=0; p<1<<SincInterpolation::phaseBits; ++p ) {
+            double f = double(p)/(1<<SincInterpolation::phaseBits);
+            double w[n];
+            double sum = 0;
+            for( int k=0; k<n; ++k ) {
+                // Distance of tap from the interpolated position
+                double x = k-SincInterpolation::reachBefore-f;
+                double sinc = x==0 ? 1 : sin(pi*x)/(pi*x);
+                // Blackman window spanning the taps
+                double blackman = 0.42+0.5*cos(pi*x/(n/2))+0.08*cos(2*pi*x/(n/2));
+                sum += w[k] = sinc*blackman;
+            }
+            // Normalize so that a constant signal passes through unchanged.
+            for( int k=0; k<n; ++k )
+                SincInterpolation::table[p][k] = float(w[k]/sum);
+        }
+    }
+};
+
+static SincTableBuilder TheSincTableBuilder;
+
+//-----------------------------------------------------------
+// Waveform mip levels
+//-----------------------------------------------------------
+
+//! Half of a half-band lowpass filter, from the center tap outwards.  Odd taps beyond the center are zero.
+static const int DecimatorReach = 15;
+static float DecimatorTaps[DecimatorReach+1];
+
+//! Builds DecimatorTaps during static initialization.
+static struct DecimatorBuilder {
+    DecimatorBuilder() {
+        const double pi = 3.14159265358979323846;
+        double h[DecimatorReach+1];
+        double sum = 0;
+        for( int k=0; k<=DecimatorReach; ++k ) {
+            // Windowed sinc with cutoff at half the Nyquist frequency
+            double x = 0.5*k;
+            double sinc = k==0 ? 1 : sin(pi*x)/(pi*x);
+            double blackman = 0.42+0.5*cos(pi*k/(DecimatorReach+1))+0.08*cos(2*pi*k/(DecimatorReach+1));
+            h[k] = sinc*blackman;
+            sum += k==0 ? h[k] : 2*h[k];
+        }
+        for( int k=0; k<=DecimatorReach; ++k )
+            DecimatorTaps[k] = float(h[k]/sum);
+    }
+} TheDecimatorBuilder;
+
+template<typename T>
+void BasicWaveform<T>::decimate( const BasicWaveform& src ) {
+    const size_t n = src.size();
+    const T* x = src.begin();
+    bool cyclic = src.isCyclic();
+    // Sample of src at index i, treating src as periodic or as tailed by zeros.
+    auto at = [&]( ptrdiff_t i ) -> float {
+        if( cyclic ) 
+            return SampleToFloat(x[(i%ptrdiff_t(n)+n)%n]);
+        return 0<=i && size_t(i)<n ? SampleToFloat(x[i]) : 0.0f;
+    };
+    resize( (n+1)/2 );
+    for( size_t j=0; j<size(); ++j ) {
+        ptrdiff_t i = 2*j;
+        float y = DecimatorTaps[0]*at(i);
+        for( int k=1; k<=DecimatorReach; k+=2 ) 
+            y += DecimatorTaps[k]*(at(i-k)+at(i+k));
+        begin()[j] = FloatToSample<T>(y);
+    }
+    complete( cyclic );
+}
+
+template<typename T>
+void BasicWaveform<T>::buildMipLevels( unsigned maxLevel ) {
+    Assert( isCompleted() );
+    // Levels shorter than this are not worth having.
+    const size_t minSize = 16;
+    BasicWaveform* w = this;
+    unsigned k = 1;
+    for( ; w->myCoarser; ++k )
+        w = w->myCoarser;
+    for( ; k<=maxLevel && w->size()>=2*minSize && !(w->isCyclic() && w->size()%2!=0); ++k ) {
+        std::unique_ptr<BasicWaveform> c(new BasicWaveform);
+        c->decimate(*w);
+        w->myCoarser = c.release();
+        w = w->myCoarser;
+    }
+}
+
+template<typename T>
+void BasicWaveform<T>::clearMipLevels() {
+    // Iterative, so that a long chain does not recurse deeply.
+    BasicWaveform* w = myCoarser;
+    myCoarser = NULL;
+    while( w ) {
+        BasicWaveform* next = w->myCoarser;
+        w->myCoarser = NULL;
+        delete w;
+        w = next;
+    }
+}
+
+template<typename T>
+void BasicWaveform<T>::appendMipLevelView( const T* first, size_t n ) {
+    Assert( isCompleted() && !isCyclic() );
+    BasicWaveform* w = this;
+    while( w->myCoarser )
+        w = w->myCoarser;
+    w->myCoarser = new BasicWaveform;
+    w->myCoarser->view( first, n );
+}
+
+template<typename T>
+auto BasicWaveform<T>::mipLevelFor( timeType& delta, unsigned& level ) const -> const BasicWaveform& {
+    const BasicWaveform* w = this;
+    level = 0;
+    while( delta>unitTime && w->myCoarser ) {
+        // Halve the step, rounding to nearest.
+        delta = (delta+1)>>1;
+        w = w->myCoarser;
+        ++level;
+    }
+    return *w;
+}
+
 //-----------------------------------------------------------
 // Waveform
 //-----------------------------------------------------------
@@ -26,87 +166,76 @@ struct WavHeader {
     uint32_t sampleRate;
     uint32_t byteRate;
     uint16_t blockAlign, bitsPerSample;
-    void check();
 };
 
-void WavHeader::check() {
-    Assert( memcmp(chunkId,"RIFF",4)==0 );
-    Assert( memcmp(format,"WAVE",4)==0 );
-    Assert( memcmp(subchunk1Id,"fmt ",4)==0 );
-    Assert( subchunk1Size==16 );
-    Assert( audioFormat==1 );  // PCM/uncompressed
-    Assert( sampleRate==44100 );
-    Assert( bitsPerSample==16 );
-}
-
 struct WavData {
     char subchunk2Id[4];
     uint32_t subchunk2Size;
-    void check();
 };
 
-void WavData::check() {
-    Assert( memcmp(subchunk2Id,"data",4)==0 );
-    Assert( subchunk2Size%2==0 );
-}
-
-class Waveform::inputType {
-    FILE* myFile;
-    const char* myData;
-    const char* myEnd;
-public:
-    inputType( const char* data, size_t n ) : myFile(NULL), myData(data), myEnd(data+n) {}
-    inputType( FILE* f ) : myFile(f), myData(NULL), myEnd(NULL) {}
-    void read( void* dst, size_t n );
-};
-
-void Waveform::inputType::read( void* dst, size_t n ) {
-    if( myData ) {
-        Assert( n <= size_t(myEnd-myData) );
-        memcpy( dst, myData, n );
-        myData += n;
-    } else {
-        size_t m = fread(dst,n,1,myFile);
-        Assert(m==1);
+//! Set dst to src[0:n] resampled by windowed-sinc interpolation, reading ratio input samples per output sample.
+/** Positions are tracked in 64 bits across blocks, so that long inputs are not limited by timeType. */
+static void ResampleSinc( Waveform& dst, const float* src, size_t n, double ratio ) {
+    typedef SincInterpolation interp;
+    const int shift = 16;
+    // Pad with zeros so that every tap lies inside the buffer.
+    const size_t before = interp::reachBefore;
+    const size_t after = interp::reachAfter+1;
+    SimpleArray<float> padded(before+n+after);
+    std::fill_n( padded.begin(), before, 0.0f );
+    std::copy( src, src+n, padded.begin()+before );
+    std::fill_n( padded.begin()+before+n, after, 0.0f );
+    size_t m = size_t(std::ceil(n/ratio));
+    dst.resize(m);
+    const unsigned dt = unsigned(ratio*(1<<shift)+0.5);
+    // Short blocks keep the rounding error in dt from accumulating.
+    const size_t blockSize = 1024;
+    for( size_t k=0; k<m; k+=blockSize ) {
+        double pos = k*ratio;
+        size_t i = size_t(pos);
+        unsigned t = unsigned((pos-i)*(1<<shift));
+        interp::run<shift>( dst.begin()+k, padded.begin()+before+i, t, dt, Min(blockSize,m-k) );
     }
 }
 
-void Waveform::readFromMemory( const char* data, size_t n ) {
-    inputType in(data,n);
-    readFromInput(in);
-}
-
-void Waveform::readFromFile( const char* filename ) {
-    FILE* f = fopen(filename,"rb");
-    Assert(f);						// FIXME - recover from missing file
-    inputType in(f);
-    readFromInput(in); 
-    fclose(f);
-}
-
-void Waveform::readFromInput( inputType& f ) {
-    WavHeader w;
-    Assert( sizeof(w)==36 );
-    f.read(&w,36);
-    w.check();
-    // FIXME - skip subchunk1Size-16 bytes
-#if 0
-    Assert( w.extraParamSize==0 );
-#endif
-    WavData d;
-    f.read(&d,8);
-    d.check();
-    size_t n = d.subchunk2Size/2;
-    SimpleArray<int16_t> tmp;
-    tmp.resize(n);
-    f.read(tmp.begin(),sizeof(int16_t)*n);
-    resize(n);
-    for( size_t i=0; i<n; ++i ) {
-        (*this)[i] = tmp[i]*(1.f/(1<<15));
+template<>
+unsigned Waveform::readFromMemory( const char* data, size_t n, bool toEngineRate ) {
+    WavLayout w = ParseWav(data,n);
+    clearMipLevels();
+    if( !toEngineRate || w.sampleRate==SampleRate ) {
+        // Convert straight into the waveform.
+        resize(w.frames);
+        ConvertWavToMono( begin(), w, w.frames );
+        complete(false);
+        return w.sampleRate;
+    }
+    Waveform tmp(w.frames);
+    ConvertWavToMono( tmp.begin(), w, w.frames );
+    tmp.complete(false);
+    double rate = w.sampleRate;
+    // Halve the rate with the mip-level decimator while possible, because it is properly band-limited 
+    // and the interpolator is not.
+    while( rate>=2*SampleRate ) {
+        Waveform half;
+        half.decimate(tmp);
+        tmp.assign(half.begin(),half.size());
+        tmp.complete(false);
+        rate *= 0.5;
     }
+    ResampleSinc( *this, tmp.begin(), tmp.size(), rate/SampleRate );
     complete(false);
+    return SampleRate;
 }
 
+template<>
+unsigned Waveform::readFromFile( const char* filename, bool toEngineRate ) {
+    MappedFile f(filename);
+    if( !f.isOpen() )
+        throw ReadError(std::string("cannot open ")+filename);
+    return readFromMemory( f.begin(), f.size(), toEngineRate );
+}
+
+template<>
 void Waveform::writeToFile( const char* filename ) {
     size_t n = size();
     FILE* f = fopen(filename,"wb");
@@ -144,4 +273,7 @@ void Waveform::writeToFile( const char* filename ) {
     fclose(f);
 }
 
+template class BasicWaveform<float>;
+template class BasicWaveform<int16_t>;
+
 } // namespace Synthesizer
\ No newline at end of file
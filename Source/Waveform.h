@@ -2,11 +2,207 @@
 #define Waveform_H
 
 #include "Utility.h"
+#include <cstring>
+#include <emmintrin.h>
+#include <xmmintrin.h>
 
 namespace Synthesizer {
 
 static const size_t SampleRate = 44100;
 
+//-----------------------------------------------------------
+// Sample types
+//
+// Signals store samples as float, or as int16_t in units of 2^-15, which halves memory and 
+// bandwidth for recorded sounds.  Both are converted to float when interpolated.
+//-----------------------------------------------------------
+
+inline float SampleToFloat( float x ) {return x;}
+inline float SampleToFloat( int16_t x ) {return x*(1.0f/(1<<15));}
+
+//! Inverse of SampleToFloat.  Rounds and clips as necessary.
+template<typename T> T FloatToSample( float x );
+template<> inline float FloatToSample<float>( float x ) {return x;}
+template<> inline int16_t FloatToSample<int16_t>( float x ) {
+    return int16_t(Round(Clip(-32768.0f,32767.0f,x*(1<<15))));
+}
+
+//! Load p[0:4] as floats.
+inline __m128 LoadSamples4( const float* p ) {
+    return _mm_loadu_ps(p);
+}
+
+inline __m128 LoadSamples4( const int16_t* p ) {
+    __m128i x = _mm_loadl_epi64((const __m128i*)p);
+    // Sign-extend by unpacking into the upper halves and shifting down.
+    return _mm_mul_ps( _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x,x),16)), _mm_set1_ps(1.0f/(1<<15)) );
+}
+
+//! Load p[0:2] as floats into the low half.  The high half is garbage.
+inline __m128 LoadSamples2( const float* p ) {
+    return _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)p));
+}
+
+inline __m128 LoadSamples2( const int16_t* p ) {
+    int32_t pair;
+    memcpy( &pair, p, sizeof(pair) );
+    __m128i x = _mm_cvtsi32_si128(pair);
+    return _mm_mul_ps( _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x,x),16)), _mm_set1_ps(1.0f/(1<<15)) );
+}
+
+//-----------------------------------------------------------
+// Interpolation policies for SampledSignalBase::resample
+//
+// Each policy computes a sample at fractional position i+frac/2^Shift from the taps
+// s[i-reachBefore..i+reachAfter].  Method combine does one sample with scalar code.
+// Method run does n samples, four at a time with SSE, when all taps are inside the 
+// signal.  Both must do the same arithmetic in the same order.  Both accept float or
+// int16_t samples.
+//-----------------------------------------------------------
+
+//! Policy for 2-point linear interpolation.  Cheapest, but dulls and aliases high frequencies.
+struct LinearInterpolation {
+    static const int reachBefore = 0;
+    static const int reachAfter = 1;
+    template<int Shift, typename T>
+    static float combine( const T* s, unsigned frac ) {
+        float f = frac*(1.0f/(1<<Shift));
+        float s0 = SampleToFloat(s[0]), s1 = SampleToFloat(s[1]);
+        return s0+(s1-s0)*f;
+    }
+    template<int Shift, typename T>
+    static unsigned run( float* output, const T* w, unsigned t, unsigned dt, size_t n );
+};
+
+template<int Shift, typename T>
+unsigned LinearInterpolation::run( float* output, const T* w, unsigned t, unsigned dt, size_t n ) {
+    const __m128i fractionMask = _mm_set1_epi32((1<<Shift)-1);
+    const __m128 scale = _mm_set1_ps(1.0f/(1<<Shift));
+    __m128i vt = _mm_setr_epi32(t, t+dt, t+2*dt, t+3*dt);
+    const __m128i vdt = _mm_set1_epi32(4*dt);
+    for( ; n>=4; n-=4, t+=4*dt, output+=4 ) {
+        unsigned j[4];
+        _mm_storeu_si128((__m128i*)j, _mm_srli_epi32(vt,Shift));
+        // Load each pair of taps with one load, then separate the pairs.
+        __m128 p0 = LoadSamples2(w+j[0]);
+        __m128 p1 = LoadSamples2(w+j[1]);
+        __m128 p2 = LoadSamples2(w+j[2]);
+        __m128 p3 = LoadSamples2(w+j[3]);
+        __m128 lo = _mm_unpacklo_ps(p0,p1);
+        __m128 hi = _mm_unpacklo_ps(p2,p3);
+        __m128 s0 = _mm_movelh_ps(lo,hi);
+        __m128 s1 = _mm_movehl_ps(hi,lo);
+        __m128 f = _mm_mul_ps( _mm_cvtepi32_ps(_mm_and_si128(vt,fractionMask)), scale );
+        _mm_storeu_ps( output, _mm_add_ps(s0, _mm_mul_ps(_mm_sub_ps(s1,s0), f)) );
+        vt = _mm_add_epi32(vt,vdt);
+    }
+    for( ; n>0; --n, t+=dt ) 
+        *output++ = combine<Shift>( w+(t>>Shift), t&((1<<Shift)-1) );
+    return t;
+}
+
+//! Policy for 4-point, 3rd-order Hermite (Catmull-Rom) interpolation.  
+/** About twice the cost of linear, with much less high-frequency loss. */
+struct HermiteInterpolation {
+    static const int reachBefore = 1;
+    static const int reachAfter = 2;
+    template<int Shift, typename T>
+    static float combine( const T* x, unsigned frac ) {
+        float f = frac*(1.0f/(1<<Shift));
+        float s[4] = {SampleToFloat(x[0]), SampleToFloat(x[1]), SampleToFloat(x[2]), SampleToFloat(x[3])};
+        float c1 = 0.5f*(s[2]-s[0]);
+        float c2 = (s[0]-2.5f*s[1]) + (2.0f*s[2]-0.5f*s[3]);
+        float c3 = 0.5f*(s[3]-s[0]) + 1.5f*(s[1]-s[2]);
+        return ((c3*f+c2)*f+c1)*f+s[1];
+    }
+    template<int Shift, typename T>
+    static unsigned run( float* output, const T* w, unsigned t, unsigned dt, size_t n );
+};
+
+template<int Shift, typename T>
+unsigned HermiteInterpolation::run( float* output, const T* w, unsigned t, unsigned dt, size_t n ) {
+    const __m128i fractionMask = _mm_set1_epi32((1<<Shift)-1);
+    const __m128 scale = _mm_set1_ps(1.0f/(1<<Shift));
+    const __m128 half = _mm_set1_ps(0.5f), oneHalf = _mm_set1_ps(1.5f), two = _mm_set1_ps(2.0f), twoHalf = _mm_set1_ps(2.5f);
+    __m128i vt = _mm_setr_epi32(t, t+dt, t+2*dt, t+3*dt);
+    const __m128i vdt = _mm_set1_epi32(4*dt);
+    for( ; n>=4; n-=4, t+=4*dt, output+=4 ) {
+        unsigned j[4];
+        _mm_storeu_si128((__m128i*)j, _mm_srli_epi32(vt,Shift));
+        // Load the four taps of each output, then transpose so that sk holds tap k of each output.
+        __m128 s0 = LoadSamples4(w+j[0]-1);
+        __m128 s1 = LoadSamples4(w+j[1]-1);
+        __m128 s2 = LoadSamples4(w+j[2]-1);
+        __m128 s3 = LoadSamples4(w+j[3]-1);
+        _MM_TRANSPOSE4_PS(s0,s1,s2,s3);
+        __m128 f = _mm_mul_ps( _mm_cvtepi32_ps(_mm_and_si128(vt,fractionMask)), scale );
+        __m128 c1 = _mm_mul_ps(half,_mm_sub_ps(s2,s0));
+        __m128 c2 = _mm_add_ps(_mm_sub_ps(s0,_mm_mul_ps(twoHalf,s1)), _mm_sub_ps(_mm_mul_ps(two,s2),_mm_mul_ps(half,s3)));
+        __m128 c3 = _mm_add_ps(_mm_mul_ps(half,_mm_sub_ps(s3,s0)), _mm_mul_ps(oneHalf,_mm_sub_ps(s1,s2)));
+        __m128 y = _mm_add_ps(_mm_mul_ps(c3,f),c2);
+        y = _mm_add_ps(_mm_mul_ps(y,f),c1);
+        y = _mm_add_ps(_mm_mul_ps(y,f),s1);
+        _mm_storeu_ps( output, y );
+        vt = _mm_add_epi32(vt,vdt);
+    }
+    for( ; n>0; --n, t+=dt ) 
+        *output++ = combine<Shift>( w+(t>>Shift)-reachBefore, t&((1<<Shift)-1) );
+    return t;
+}
+
+//! Policy for 8-tap windowed-sinc interpolation.  Best quality when not downsampling, at about four times the cost of linear.
+class SincInterpolation {
+public:
+    static const int reachBefore = 3;
+    static const int reachAfter = 4;
+    static const int taps = reachBefore+reachAfter+1;
+    //! Log2 of number of fractional positions in table.
+    static const int phaseBits = 9;
+    template<int Shift, typename T>
+    static float combine( const T* s, unsigned frac ) {
+        const float* c = table[(frac<<phaseBits)>>Shift];
+        // Same summation order as run.
+        float r0 = SampleToFloat(s[0])*c[0] + SampleToFloat(s[4])*c[4];
+        float r1 = SampleToFloat(s[1])*c[1] + SampleToFloat(s[5])*c[5];
+        float r2 = SampleToFloat(s[2])*c[2] + SampleToFloat(s[6])*c[6];
+        float r3 = SampleToFloat(s[3])*c[3] + SampleToFloat(s[7])*c[7];
+        return (r0+r1)+(r2+r3);
+    }
+    template<int Shift, typename T>
+    static unsigned run( float* output, const T* w, unsigned t, unsigned dt, size_t n );
+private:
+    //! table[p][k] is the weight of tap k at fractional position p/2^phaseBits.  Built by Waveform.cpp.
+    static float table[1<<phaseBits][taps];
+    friend struct SincTableBuilder;
+};
+
+template<int Shift, typename T>
+unsigned SincInterpolation::run( float* output, const T* w, unsigned t, unsigned dt, size_t n ) {
+    const unsigned fractionMask = (1<<Shift)-1;
+    for( ; n>=4; n-=4, output+=4 ) {
+        // Multiply each output's taps by its weights, giving two partial products per output...
+        __m128 p[4];
+        for( unsigned k=0; k<4; ++k, t+=dt ) {
+            const T* s = w+(t>>Shift)-reachBefore;
+            const float* c = table[((t&fractionMask)<<phaseBits)>>Shift];
+            p[k] = _mm_add_ps( _mm_mul_ps(LoadSamples4(s),_mm_loadu_ps(c)), _mm_mul_ps(LoadSamples4(s+4),_mm_loadu_ps(c+4)) );
+        }
+        // ...then transpose and add, so that lane k sums the products of output k.
+        _MM_TRANSPOSE4_PS(p[0],p[1],p[2],p[3]);
+        _mm_storeu_ps( output, _mm_add_ps(_mm_add_ps(p[0],p[1]),_mm_add_ps(p[2],p[3])) );
+    }
+    for( ; n>0; --n, t+=dt ) 
+        *output++ = combine<Shift>( w+(t>>Shift)-reachBefore, t&fractionMask );
+    return t;
+}
+
+//! Run-time choice of interpolation policy.
+enum class Interpolation: char {
+    linear,
+    hermite,
+    sinc
+};
+
 template<typename T, int Shift> 
 class SampledSignalBase: public SimpleArray<T,1> {
     typedef SimpleArray<T,1> base;
@@ -23,38 +219,87 @@ public:
     float interpolate( const T* w, timeType t ) const {
         size_t i = t>>timeShift;
         Assert( w+i<end() );
-        sampleType s0 = w[i];
-        sampleType s1 = w[i+1];
+        float s0 = SampleToFloat(w[i]);
+        float s1 = SampleToFloat(w[i+1]);
         float f = (t & unitTime-1)*(1.0f/unitTime);
         return s0+(s1-s0)*f;
     }
-    // Compute n samples and accumulate them into output. Returns t0+n*dt.
-    timeType resample( T* output, timeType t, timeType dt, size_t n ) const;
+    //! Compute n samples starting at time t, spaced dt apart, and store them into output as floats. Returns t+n*dt.
+    /** Policy Interp is one of LinearInterpolation, HermiteInterpolation, or SincInterpolation.
+        The signal is treated as zero outside [begin(),end()]. */
+    template<typename Interp>
+    timeType resample( float* output, timeType t, timeType dt, size_t n ) const;
+    //! Same as resample<LinearInterpolation>
+    timeType resample( float* output, timeType t, timeType dt, size_t n ) const {
+        return resample<LinearInterpolation>( output, t, dt, n );
+    }
+    //! Pointer to an instance of resample.
+    typedef timeType (SampledSignalBase::*resampleType)( float* output, timeType t, timeType dt, size_t n ) const;
+    //! Instance of resample for given policy.  Lets voices choose a policy without branching per sample.
+    static resampleType resampler( Interpolation kind ) {
+        switch( kind ) {
+            default: Assert(0);
+            case Interpolation::linear: return &SampledSignalBase::resample<LinearInterpolation>;
+            case Interpolation::hermite: return &SampledSignalBase::resample<HermiteInterpolation>;
+            case Interpolation::sinc: return &SampledSignalBase::resample<SincInterpolation>;
+        }
+    }
 };
 
 template<typename T, int Shift>
-auto SampledSignalBase<T,Shift>::resample( T* output, timeType t, timeType dt, size_t n ) const -> timeType {
+template<typename Interp>
+auto SampledSignalBase<T,Shift>::resample( float* output, timeType t, timeType dt, size_t n ) const -> timeType {
     Assert( t < size()<<timeShift );
     Assert( t+(n-1)*dt < size()<<timeShift );
     const T* w = begin();
-    for( ; n>0; t+=dt, --n ) {
-        // FIXME - use FIR filter bank to interpolate more accurately? 
-        size_t i = t>>timeShift;
-        sampleType s0 = w[i];
-        sampleType s1 = w[i+1];
-        float f = (t & unitTime-1)*(1.0f/unitTime);
-        // FIXME - redo algebra to shorten dependence chain or exploit FMA?
-        *output++ = (s0+(s1-s0)*f);
+    // Element w[size()] is valid too.  See SimpleArray's Extra parameter.
+    const size_t valid = size()+1;
+    // Taps outside [0,valid) are taken as zero.  Only a few samples at either end need that, 
+    // so they are done separately, keeping branches out of the fast loop.
+    T taps[Interp::reachBefore+Interp::reachAfter+1];
+    auto edge = [&]() {
+        ptrdiff_t i = ptrdiff_t(t>>timeShift)-Interp::reachBefore;
+        for( int k=0; k<Interp::reachBefore+Interp::reachAfter+1; ++k ) 
+            taps[k] = size_t(i+k)<valid ? w[i+k] : T(0);
+        *output++ = Interp::template combine<Shift>( taps, t & unitTime-1 );
+        t += dt;
+        --n;
+    };
+    while( n>0 && (t>>timeShift)<timeType(Interp::reachBefore) ) 
+        edge();
+    if( n>0 && valid>=size_t(Interp::reachAfter) ) {
+        // Number of samples from t onwards whose last tap is inside the signal.
+        timeType fastEnd = timeType(valid-Interp::reachAfter)<<timeShift;
+        if( t<fastEnd ) {
+            size_t m = Min( n, size_t((fastEnd-t+dt-1)/dt) );
+            t = Interp::template run<Shift>( output, w, t, dt, m );
+            output += m;
+            n -= m;
+        }
     }
+    while( n>0 )
+        edge();
     return t;
 }
 
-class Waveform: public SampledSignalBase<float,12> {
+//! Sampled sound, with optional band-limited mip levels.  
+/** T is float, or int16_t to halve the memory of recorded sounds.  See SampleToFloat.
+    Usually referred to as Waveform or Waveform16. */
+template<typename T>
+class BasicWaveform: public SampledSignalBase<T,12> {
+    typedef SampledSignalBase<T,12> base;
 public:
-    Waveform() : myIsCyclic(2) {}
-    Waveform( size_t n ) : myIsCyclic(2) {resize(n);}
+    using base::size;
+    using base::begin;
+    using base::end;
+    using base::resize;
+    typedef typename base::timeType timeType;
+    using base::unitTime;
 
-    ~Waveform() {}
+    BasicWaveform() : myIsCyclic(2), myCoarser(NULL) {}
+    BasicWaveform( size_t n ) : myIsCyclic(2), myCoarser(NULL) {resize(n);}
+
+    ~BasicWaveform() {clearMipLevels();}
     //! True if waveform is cyclic.
     bool isCyclic() const {
         Assert(isCompleted());
@@ -65,21 +310,71 @@ public:
         *end() = cyclic ? *begin() : 0;
     }
     bool isCompleted() const {return myIsCyclic<2;}
-    //! Read from a ".wav" file
-    void readFromFile( const char* filename );
-    //! Write to a ".wav" file
+    //! Make *this a completed non-cyclic waveform that refers to first[0:n] without copying.
+    /** first[n] must be zero, since it serves as the guard sample that complete would write.
+        The memory is owned by the caller, is never written, and must outlive *this. */
+    void view( const T* first, size_t n ) {
+        Assert( first[n]==0 );
+        clearMipLevels();
+        base::view( const_cast<T*>(first), n );
+        myIsCyclic = 0;
+    }
+    //! Read from a ".wav" file, which is mapped into memory rather than copied.
+    /** Accepts 8, 16, 24 or 32-bit integer and 32-bit float samples, mono or stereo, at any sample rate.
+        Stereo is mixed down to mono.  If toEngineRate is true, the samples are resampled to SampleRate.  
+        Returns the sample rate of the waveform.  Throws ReadError if the file cannot be read or is not supported.
+        Available only for Waveform. */
+    unsigned readFromFile( const char* filename, bool toEngineRate=true );
+    //! Write to a ".wav" file.  Available only for Waveform.
     void writeToFile( const char* filename );
-    //! Read from a ".wav" file in memory
-    void readFromMemory( const char* data, size_t size );
+    //! Read from a ".wav" file in memory.  See readFromFile.
+    unsigned readFromMemory( const char* data, size_t size, bool toEngineRate=true );
+
+    //! Build up to maxLevel band-limited copies, each at half the sample rate of the previous one.
+    /** Must be called after complete.  Stops early once a level gets very short, or for a cyclic waveform, 
+        once a level has odd length, since halving it would not preserve the period.  Levels already built 
+        are kept, and each new level is attached only once it is complete, so levels can be added as they 
+        turn out to be needed while mipLevelFor uses the existing ones.  Level k is the waveform decimated 
+        by 2^k, so times and loop points at level k are those at level 0 shifted right by k.  Levels have 
+        the same sample type as *this. */
+    void buildMipLevels( unsigned maxLevel );
+    //! Discard levels built by buildMipLevels
+    void clearMipLevels();
+    //! Append a coarser mip level that refers to first[0:n] without copying, as for method view.
+    /** Used to restore levels that buildMipLevels built earlier and that were saved elsewhere. */
+    void appendMipLevelView( const T* first, size_t n );
+    //! Next coarser mip level, or NULL if there is none.
+    const BasicWaveform* coarser() const {return myCoarser;}
+    //! Return coarsest mip level at which stepping by delta moves at most about one sample per step.
+    /** On return, delta is scaled to that level, and level is its number.  Returns *this if there are no mip levels. 
+        Only the links to levels finer than mipLevelsFor(delta) are read. */
+    const BasicWaveform& mipLevelFor( timeType& delta, unsigned& level ) const;
+    //! Number of the level that mipLevelFor would return for delta if there were enough levels.
+    static unsigned mipLevelsFor( timeType delta ) {
+        unsigned level = 0;
+        for( ; delta>unitTime; ++level )
+            delta = (delta+1)>>1;
+        return level;
+    }
 private:
-    class inputType;
-    void readFromInput( inputType& f );
+    //! Set *this to src lowpass-filtered to half its bandwidth and decimated by 2.
+    void decimate( const BasicWaveform& src );
     /** 0-> non-cyclic waveform (conceptually tailed by zeros).
         1-> cyclic waveform 
         2-> method complete has not been called yet */
     char myIsCyclic;
+    //! Next coarser mip level, or NULL.  Owned by *this.
+    BasicWaveform* myCoarser;
 };
 
+typedef BasicWaveform<float> Waveform;
+typedef BasicWaveform<int16_t> Waveform16;
+
+// WAV file I/O is defined only for Waveform.
+template<> unsigned Waveform::readFromFile( const char* filename, bool toEngineRate );
+template<> void Waveform::writeToFile( const char* filename );
+template<> unsigned Waveform::readFromMemory( const char* data, size_t size, bool toEngineRate );
+
 } // namespace Synthesizer
 
 #endif /* WaveForm_H */
\ No newline at end of file